@@ -22,6 +22,7 @@ extern struct vfs_ops ramfs_vfs_ops;
 extern struct vnode_ops ramfs_vnode_ops;
 extern struct ventry_ops ramfs_ventry_ops;
 static fs_type_t ramfs_type;
+static kmem_cache_t *ramfs_dirent_cache;
 
 
 static void ramfs_static_init() {
@@ -29,6 +30,7 @@ static void ramfs_static_init() {
   ramfs_type.vfs_ops = &ramfs_vfs_ops;
   ramfs_type.vnode_ops = &ramfs_vnode_ops;
   ramfs_type.ventry_ops = &ramfs_ventry_ops;
+  ramfs_dirent_cache = kmem_cache_create("ramfs_dirent", sizeof(ramfs_dirent_t), 0);
   if (fs_register_type(&ramfs_type) < 0) {
     DPRINTF("failed to register ramfs type\n");
   }
@@ -76,7 +78,7 @@ void ramfs_dir_remove(ramfs_node_t *dir, ramfs_dirent_t *dirent) {
 
 
 ramfs_dirent_t *ramfs_dirent_alloc(ramfs_node_t *node, cstr_t name) {
-  ramfs_dirent_t *dirent = kmallocz(sizeof(ramfs_dirent_t));
+  ramfs_dirent_t *dirent = kmem_cache_allocz(ramfs_dirent_cache);
   dirent->node = node;
   dirent->name = str_copy_cstr(name);
   return dirent;
@@ -84,7 +86,7 @@ ramfs_dirent_t *ramfs_dirent_alloc(ramfs_node_t *node, cstr_t name) {
 
 void ramfs_dirent_free(ramfs_dirent_t *dirent) {
   str_free(&dirent->name);
-  kfree(dirent);
+  kmem_cache_free(ramfs_dirent_cache, dirent);
 }
 
 ramfs_dirent_t *ramfs_dirent_lookup(ramfs_node_t *dir, cstr_t name) {
@@ -41,6 +41,8 @@
 #define SIZE_4KB  0x1000ULL
 #define SIZE_8KB  0x2000ULL
 #define SIZE_16KB 0x4000ULL
+#define SIZE_32KB 0x8000ULL
+#define SIZE_64KB 0x10000ULL
 #define SIZE_1MB  0x100000ULL
 #define SIZE_2MB  0x200000ULL
 #define SIZE_4MB  0x400000ULL
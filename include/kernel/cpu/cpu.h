@@ -77,8 +77,10 @@ typedef union cpuid_bits {
 
 #define CPUID_BIT_SSE3          _CPUID_BIT(ecx_0_1, 0)
 #define CPUID_BIT_DTES64        _CPUID_BIT(ecx_0_1, 2)
+#define CPUID_BIT_MONITOR       _CPUID_BIT(ecx_0_1, 3)
 #define CPUID_BIT_DS_CPL        _CPUID_BIT(ecx_0_1, 4)
 #define CPUID_BIT_SSSE3         _CPUID_BIT(ecx_0_1, 9)
+#define CPUID_BIT_PCID          _CPUID_BIT(ecx_0_1, 17)
 #define CPUID_BIT_SSE4_1        _CPUID_BIT(ecx_0_1, 19)
 #define CPUID_BIT_SSE4_2        _CPUID_BIT(ecx_0_1, 20)
 #define CPUID_BIT_X2APIC        _CPUID_BIT(ecx_0_1, 21)
@@ -90,12 +92,14 @@ typedef union cpuid_bits {
 
 #define CPUID_BIT_ARAT          _CPUID_BIT(eax_0_6, 2)
 
+#define CPUID_BIT_FSGSBASE      _CPUID_BIT(ebx_0_7, 0)
 #define CPUID_BIT_TSC_ADJUST    _CPUID_BIT(ebx_0_7, 1)
 #define CPUID_BIT_BMI1          _CPUID_BIT(ebx_0_7, 3)
 #define CPUID_BIT_HLE           _CPUID_BIT(ebx_0_7, 4)
 #define CPUID_BIT_AVX2          _CPUID_BIT(ebx_0_7, 5)
 #define CPUID_BIT_SMEP          _CPUID_BIT(ebx_0_7, 7)
 #define CPUID_BIT_BMI2          _CPUID_BIT(ebx_0_7, 8)
+#define CPUID_BIT_INVPCID       _CPUID_BIT(ebx_0_7, 10)
 #define CPUID_BIT_AVX512_F      _CPUID_BIT(ebx_0_7, 16)
 
 #define CPUID_BIT_UMIP          _CPUID_BIT(ecx_0_7, 2)
@@ -172,8 +176,14 @@ void cpu_load_gdt(void *gdt);
 void cpu_load_idt(void *idt);
 void cpu_load_tr(uint16_t tr);
 void cpu_flush_tlb();
+void cpu_invlpg(uintptr_t addr);
+void cpu_invpcid(uint64_t type, uint64_t pcid, uintptr_t addr);
 void cpu_reload_segments();
 
+void cpu_sti_hlt();
+void cpu_monitor(volatile void *addr);
+void cpu_sti_mwait();
+
 uint64_t cpu_read_msr(uint32_t msr);
 uint64_t cpu_write_msr(uint32_t msr, uint64_t value);
 
@@ -181,6 +191,8 @@ uint64_t cpu_read_tsc();
 
 uint64_t cpu_read_fsbase();
 void cpu_write_fsbase(uint64_t value);
+uint64_t __rdfsbase();
+void __wrfsbase(uint64_t value);
 uint64_t cpu_read_gsbase();
 void cpu_write_gsbase(uint64_t value);
 uint64_t cpu_read_kernel_gsbase();
@@ -197,6 +209,12 @@ void __write_cr4(uint64_t cr4);
 uint64_t __xgetbv(uint32_t index);
 void __xsetbv(uint32_t index, uint64_t value);
 
+void cpu_xsave(void *area, uint64_t mask);
+void cpu_xsaveopt(void *area, uint64_t mask);
+void cpu_xrstor(void *area, uint64_t mask);
+void cpu_fxsave(void *area);
+void cpu_fxrstor(void *area);
+
 int syscall(int call);
 noreturn void sysret(uintptr_t rip, uintptr_t rsp);
 
@@ -0,0 +1,32 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-21.
+//
+
+#ifndef KERNEL_CPU_FPU_H
+#define KERNEL_CPU_FPU_H
+
+#include <base.h>
+
+// extended processor state (x87, SSE and AVX registers)
+
+void fpu_init();
+
+void *fpu_alloc_area();
+void fpu_free_area(void *area);
+void fpu_copy_area(void *dest, void *src);
+
+void fpu_save(void *area);
+void fpu_restore(void *area);
+
+/**
+ * Kernel code which uses the vector registers must be wrapped in a
+ * kernel_fpu_begin/kernel_fpu_end section. The state of the current thread
+ * is saved on entry and restored on exit. Preemption is disabled for the
+ * duration of the section and it must not block, sleep or yield. The rest of
+ * the kernel is built with -mgeneral-regs-only, so vector code has to live in
+ * assembly or in a function with an explicit target attribute.
+ */
+void kernel_fpu_begin();
+void kernel_fpu_end();
+
+#endif
@@ -28,17 +28,19 @@ typedef struct __attribute__((aligned(128))) per_cpu {
   uint64_t rflags;
 
   uint32_t irq_level;
-  uint32_t : 32;
+  uint32_t spin_depth; // irq saving spinlocks held
 
   struct address_space *address_space;
   struct sched *sched;
   struct cpu_info *cpu_info;
   void *cpu_gdt;
   void *cpu_idt;
+  struct thread *prev_thread; // thread being switched away from
 } per_cpu_t;
 _Static_assert(sizeof(per_cpu_t) <= PER_CPU_SIZE, "");
 _Static_assert(offsetof(per_cpu_t, thread) == 0x10, "");
 _Static_assert(offsetof(per_cpu_t, process) == 0x18, "");
+_Static_assert(offsetof(per_cpu_t, prev_thread) == 0x68, "");
 
 #define __percpu_get_u16(offset) ({ register uint16_t v; __asm("mov %0, gs:%1" : "=r" (v) : "i" (offset)); v; })
 #define __percpu_get_u32(offset) ({ register uint32_t v; __asm("mov %0, gs:%1" : "=r" (v) : "i" (offset)); v; })
@@ -56,6 +58,7 @@ _Static_assert(offsetof(per_cpu_t, process) == 0x18, "");
 #define __percpu_get_user_sp() ((uintptr_t) __percpu_get_u64(offsetof(per_cpu_t, user_sp)))
 #define __percpu_get_rflags() __percpu_get_u64(offsetof(per_cpu_t, rflags))
 #define __percpu_get_irq_level() __percpu_get_u32(offsetof(per_cpu_t, irq_level))
+#define __percpu_get_spin_depth() __percpu_get_u32(offsetof(per_cpu_t, spin_depth))
 #define __percpu_get_address_space() ((struct address_space *) __percpu_get_u64(offsetof(per_cpu_t, address_space)))
 #define __percpu_get_sched() ((struct sched *) __percpu_get_u64(offsetof(per_cpu_t, sched)))
 #define __percpu_get_cpu_info() ((struct cpu_info *) __percpu_get_u64(offsetof(per_cpu_t, cpu_info)))
@@ -64,6 +67,7 @@ _Static_assert(offsetof(per_cpu_t, process) == 0x18, "");
 #define __percpu_set_thread(value) __percpu_set_u64(offsetof(per_cpu_t, thread), (uintptr_t) value)
 #define __percpu_set_process(value) __percpu_set_u64(offsetof(per_cpu_t, process), (uintptr_t) value)
 #define __percpu_set_rflags(value) __percpu_set_u64(offsetof(per_cpu_t, rflags), value)
+#define __percpu_set_spin_depth(value) __percpu_set_u32(offsetof(per_cpu_t, spin_depth), value)
 #define __percpu_set_address_space(value) __percpu_set_u64(offsetof(per_cpu_t, address_space), (uintptr_t) value)
 #define __percpu_set_sched(value) __percpu_set_u64(offsetof(per_cpu_t, sched), (uintptr_t) value)
 #define __percpu_set_cpu_info(value) __percpu_set_u64(offsetof(per_cpu_t, cpu_info), (uintptr_t) value)
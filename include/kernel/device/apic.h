@@ -320,8 +320,9 @@ void register_apic(uint8_t id);
 
 void apic_init();
 void apic_init_periodic(uint64_t ms);
-void apic_init_oneshot();
+void apic_init_oneshot(uint8_t vector);
 void apic_oneshot(uint64_t ms);
+void apic_oneshot_ns(uint64_t ns);
 void apic_udelay(uint64_t us);
 void apic_mdelay(uint64_t ms);
 void apic_send_eoi();
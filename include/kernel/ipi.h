@@ -14,6 +14,8 @@ typedef enum ipi_type {
   IPI_PANIC,
   IPI_INVLPG,
   IPI_SCHEDULE,
+  IPI_TIMESLICE,
+  IPI_PCP_DRAIN,
   IPI_NOOP,
   //
   NUM_IPIS,
@@ -31,4 +33,11 @@ typedef void (*ipi_handler_t)(uint64_t data);
 int ipi_deliver_cpu_id(ipi_type_t type, uint8_t cpu_id, uint64_t data);
 int ipi_deliver_mode(ipi_type_t type, ipi_mode_t mode, uint64_t data);
 
+/**
+ * Handles any shootdowns sent to the current cpu without waiting for the
+ * interrupt. This must be called by cpus that spin with interrupts disabled
+ * while waiting on other cpus.
+ */
+void ipi_poll_invlpg();
+
 #endif
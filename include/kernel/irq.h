@@ -15,6 +15,7 @@ typedef void (*irq_handler_t)(uint8_t, void *);
 typedef void (*exception_handler_t)(uint8_t, uint32_t, cpu_irq_stack_t *, cpu_registers_t *);
 
 extern uint8_t ipi_vectornum;
+extern uint8_t timer_vectornum;
 
 
 void irq_early_init();
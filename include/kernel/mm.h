@@ -9,6 +9,8 @@
 #include <mm_types.h>
 #include <mm/heap.h>
 #include <mm/pmalloc.h>
+#include <mm/slab.h>
+#include <mm/tlb.h>
 #include <mm/vmalloc.h>
 #include <mm/init.h>
 
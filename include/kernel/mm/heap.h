@@ -10,45 +10,80 @@
 #include <mutex.h>
 #include <string.h>
 
-// TODO: switch to better allocator for large sizes
 #define CHUNK_MIN_SIZE   8
-#define CHUNK_MAX_SIZE   524288
+#define CHUNK_MAX_SIZE   524256 // largest size for which the next prev_offset fits in 16 bits
 #define CHUNK_SIZE_ALIGN 8
 #define CHUNK_MIN_ALIGN  4
+#define CHUNK_LARGE_SIZE SIZE_64KB // requests of this size or more get their own mapping
 
 #define CHUNK_MAGIC 0xC0DE
-#define HOLE_MAGIC 0xDEAD
+#define LARGE_CHUNK_MAGIC 0xB16C
+#define HEAP_MAGIC 0x48454150 // 'HEAP'
+
+// free chunks are kept in segregated bins. the small bins hold a single size
+// (8-512 in steps of 8) while the large bins each cover a power of two range
+#define HEAP_SMALL_BIN_MAX 512
+#define HEAP_NUM_SMALL_BINS (HEAP_SMALL_BIN_MAX / CHUNK_SIZE_ALIGN)
+#define HEAP_NUM_LARGE_BINS 10
+#define HEAP_NUM_BINS (HEAP_NUM_SMALL_BINS + HEAP_NUM_LARGE_BINS)
+
+// additional heap regions are each backed by a single big page
+#define HEAP_REGION_SIZE SIZE_2MB
+#define HEAP_MAX_REGIONS 4096 // size of the region registry (power of two)
+#define HEAP_SHARED_CPU  UINT32_MAX
 
 typedef struct page page_t;
 
 typedef struct mm_chunk {
   uint16_t magic;                   // magic number
-  uint16_t prev_offset;             // offset to previous chunk
+  uint16_t prev_offset;             // offset to previous chunk (in units of CHUNK_SIZE_ALIGN)
   uint32_t size : 31;               // size of chunk
   uint32_t free : 1;                // chunk free/used
   LIST_ENTRY(struct mm_chunk) list; // links to free chunks (if free)
 } mm_chunk_t;
 static_assert(sizeof(mm_chunk_t) == 24);
 
+typedef struct mm_large_chunk {
+  uint16_t magic;                   // magic number
+  uint16_t offset;                  // offset of the data from the start of the mapping
+  uint32_t size;                    // requested size
+  page_t *pages;                    // backing pages
+  uint64_t reserved;
+} mm_large_chunk_t;
+static_assert(sizeof(mm_large_chunk_t) == sizeof(mm_chunk_t));
+
 typedef struct mm_heap {
+  uint32_t magic;               // magic number
   uintptr_t phys_addr;          // physical address of heap
   uintptr_t virt_addr;          // virtual address of heap base
   page_t *pages;                // pages representing the heap
   mm_chunk_t *last_chunk;       // the last created chunk
-  LIST_HEAD(mm_chunk_t) chunks; // linked list of free chunks
+  LIST_HEAD(mm_chunk_t) bins[HEAP_NUM_BINS]; // segregated lists of free chunks
+  uint64_t bin_map[2];          // bitmap of non-empty bins
   mutex_t lock;                 // heap lock (must be held to alloc/free)
+  uint32_t cpu_id;              // owning cpu (or HEAP_SHARED_CPU)
+  mm_chunk_t *remote_free;      // chunks freed by other cpus (arenas only)
+  struct mm_heap *next;         // next region in the chain
 
   size_t size;                  // the size of the heap
   size_t used;                  // the total number of bytes used
   struct {
     size_t alloc_count;         // the number of times malloc was called
     size_t free_count;          // the number of times free was called
+    size_t remote_free_count;   // the number of chunks freed by other cpus
     size_t alloc_sizes[9];      // a histogram of alloc request sizes
+    size_t bin_chunks[HEAP_NUM_BINS]; // the number of free chunks in each bin
+    size_t bin_bytes[HEAP_NUM_BINS];  // the number of free bytes in each bin
+    size_t large_alloc_count;   // the number of large objects allocated
+    size_t large_free_count;    // the number of large objects freed
+    size_t large_used;          // the total number of bytes mapped for large objects
   } stats;
 } mm_heap_t;
+static_assert(HEAP_NUM_BINS <= 128);
 
 void mm_init_kheap();
 void kheap_init();
+void kheap_init_cpu_arena();
 
 void *kmalloc(size_t size) __malloc_like;
 void *kmallocz(size_t size) __malloc_like;
@@ -10,17 +10,52 @@
 
 void early_init_pgtable();
 void *early_map_entries(uintptr_t virt_addr, uintptr_t phys_addr, size_t count, uint32_t flags);
+/**
+ * Maps all physical memory below phys_top at PHYS_MAP_VA using the largest
+ * supported page size. The map is part of the kernel half of the page tables
+ * so it is shared by every address space.
+ */
+void early_init_phys_map(uintptr_t phys_top);
 
 void init_recursive_pgtable(uint64_t *table_virt, uintptr_t table_phys);
 void pgtable_unmap_user_mappings();
 uint64_t *recursive_map_entry(uintptr_t virt_addr, uintptr_t phys_addr, uint32_t flags, page_t **out_pages);
 void recursive_unmap_entry(uintptr_t virt_addr, uint32_t flags);
+/**
+ * Maps count pages of the size given by flags to the physically contiguous
+ * frames starting at phys_addr. The tables are walked once per run of entries
+ * in the same table and any tables that had to be created are returned through
+ * out_pages. Returns the size of the mapped range.
+ */
+size_t recursive_map_range(uintptr_t virt_addr, uintptr_t phys_addr, size_t count, uint32_t flags, page_t **out_pages);
+/**
+ * Clears count consecutive entries of the size given by flags. The tables must
+ * exist and the caller is responsible for invalidating the tlb entries.
+ */
+void recursive_unmap_range(uintptr_t virt_addr, size_t count, uint32_t flags);
+
+/** Returns true if the address is mapped by a 2MB page. */
+bool recursive_is_bigpage(uintptr_t virt_addr);
+/** Returns true if a 2MB page can be mapped at the (aligned) address. */
+bool recursive_can_map_bigpage(uintptr_t virt_addr);
+/**
+ * Replaces the 2MB page mapping the address with a page table of 4K entries
+ * that map the same frames with the same flags. The caller must invalidate the
+ * old tlb entry and take ownership of the returned table page.
+ */
+page_t *recursive_split_bigpage(uintptr_t virt_addr);
 
 uintptr_t get_current_pgtable();
 void set_current_pgtable(uintptr_t table_phys);
 size_t pg_flags_to_size(uint32_t flags);
 
 uintptr_t create_new_ap_page_tables(page_t **out_pages);
-uintptr_t deepcopy_fork_page_tables(page_t **out_pages);
+/**
+ * Creates a copy of the current page tables for a forked address space. The
+ * kernel entries are shared and the user paging structures are duplicated, but
+ * the pages they map are not. Returns the physical address of the new PML4 and
+ * the list of table pages through out_pages.
+ */
+uintptr_t fork_page_tables(page_t **out_pages);
 
 #endif
@@ -10,6 +10,12 @@
 
 void init_mem_zones();
 
+/**
+ * Returns the page descriptor for the frame containing the given physical
+ * address, or NULL if the address is not covered by the mem_map.
+ */
+page_t *phys_to_page(uintptr_t addr);
+
 /**
  * Allocates one or more pages of physical memory from the specified zone.
  *
@@ -23,7 +29,9 @@ page_t *_alloc_pages_zone(mem_zone_type_t zone_type, size_t count, uint32_t flag
 /**
  * Allocates one or more pages of physical memory. The pages are allocated
  * from the zones in the following order: ZONE_TYPE_HIGH, ZONE_TYPE_NORMAL,
- * ZONE_TYPE_DMA.
+ * ZONE_TYPE_DMA. Single 4k pages are served from the per-cpu page cache.
+ * If PG_ZERO is set the pages are zeroed, and single 4k pages are taken from
+ * the pre-zeroed page pool when possible.
  *
  * @param count The number of pages to allocate.
  * @param flags Page flags.
@@ -31,6 +39,12 @@ page_t *_alloc_pages_zone(mem_zone_type_t zone_type, size_t count, uint32_t flag
  */
 page_t *_alloc_pages(size_t count, uint32_t flags);
 
+/**
+ * Same as _alloc_pages but returns NULL instead of panicking when there is
+ * not enough memory to satisfy the request.
+ */
+page_t *_try_alloc_pages(size_t count, uint32_t flags);
+
 /**
  * Allocates one or more pages of physical memory starting at the specified
  * physical address.
@@ -50,8 +64,22 @@ page_t *_alloc_pages_at(uintptr_t address, size_t count, uint32_t flags);
  */
 int _reserve_pages(uintptr_t address, size_t count);
 
+/**
+ * Frees one or more pages of physical memory. Single 4k pages are returned
+ * to the per-cpu page cache and are only released to their zone in batches.
+ *
+ * @param pages The list of page_t structures to free.
+ */
 void _free_pages(page_t *pages);
 
+void pmalloc_dump_stats();
+
+/**
+ * Releases every frame in the current cpu's page cache back to its zone if
+ * another cpu has asked for it. Called from the ipi handler.
+ */
+void pcp_drain_handler();
+
 bool mm_is_kernel_code_ptr(uintptr_t ptr);
 bool mm_is_kernel_data_ptr(uintptr_t ptr);
 
@@ -0,0 +1,81 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-02.
+//
+
+#ifndef KERNEL_MM_SLAB_H
+#define KERNEL_MM_SLAB_H
+
+#include <base.h>
+#include <queue.h>
+#include <spinlock.h>
+
+#define KMEM_MAGAZINE_SIZE  15
+#define KMEM_MAGAZINE_BATCH 8
+#define KMEM_MAX_OBJ_SIZE   (PAGE_SIZE / 8)
+
+typedef struct page page_t;
+typedef struct kmem_cache kmem_cache_t;
+
+typedef struct kmem_slab {
+  kmem_cache_t *cache;              // owning cache
+  page_t *page;                     // backing page
+  void *free;                       // list of free objects
+  uint16_t inuse;                   // number of allocated objects
+  LIST_ENTRY(struct kmem_slab) list;
+} kmem_slab_t;
+
+typedef struct __aligned(64) kmem_magazine {
+  size_t count;                     // number of cached objects
+  void *objs[KMEM_MAGAZINE_SIZE];   // cached objects
+  struct {
+    size_t alloc_hits;              // allocations served from the magazine
+    size_t alloc_misses;            // allocations which required a refill
+    size_t free_hits;               // frees absorbed by the magazine
+    size_t free_misses;             // frees which required a flush
+  } stats;
+} kmem_magazine_t;
+
+typedef struct kmem_cache {
+  const char *name;                 // cache name
+  size_t obj_size;                  // object size (including alignment)
+  size_t obj_align;                 // object alignment
+  size_t objs_per_slab;             // number of objects in a slab
+
+  spinlock_t lock;                  // slab list lock
+  LIST_HEAD(kmem_slab_t) partial;   // slabs with some free objects
+  LIST_HEAD(kmem_slab_t) full;      // slabs with no free objects
+  LIST_HEAD(kmem_slab_t) empty;     // slabs with only free objects
+
+  size_t num_slabs;                 // number of slabs owned by the cache
+  size_t num_empty;                 // number of slabs in the empty list
+  size_t num_inuse;                 // number of objects outside of the slabs
+
+  kmem_magazine_t *magazines;       // per-cpu object magazines
+  LIST_ENTRY(struct kmem_cache) list;
+} kmem_cache_t;
+
+/**
+ * Creates a new object cache for objects of the given size and alignment.
+ * The size must not be larger than KMEM_MAX_OBJ_SIZE.
+ *
+ * @param name The cache name (not owning).
+ * @param size The object size.
+ * @param alignment The object alignment (0 for the default alignment).
+ * @return The new cache.
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t alignment);
+
+/**
+ * Destroys an object cache and releases all of its slabs. Every object
+ * must have been freed back to the cache and the cache must not be in use
+ * by any other cpu.
+ */
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+void *kmem_cache_alloc(kmem_cache_t *cache) __malloc_like;
+void *kmem_cache_allocz(kmem_cache_t *cache) __malloc_like;
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+void kmem_cache_dump_stats();
+
+#endif
@@ -0,0 +1,62 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-10.
+//
+
+#ifndef KERNEL_MM_TLB_H
+#define KERNEL_MM_TLB_H
+
+#include <base.h>
+#include <mm_types.h>
+
+#define TLB_BATCH_SIZE 32 // max pages invalidated one at a time per batch
+
+typedef struct tlb_batch {
+  address_space_t *space;          // address space of the batched pages
+  size_t count;                    // number of batched pages
+  bool flush_all;                  // batch overflowed (flush the whole tlb)
+  uintptr_t pages[TLB_BATCH_SIZE]; // batched page addresses
+  volatile uint64_t pending;       // cpus which have not finished the shootdown
+} tlb_batch_t;
+
+typedef struct tlb_pcid {
+  uint16_t pcid;                   // assigned pcid (0 if never loaded)
+  uint64_t pcid_gen;               // cpu pcid generation the pcid belongs to
+  uint64_t tlb_gen;                // address space tlb_gen when last loaded
+} tlb_pcid_t;
+
+/**
+ * Queues the invalidation of a single mapped page (of any size) in the given
+ * address space. The invalidation does not take effect until tlb_flush_batch
+ * is called. If the batch fills up, it is converted into a full tlb flush.
+ */
+void tlb_invalidate_page(address_space_t *space, uintptr_t virt_addr);
+
+/**
+ * Queues the invalidation of every 4K page in the range. Ranges which do not
+ * fit in the remaining batch turn it into a full tlb flush.
+ */
+void tlb_invalidate_range(address_space_t *space, uintptr_t virt_addr, size_t size);
+
+/**
+ * Invalidates every page in the current cpu's batch on this cpu and on all
+ * other cpus which have the address space loaded. Each remote cpu receives
+ * one IPI per batch and this function returns once all of them are done.
+ */
+void tlb_flush_batch();
+
+void tlb_shootdown_handler(tlb_batch_t *batch);
+
+/**
+ * Loads the page tables of the given address space on the current cpu. When
+ * PCIDs are supported, the address space keeps a pcid per cpu and cr3 is written
+ * without flushing the tlb unless the space's entries may be stale. The caller
+ * must have set this cpu's bit in the address space cpu_mask.
+ */
+void tlb_load_address_space(address_space_t *space);
+
+/**
+ * Allocates the per-cpu pcid state for a new address space.
+ */
+tlb_pcid_t *tlb_alloc_pcids();
+
+#endif
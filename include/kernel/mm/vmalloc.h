@@ -14,6 +14,12 @@ void init_address_space();
 void init_ap_address_space();
 uintptr_t make_ap_page_tables();
 address_space_t *new_address_space();
+/**
+ * Creates a copy-on-write fork of the current user address space. The
+ * anonymous pages are write protected and shared between both address
+ * spaces until either of them writes to a page. Page list mappings are
+ * shared as is, so anything a process may write to must be anonymous.
+ */
 address_space_t *fork_address_space();
 
 void *_vmap_pages(page_t *pages);
@@ -26,6 +32,21 @@ void *_vmap_reserved_shortlived(vm_mapping_t *mapping, page_t *pages);
 void *_vmap_stack_pages(page_t *pages);
 void *_vmap_mmio(uintptr_t phys_addr, size_t size, uint32_t flags);
 
+/**
+ * Reserves a demand paged anonymous mapping. No memory is allocated up front,
+ * instead each page is allocated and zeroed by the page fault handler the first
+ * time it is touched. The mapping is released with _vunmap_addr. If PG_BIGPAGE
+ * is given, a fault in an untouched 2MB aligned span backs the whole span with a
+ * single big page instead.
+ *
+ * @param size The mapping size (must be a multiple of PAGE_SIZE).
+ * @param flags The page flags used for the faulted pages.
+ * @param name The mapping name (or NULL).
+ * @return The new mapping.
+ */
+vm_mapping_t *_vmap_anon(size_t size, uint32_t flags, const char *name);
+vm_mapping_t *_vmap_anon_addr(uintptr_t virt_addr, size_t size, uint32_t flags, const char *name);
+
 vm_mapping_t *_vmap_reserve(uintptr_t virt_addr, size_t size);
 vm_mapping_t *_vmap_reserve_range(size_t size, uintptr_t hint);
 
@@ -33,6 +54,7 @@ void _vunmap_pages(page_t *pages);
 void _vunmap_addr(uintptr_t virt_addr, size_t size);
 
 vm_mapping_t *_vmap_get_mapping(uintptr_t virt_addr);
+vm_mapping_t *_address_space_get_mapping(address_space_t *space, uintptr_t virt_addr);
 uintptr_t _vm_virt_to_phys(uintptr_t virt_addr);
 page_t *_vm_virt_to_page(uintptr_t virt_addr);
 
@@ -43,8 +65,33 @@ void vfree_pages(page_t *pages);
 
 void _address_space_print_mappings(address_space_t *space);
 void _address_space_to_graphiz(address_space_t *space);
+void vm_dump_stats();
 void vm_print_debug_address_space();
 
 #define virt_to_phys_addr(addr) (_vm_virt_to_phys((uintptr_t)(addr)))
 
+//
+// Direct Map
+//
+// All of physical memory is permanently mapped at PHYS_MAP_VA, so the kernel
+// can reach any frame without creating a mapping or flushing the tlb. Frames
+// that need a different memory type (such as uncached dma buffers) must still
+// be mapped through vmalloc.
+//
+
+extern size_t phys_map_size;
+
+#define is_phys_map_addr(addr) \
+  ((uintptr_t)(addr) >= PHYS_MAP_VA && (uintptr_t)(addr) < PHYS_MAP_VA + phys_map_size)
+
+/** Returns the direct mapped address of a physical address. */
+static inline void *phys_to_virt(uintptr_t phys_addr) {
+  return (void *) (PHYS_MAP_VA + phys_addr);
+}
+
+/** Returns the physical address of a direct mapped address. */
+static inline uintptr_t virt_to_phys(const void *virt_addr) {
+  return (uintptr_t) virt_addr - PHYS_MAP_VA;
+}
+
 #endif
@@ -0,0 +1,28 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-12.
+//
+
+#ifndef KERNEL_MM_ZEROPOOL_H
+#define KERNEL_MM_ZEROPOOL_H
+
+#include <base.h>
+#include <mm_types.h>
+
+#define ZERO_POOL_MAX      512   // max number of pre-zeroed frames
+#define ZERO_POOL_BATCH    16    // frames zeroed per refill
+
+/**
+ * Takes a single pre-zeroed 4K page from the pool. The page looks exactly like
+ * one returned by _alloc_pages(1, flags). Returns NULL if the pool is empty.
+ */
+page_t *zero_pool_alloc(uint32_t flags);
+
+/**
+ * Zeroes a single batch of frames into the pool if it is not full. This is
+ * called from the idle loop and returns true if any work was done.
+ */
+bool zero_pool_idle_refill();
+
+void zero_pool_dump_stats();
+
+#endif
@@ -29,8 +29,8 @@ struct vm_mapping;
 struct mem_zone;
 
 struct intvl_tree;
+struct tlb_pcid;
 struct file;
-struct bitmap;
 
 // page flags
 #define PG_USED       (1 << 0)
@@ -61,6 +61,7 @@ typedef struct page {
       uint32_t raw;
     } reserved;
   };
+  uint32_t refcount;             // number of address spaces sharing the page
   struct vm_mapping *mapping;    // virtual mapping
   struct mem_zone *zone;         // owning memory zone
   SLIST_ENTRY(struct page) next;
@@ -85,18 +86,32 @@ typedef struct address_space {
 
   uintptr_t page_table;
   LIST_HEAD(struct page) table_pages;
+  volatile uint64_t cpu_mask;  // cpus which have the address space loaded
+  volatile uint64_t tlb_gen;   // bumped whenever pages are invalidated
+  struct tlb_pcid *pcids;      // per-cpu process-context identifiers
+
+  struct {
+    size_t major_faults;       // faults which allocated a new page
+    size_t minor_faults;       // faults resolved without allocating a page
+    size_t mapped_4k;          // bytes mapped with 4k pages
+    size_t mapped_2mb;         // bytes mapped with 2mb pages
+    size_t mapped_1gb;         // bytes mapped with 1gb pages
+    size_t promotions;         // 2mb spans mapped with a big page instead of 4k pages
+    size_t splits;             // big pages split back into 4k pages
+  } stats;
 } address_space_t;
 
 // vm types
 #define VM_TYPE_PHYS   0 // direct physical mapping
 #define VM_TYPE_PAGE   1 // mapped page structures
-#define VM_TYPE_ANON   2 // mmap'd anonymous memory
+#define VM_TYPE_ANON   2 // demand paged anonymous memory
 #define VM_TYPE_RSVD   3 // reserved memory
 
 // vm attributes
 #define VM_ATTR_USER        (1 << 0) // region is in user space
 #define VM_ATTR_RESERVED    (1 << 1) // region is reserved
 #define VM_ATTR_MMIO        (1 << 2) // region is memory-mapped I/O
+#define VM_ATTR_BIGPAGE     (1 << 3) // anonymous region may be faulted in with big pages
 
 typedef struct vm_mapping {
   uint64_t address;    // virtual address
@@ -113,7 +128,8 @@ typedef struct vm_mapping {
   union {
     void *ptr;
     uint64_t phys;     // VM_TYPE_PHYS
-    struct page *page; // VM_TYPE_PAGE|VM_TYPE_ANON
+    struct page *page; // VM_TYPE_PAGE
+    struct page **pages; // VM_TYPE_ANON (indexed by page offset)
   } data;
 } vm_mapping_t;
 
@@ -137,7 +153,10 @@ typedef struct mem_zone {
   size_t size;
 
   spinlock_t lock;
-  struct bitmap *frames;
+  size_t free_pages;         // number of free 4k frames in the zone
+  uintptr_t buddy_base;      // naturally aligned base address of the buddy tree
+  uint8_t buddy_order;       // order of the buddy tree root
+  uint8_t *buddy_tree;       // buddy tree nodes (largest free order + 1)
   LIST_ENTRY(struct mem_zone) list;
 } mem_zone_t;
 
@@ -148,6 +167,7 @@ typedef struct mem_zone {
 #define KERNEL_SPACE_START  0xFFFF800000000000ULL
 #define KERNEL_SPACE_END    0xFFFFFFFFFFFFFFFFULL
 
+#define PHYS_MAP_VA         0xFFFF800000000000ULL // direct map of physical memory
 #define FRAMEBUFFER_VA      0xFFFFC00000000000ULL
 #define MMIO_BASE_VA        0xFFFFC00200000000ULL
 #define KERNEL_HEAP_VA      0xFFFFFF8000400000ULL
@@ -156,5 +176,6 @@ typedef struct mem_zone {
 
 #define KERNEL_HEAP_SIZE   (SIZE_4MB + SIZE_2MB)
 #define KERNEL_STACK_SIZE  SIZE_16KB
+#define PHYS_MAP_MAX_SIZE  (FRAMEBUFFER_VA - PHYS_MAP_VA)
 
 #endif
@@ -96,6 +96,8 @@
  *
  *         'f'             - floating point number (double)
  *         'F'             - floating point number capitalized
+ *                           (the kernel is built without floating point so
+ *                            these can not be passed from kernel code)
  *
  *         's'             - string
  *         'c'             - character
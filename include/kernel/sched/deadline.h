@@ -0,0 +1,18 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-19.
+//
+
+#ifndef KERNEL_SCHED_DEADLINE_H
+#define KERNEL_SCHED_DEADLINE_H
+
+#include <sched/sched.h>
+
+#define DEADLINE_BW_SHIFT      20
+#define DEADLINE_MAX_BW        ((95ULL << DEADLINE_BW_SHIFT) / 100) // admissible bandwidth per cpu
+#define DEADLINE_MIN_BUDGET    US_TO_NS(100)  // smallest budget which can be reserved
+#define DEADLINE_MAX_PERIOD    MS_TO_NS(1000) // longest period which can be reserved
+#define DEADLINE_MIN_RUNTIME   US_TO_NS(20)   // budget left over which is not worth running
+
+extern sched_policy_impl_t sched_policy_deadline;
+
+#endif
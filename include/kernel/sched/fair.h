@@ -0,0 +1,17 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-18.
+//
+
+#ifndef KERNEL_SCHED_FAIR_H
+#define KERNEL_SCHED_FAIR_H
+
+#include <sched/sched.h>
+
+#define FAIR_LATENCY            MS_TO_NS(12) // period in which every ready thread runs once
+#define FAIR_MIN_GRANULARITY    MS_TO_NS(2)  // shortest time slice handed out
+#define FAIR_WAKEUP_GRANULARITY MS_TO_NS(1)  // vruntime lead needed to preempt on wakeup
+#define FAIR_BASE_WEIGHT        1024         // weight of a priority 0 thread
+
+extern sched_policy_impl_t sched_policy_fair;
+
+#endif
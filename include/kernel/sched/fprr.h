@@ -7,6 +7,8 @@
 
 #include <sched/sched.h>
 
+#define FPRR_NUM_PRIORITIES 64 // higher priorities share the top level
+
 extern sched_policy_impl_t sched_policy_fprr;
 
 #endif
@@ -9,16 +9,22 @@
 #include <queue.h>
 #include <spinlock.h>
 
-#define SCHED_COUNT_CACHE_AFFINITY_THRES  50
+#define SCHED_BALANCE_INTERVAL  MS_TO_NS(10) // min time between periodic load balancing
+#define SCHED_DEFAULT_TIMESLICE MS_TO_NS(10) // time slice of policies which dont give one
+#define SCHED_MIN_TIMESLICE     US_TO_NS(50) // shortest time the preemption timer is armed for
+#define SCHED_MAX_TIMESLICE     MS_TO_NS(1000) // longest time the preemption timer is armed for
 
 // scheduling policies
-#define POLICY_SYSTEM 0
-#define POLICY_DRIVER 1
-#define NUM_POLICIES 2
+#define POLICY_DEADLINE 0
+#define POLICY_SYSTEM   1
+#define POLICY_DRIVER   2
+#define POLICY_FAIR     3
+#define NUM_POLICIES 4
 
 typedef struct thread thread_t;
 typedef struct process process_t;
 typedef struct sched sched_t;
+typedef struct sched_opts sched_opts_t;
 
 typedef enum sched_cause {
   SCHED_BLOCKED,        // current thread was blocked
@@ -43,10 +49,15 @@ typedef struct sched_policy_impl {
   int (*on_thread_timeslice_start)(void *self, thread_t *thread);
   int (*on_thread_timeslice_end)(void *self, thread_t *thread);
   int (*on_thread_migrate_cpu)(void *self, thread_t *thread, uint8_t new_cpu);
+  int (*on_reschedule_unlocked)(void *self); /* called on the cpu after it unlocks the scheduler */
+  thread_t *(*get_migratable_thread)(void *self, uint8_t cpu_id);
+  clock_t (*get_thread_timeslice)(void *self, thread_t *thread);
 
   /* static (optional) */
+  int (*policy_admit_thread)(thread_t *thread, sched_opts_t *opts);
+  int (*policy_setup_thread)(thread_t *thread, sched_opts_t *opts);
   bool (*should_thread_preempt_same_policy)(thread_t *active, thread_t *other);
-  double (*compute_thread_cpu_affinity_score)(thread_t *thread);
+  uint64_t (*compute_thread_cpu_affinity_score)(sched_t *sched, thread_t *thread);
 } sched_policy_impl_t;
 
 typedef struct sched_stats {
@@ -65,6 +76,8 @@ typedef struct sched_opts {
   uint8_t policy;
   uint16_t priority;
   int affinity;
+  clock_t period; // reservation period (POLICY_DEADLINE)
+  clock_t budget; // runtime per period (POLICY_DEADLINE)
 } sched_opts_t;
 
 typedef struct sched {
@@ -72,12 +85,16 @@ typedef struct sched {
   spinlock_t lock;      // scheduler lock
 
   size_t ready_count;   // number of ready threads
+  bool throttled;       // every ready thread was throttled by its policy at the last pick
   size_t blocked_count; // number of blocked or sleeping threads
   size_t total_count;   // total number of 'owned' threads
-  clock_t idle_time;    // amount of time spent idling
+  clock_t idle_time;    // amount of time spent sleeping in the idle thread
+  clock_t last_balance; // time of the last load balancing pass
+  clock_t slice_end;    // end of the active time slice (0 if the timer is not armed)
 
   thread_t *active;     // active thread
   thread_t *idle;       // idle thread
+  volatile bool idle_polling; // idle thread is waiting on ready_count with mwait
 
   LIST_HEAD(thread_t) blocked;
   struct {
@@ -97,5 +114,11 @@ int sched_sleep(uint64_t ns);
 int sched_yield();
 
 int sched_reschedule(sched_cause_t reason);
+int sched_reschedule_remote(sched_cause_t reason);
+int sched_reschedule_pending();
+void sched_timer_handler();
+void sched_timer_update();
+
+void sched_dump_stats();
 
 #endif
@@ -7,20 +7,45 @@
 
 #include <base.h>
 
+// #define SPINLOCK_DEBUG
+
+struct spin_node;
+
+/*
+ * Queued (MCS) spinlock. Waiters are queued up in order and each one spins
+ * on its own per-cpu queue node, which the previous owner hands the lock to.
+ * A cpu which already holds a lock with interrupts disabled can lock it
+ * again without blocking.
+ */
 typedef struct spinlock {
-  volatile uint8_t locked;
-  uint8_t locked_by;
-  uint16_t lock_count;
+  struct spin_node *volatile tail; // last node in the queue (NULL if unlocked)
+  struct spin_node *node;          // queue node of the owner
+  volatile uint16_t owner;         // id + 1 of the owning cpu (0 if unlocked)
+  uint16_t lock_count;             // re-entrant lock count
+#ifdef SPINLOCK_DEBUG
+  uintptr_t locked_at;             // return address of the outermost lock
+#endif
 } spinlock_t;
 
 void spin_init(spinlock_t *lock);
+
+/* interrupts are disabled while the lock is held */
 int spin_lock(spinlock_t *lock);
 int spin_trylock(spinlock_t *lock);
 int spin_unlock(spinlock_t *lock);
 
+/* preemption is disabled while the lock is held but interrupts are left
+ * alone. these must only be used for locks never taken by interrupt handlers
+ * and are not re-entrant */
+int spin_lock_noirq(spinlock_t *lock);
+int spin_trylock_noirq(spinlock_t *lock);
+int spin_unlock_noirq(spinlock_t *lock);
+
 int spin_getowner(spinlock_t *lock);
 
 #define SPIN_LOCK(lock) __type_checked(spinlock_t *, lock, spin_lock(lock))
 #define SPIN_UNLOCK(lock) __type_checked(spinlock_t *, lock, spin_unlock(lock))
+#define SPIN_LOCK_NOIRQ(lock) __type_checked(spinlock_t *, lock, spin_lock_noirq(lock))
+#define SPIN_UNLOCK_NOIRQ(lock) __type_checked(spinlock_t *, lock, spin_unlock_noirq(lock))
 
 #endif
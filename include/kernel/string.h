@@ -43,5 +43,6 @@ void *__memset_slow(void *dest, int val, size_t len);
 void *__memset8(void *dest, uint8_t val, size_t len);
 void *__memset32(void *dest, uint32_t val, size_t len);
 void *__memset64(void *dest, uint64_t val, size_t len);
+void __memzero_nt(void *dest, size_t len);
 
 #endif
@@ -11,13 +11,13 @@
 
 #define ERRNO (PERCPU_THREAD->errno)
 
-#define USER_VSTACK_SIZE  0x20000  // 128 KiB
-#define USER_PSTACK_SIZE  0x20000  // 128 KiB
+#define USER_VSTACK_SIZE  0x200000 // 2 MiB (demand paged)
 #define TLS_SIZE          0x2000   // 8 KiB
 #define DEFAULT_RFLAGS 0x246
 
 typedef struct process process_t;
 typedef struct page page_t;
+typedef struct vm_mapping vm_mapping_t;
 typedef struct sched_stats sched_stats_t;
 
 // thread flags
@@ -25,6 +25,7 @@ typedef struct sched_stats sched_stats_t;
 #define F_THREAD_JOINING    0x2 // thread will join
 #define F_THREAD_DETATCHING 0x4 // thread will detatch
 #define F_THREAD_CREATED    0x8 // thread was just created
+#define F_THREAD_KERNEL_FPU 0x10 // thread is in a kernel fpu section
 
 typedef enum thread_status {
   THREAD_READY,
@@ -67,13 +68,14 @@ typedef struct thread_meta_ctx {
 
 typedef struct thread {
   id_t tid;                    // thread id
-  uint32_t reserved;           // reserved
+  volatile uint32_t on_cpu;    // context is in use by a cpu
   thread_ctx_t *ctx;           // thread context
   thread_meta_ctx_t *mctx;     // thread meta context
   process_t *process;          // owning process
   tls_block_t *tls;            // thread local storage
   uintptr_t kernel_sp;         // kernel stack pointer
   uintptr_t user_sp;           // user stack pointer
+  void *fpu;                   // extended state save area
   // !!! DO NOT CHANGE ABOVE HERE !!!
   // assembly code in thread.asm accesses these fields using known offsets
 
@@ -94,10 +96,12 @@ typedef struct thread {
   char *name;                  // thread name or description (owning)
   int errno;                   // thread local errno
   int preempt_count;           // preempt disable counter
+  int resched_pending;         // deferred reschedule reason + 1 (0 if none)
+  bool wake_pending;           // unblocked before it got to block
   void *data;                  // thread data pointer
 
   page_t *kernel_stack;        // kernel stack pages
-  page_t *user_stack;          // user stack pages
+  vm_mapping_t *user_stack;    // user stack mapping
 
   LIST_ENTRY(thread_t) group;  // thread group (threads from same process)
   LIST_ENTRY(thread_t) list;   // generic thread list (used by scheduler, mutex, cond, etc)
@@ -105,6 +109,7 @@ typedef struct thread {
 static_assert(offsetof(thread_t, tid) == 0x00);
 static_assert(offsetof(thread_t, process) == 0x18);
 static_assert(offsetof(thread_t, user_sp) == 0x30);
+static_assert(offsetof(thread_t, fpu) == 0x38);
 
 thread_t *thread_alloc(id_t tid, void *(start_routine)(void *), void *arg, bool user);
 thread_t *thread_copy(thread_t *other);
@@ -124,6 +129,7 @@ int thread_setpolicy(uint8_t policy);
 int thread_setpriority(uint16_t priority);
 int thread_setaffinity(uint8_t affinity);
 int thread_setsched(uint8_t policy, uint16_t priority);
+int thread_setdeadline(clock_t period, clock_t budget);
 
 void preempt_disable();
 void preempt_enable();
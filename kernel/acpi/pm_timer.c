@@ -49,7 +49,7 @@ void remap_pm_timer_registers(void *data) {
 void register_acpi_pm_timer() {
   kassert(acpi_global_fadt != NULL);
 
-  uint64_t period_ns = 1 / ((double) pm_timer_frequency / NS_PER_SEC);
+  uint64_t period_ns = NS_PER_SEC / pm_timer_frequency;
 
   clock_source_t *cs = kmalloc(sizeof(clock_source_t));
   memset(cs, 0, sizeof(clock_source_t));
@@ -91,7 +91,7 @@ void register_acpi_pm_timer() {
 
 int pm_timer_udelay(clock_t us) {
   uint64_t delay_ns = US_TO_NS(us);
-  uint64_t period_ns = 1 / ((double) pm_timer_frequency / NS_PER_SEC);
+  uint64_t period_ns = NS_PER_SEC / pm_timer_frequency;
   uint64_t count = pm_timer_clock_source->read(pm_timer_clock_source) + (delay_ns / period_ns);
   while (pm_timer_clock_source->read(pm_timer_clock_source) < count) {
     cpu_pause();
@@ -101,7 +101,7 @@ int pm_timer_udelay(clock_t us) {
 
 int pm_timer_mdelay(clock_t ms) {
   uint64_t delay_ns = MS_TO_NS(ms);
-  uint64_t period_ns = 1 / ((double) pm_timer_frequency / NS_PER_SEC);
+  uint64_t period_ns = NS_PER_SEC / pm_timer_frequency;
   uint64_t count = pm_timer_clock_source->read(pm_timer_clock_source) + (delay_ns / period_ns);
   while (pm_timer_clock_source->read(pm_timer_clock_source) < count) {
     cpu_pause();
@@ -329,6 +329,7 @@ static void cmdline_free_strings(char **strings) {
 // MARK: Console Commands
 
 #include <thread.h>
+#include <sched/sched.h>
 
 static int cmdline_ls_command(const char **args, size_t args_len) {
   if (args_len == 0) {
@@ -381,6 +382,26 @@ static int cmdline_mount_command(const char **args, size_t args_len) {
   return 0;
 }
 
+static int cmdline_pmstat_command(const char **args, size_t args_len) {
+  pmalloc_dump_stats();
+  return 0;
+}
+
+static int cmdline_slabstat_command(const char **args, size_t args_len) {
+  kmem_cache_dump_stats();
+  return 0;
+}
+
+static int cmdline_vmstat_command(const char **args, size_t args_len) {
+  vm_dump_stats();
+  return 0;
+}
+
+static int cmdline_schedstat_command(const char **args, size_t args_len) {
+  sched_dump_stats();
+  return 0;
+}
+
 // MARK: Console Main
 
 static int cmdline_process_line(const char *buffer, size_t len) {
@@ -399,6 +420,10 @@ static int cmdline_process_line(const char *buffer, size_t len) {
   const char *command = strings[0];
   HANDLE_COMMAND("ls", cmdline_ls_command);
   HANDLE_COMMAND("mount", cmdline_mount_command);
+  HANDLE_COMMAND("pmstat", cmdline_pmstat_command);
+  HANDLE_COMMAND("slabstat", cmdline_slabstat_command);
+  HANDLE_COMMAND("vmstat", cmdline_vmstat_command);
+  HANDLE_COMMAND("schedstat", cmdline_schedstat_command);
 
   kputsf("error: unknown command %s\n", command);
   cmdline_free_strings(strings);
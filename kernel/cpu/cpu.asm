@@ -68,18 +68,14 @@ cpu_read_tsc:
 
 ;
 
-global cpu_read_fsbase
-cpu_read_fsbase:
-  mov rsi, rdi
-  mov rdi, FS_BASE_MSR
-  call cpu_read_msr
+global __rdfsbase
+__rdfsbase:
+  rdfsbase rax
   ret
 
-global cpu_write_fsbase
-cpu_write_fsbase:
-  mov rsi, rdi
-  mov rdi, FS_BASE_MSR
-  call cpu_write_msr
+global __wrfsbase
+__wrfsbase:
+  wrfsbase rdi
   ret
 
 global cpu_read_gsbase
@@ -199,8 +195,7 @@ __xsetbv:
   mov ecx, edi
   mov rax, rsi
   mov rdx, rsi
-  mov cl, 32
-  shr rdx, cl
+  shr rdx, 32
   xsetbv
   ret
 
@@ -212,6 +207,89 @@ cpu_flush_tlb:
   mov cr3, rax
   ret
 
+global cpu_invlpg
+cpu_invlpg:
+  invlpg [rdi]
+  ret
+
+global cpu_invpcid
+cpu_invpcid:
+  ; rdi = type, rsi = pcid, rdx = address
+  sub rsp, 16
+  mov [rsp], rsi
+  mov [rsp + 8], rdx
+  invpcid rdi, [rsp]
+  add rsp, 16
+  ret
+
+; Power Management
+
+global cpu_sti_hlt
+cpu_sti_hlt:
+  ; the sti shadow ensures an interrupt can not slip in before the hlt
+  sti
+  hlt
+  ret
+
+global cpu_monitor
+cpu_monitor:
+  ; rdi = address
+  mov rax, rdi
+  xor ecx, ecx
+  xor edx, edx
+  monitor
+  ret
+
+global cpu_sti_mwait
+cpu_sti_mwait:
+  xor eax, eax ; C1
+  xor ecx, ecx
+  sti
+  mwait
+  ret
+
+; Extended State
+
+global cpu_xsave
+cpu_xsave:
+  ; rdi = area
+  ; rsi = component mask
+  mov rax, rsi
+  mov rdx, rsi
+  shr rdx, 32
+  xsave64 [rdi]
+  ret
+
+global cpu_xsaveopt
+cpu_xsaveopt:
+  ; rdi = area
+  ; rsi = component mask
+  mov rax, rsi
+  mov rdx, rsi
+  shr rdx, 32
+  xsaveopt64 [rdi]
+  ret
+
+global cpu_xrstor
+cpu_xrstor:
+  ; rdi = area
+  ; rsi = component mask
+  mov rax, rsi
+  mov rdx, rsi
+  shr rdx, 32
+  xrstor64 [rdi]
+  ret
+
+global cpu_fxsave
+cpu_fxsave:
+  fxsave64 [rdi]
+  ret
+
+global cpu_fxrstor
+cpu_fxrstor:
+  fxrstor64 [rdi]
+  ret
+
 ; Syscalls
 
 global syscall
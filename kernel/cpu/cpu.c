@@ -5,6 +5,7 @@
 #include <cpu/cpu.h>
 #include <cpu/gdt.h>
 #include <cpu/idt.h>
+#include <cpu/fpu.h>
 
 #include <device/apic.h>
 #include <device/pit.h>
@@ -26,6 +27,8 @@
 #define CPU_CR4_OSFXSR     (1 << 9)
 #define CPU_CR4_OSXMMEXCPT (1 << 10)
 #define CPU_CR4_UMIP       (1 << 11)
+#define CPU_CR4_FSGSBASE   (1 << 16)
+#define CPU_CR4_PCIDE      (1 << 17)
 #define CPU_CR4_OSXSAVE    (1 << 18)
 
 #define CPU_XCR0_X87       (1 << 0)
@@ -164,28 +167,45 @@ void cpu_init() {
     bsp_log_message("UMIP enabled\n");
     cr4 |= CPU_CR4_UMIP;
   }
-  // os enabled xsave
-  if (cpuid_query_bit(CPUID_BIT_XSAVE) && cpuid_query_bit(CPUID_BIT_OSXSAVE)) {
+  // user mode access to the fs/gs base registers
+  if (cpuid_query_bit(CPUID_BIT_FSGSBASE)) {
+    bsp_log_message("FSGSBASE enabled\n");
+    cr4 |= CPU_CR4_FSGSBASE;
+  }
+  // os enabled xsave (the OSXSAVE bit only reflects cr4 so it is not checked)
+  if (cpuid_query_bit(CPUID_BIT_XSAVE)) {
     cr4 |= CPU_CR4_OSXSAVE;
   } else {
     bsp_log_message("XSAVE disabled\n");
     cpuid_clear_bit(CPUID_BIT_XSAVE);
   }
+  // process-context identifiers (requires a zero pcid in cr3)
+  if (cpuid_query_bit(CPUID_BIT_PCID) && (__read_cr3() & 0xFFF) == 0) {
+    bsp_log_message("PCID enabled\n");
+    cr4 |= CPU_CR4_PCIDE;
+    if (cpuid_query_bit(CPUID_BIT_INVPCID)) {
+      bsp_log_message("INVPCID supported\n");
+    }
+  } else {
+    cpuid_clear_bit(CPUID_BIT_PCID);
+    cpuid_clear_bit(CPUID_BIT_INVPCID);
+  }
   __write_cr4(cr4);
 
   // enable XSAVE/XRSTOR Support
   if (cpuid_query_bit(CPUID_BIT_XSAVE)) {
     bsp_log_message("XSAVE support 'x87 registers'\n");
     bsp_log_message("XSAVE support 'SSE registers'\n");
-    uint64_t xcr = __xgetbv(0x1);
+    uint64_t xcr = __xgetbv(0);
     xcr |= CPU_XCR0_X87 | CPU_XCR0_SSE; // x87 state and SSE state
     // Enable AVX if available
     if (cpuid_query_bit(CPUID_BIT_AVX)) {
       bsp_log_message("XSAVE support 'AVX registers'\n");
       xcr |= CPU_XCR0_AVX; // AVX state
     }
-    __xsetbv(0x1, xcr);
+    __xsetbv(0, xcr);
   }
+  fpu_init();
 
   // enable NX and Fast FXSR
   uint64_t efer = cpu_read_msr(IA32_EFER_MSR);
@@ -223,7 +243,7 @@ void cpu_init() {
 
     uint64_t cpu_ticks_per_sec = cycles * (MS_PER_SEC / ms);
     uint64_t cpu_clock_khz = cpu_ticks_per_sec / 1000;
-    kprintf("detected %.2f MHz processor\n", (double)(cpu_clock_khz / 1000));
+    kprintf("detected %llu.%02llu MHz processor\n", cpu_clock_khz / 1000, (cpu_clock_khz % 1000) / 10);
   }
 }
 
@@ -280,6 +300,23 @@ int cpuid_query_bit(uint16_t feature) {
   return (PERCPU_CPU_INFO->cpuid_bits.raw[dword] & (1 << bit)) != 0;
 }
 
+uint64_t cpu_read_fsbase() {
+  if (cpuid_query_bit(CPUID_BIT_FSGSBASE)) {
+    return __rdfsbase();
+  }
+  return cpu_read_msr(IA32_FS_BASE_MSR);
+}
+
+void cpu_write_fsbase(uint64_t value) {
+  if (cpuid_query_bit(CPUID_BIT_FSGSBASE)) {
+    __wrfsbase(value);
+    return;
+  }
+  cpu_write_msr(IA32_FS_BASE_MSR, value);
+}
+
+//
+
 void cpu_print_info() {
   char id_string[13];
   uint32_t max_leaf;
@@ -0,0 +1,133 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-21.
+//
+
+#include <cpu/fpu.h>
+#include <cpu/cpu.h>
+
+#include <mm.h>
+#include <thread.h>
+
+#include <string.h>
+#include <panic.h>
+#include <printf.h>
+
+// Extended State
+//
+// Every thread owns an area which its extended state is saved to when it is
+// switched out and restored from when it is switched back in. When supported,
+// XSAVEOPT and XRSTOR are used which track the components that are still in
+// their initial state. Those are only marked as such in the area header and are
+// reset rather than loaded on restore, so threads which never touch the vector
+// registers do not pay for saving or loading them. Older cpus fall back to
+// FXSAVE/FXRSTOR of the x87 and SSE state.
+
+#define FXSAVE_AREA_SIZE  512
+#define FPU_AREA_ALIGN    64
+
+#define FPU_FCW_OFFSET    0
+#define FPU_MXCSR_OFFSET  24
+#define FPU_FCW_DEFAULT   0x037F
+#define FPU_MXCSR_DEFAULT 0x1F80
+
+#define CPUID_XSAVE_LEAF  0x0D
+#define CPUID_XSAVEOPT    (1 << 0) // leaf 0x0D, sub-leaf 1, eax
+
+#define __cpuid_count(level, count, a, b, c, d) \
+  __asm("cpuid\n\t" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "0" (level), "2" (count))
+
+typedef enum fpu_mode {
+  FPU_FXSAVE,
+  FPU_XSAVE,
+  FPU_XSAVEOPT,
+} fpu_mode_t;
+
+static fpu_mode_t fpu_mode;
+static uint64_t fpu_mask;    // state components which are saved (xcr0)
+static size_t fpu_area_size; // size of a save area
+
+void fpu_init() {
+  // every cpu is set up the same way so only the bsp needs to check
+  if (!PERCPU_IS_BSP) {
+    return;
+  }
+
+  if (!cpuid_query_bit(CPUID_BIT_XSAVE)) {
+    fpu_mode = FPU_FXSAVE;
+    fpu_mask = 0;
+    fpu_area_size = FXSAVE_AREA_SIZE;
+    kprintf("fpu: using fxsave [size = %zu]\n", fpu_area_size);
+    return;
+  }
+
+  uint32_t eax, ebx, ecx, edx;
+  fpu_mask = __xgetbv(0);
+  // ebx holds the area size for the components currently enabled in xcr0
+  __cpuid_count(CPUID_XSAVE_LEAF, 0, eax, ebx, ecx, edx);
+  fpu_area_size = ebx;
+  __cpuid_count(CPUID_XSAVE_LEAF, 1, eax, ebx, ecx, edx);
+  fpu_mode = (eax & CPUID_XSAVEOPT) ? FPU_XSAVEOPT : FPU_XSAVE;
+  kprintf("fpu: using %s [size = %zu, mask = %#llx]\n",
+          fpu_mode == FPU_XSAVEOPT ? "xsaveopt" : "xsave", fpu_area_size, fpu_mask);
+}
+
+//
+
+void *fpu_alloc_area() {
+  kassert(fpu_area_size > 0);
+  void *area = kmalloca(fpu_area_size, FPU_AREA_ALIGN);
+  // a zeroed xsave header marks every component as being in its initial state
+  // but the control words in the legacy region are loaded either way
+  memset(area, 0, fpu_area_size);
+  *((uint16_t *)(area + FPU_FCW_OFFSET)) = FPU_FCW_DEFAULT;
+  *((uint32_t *)(area + FPU_MXCSR_OFFSET)) = FPU_MXCSR_DEFAULT;
+  return area;
+}
+
+void fpu_free_area(void *area) {
+  kfree(area);
+}
+
+void fpu_copy_area(void *dest, void *src) {
+  memcpy(dest, src, fpu_area_size);
+}
+
+void fpu_save(void *area) {
+  switch (fpu_mode) {
+    case FPU_XSAVEOPT:
+      cpu_xsaveopt(area, fpu_mask);
+      break;
+    case FPU_XSAVE:
+      cpu_xsave(area, fpu_mask);
+      break;
+    default:
+      cpu_fxsave(area);
+      break;
+  }
+}
+
+void fpu_restore(void *area) {
+  if (fpu_mode == FPU_FXSAVE) {
+    cpu_fxrstor(area);
+  } else {
+    cpu_xrstor(area, fpu_mask);
+  }
+}
+
+//
+
+void kernel_fpu_begin() {
+  thread_t *thread = PERCPU_THREAD;
+  preempt_disable();
+  kassert(!(thread->flags & F_THREAD_KERNEL_FPU));
+  thread->flags |= F_THREAD_KERNEL_FPU;
+  fpu_save(thread->fpu);
+}
+
+void kernel_fpu_end() {
+  thread_t *thread = PERCPU_THREAD;
+  kassert(thread->flags & F_THREAD_KERNEL_FPU);
+  fpu_restore(thread->fpu);
+  thread->flags &= ~F_THREAD_KERNEL_FPU;
+  preempt_enable();
+}
@@ -164,8 +164,8 @@ void get_cpu_clock() {
   cpu_clock = min * (MS_PER_SEC / ms);
   kprintf("[apic] cpu clock ticks per second: %u\n", cpu_clock);
 
-  double freq = cpu_clock / 1e6;
-  kprintf("[apic] detected %.1f MHz cpu clock\n", freq);
+  uint64_t freq_khz = cpu_clock / 1000;
+  kprintf("[apic] detected %llu.%llu MHz cpu clock\n", freq_khz / 1000, (freq_khz % 1000) / 100);
 }
 
 void get_apic_clock() {
@@ -197,8 +197,8 @@ void get_apic_clock() {
   apic_clock = min * (MS_PER_SEC / ms);
   kprintf("[apic] apic clock ticks per second: %u\n", apic_clock);
 
-  double freq = apic_clock / 1e6;
-  kprintf("[apic] detected %.1f MHz timer clock\n", freq);
+  uint32_t freq_khz = apic_clock / 1000;
+  kprintf("[apic] detected %u.%u MHz timer clock\n", freq_khz / 1000, (freq_khz % 1000) / 100);
 }
 
 void poll_icr_status() {
@@ -267,13 +267,14 @@ void apic_init_periodic(uint64_t ms) {
   apic_write(APIC_INITIAL_COUNT, ms_to_count(ms));
 }
 
-void apic_init_oneshot() {
+void apic_init_oneshot(uint8_t vector) {
   apic_reg_div_config_t div = apic_reg_div_config(APIC_DIVIDE_1);
   apic_write(APIC_DIVIDE_CONFIG, div.raw);
 
   apic_reg_lvt_timer_t timer = apic_read_timer();
   timer.timer_mode = APIC_ONE_SHOT;
   timer.mask = APIC_UNMASK;
+  timer.vector = vector;
   apic_write_timer(timer);
 }
 
@@ -282,6 +283,12 @@ void apic_oneshot(uint64_t ms) {
   apic_write(APIC_INITIAL_COUNT, ms == 0 ? 0 : ms_to_count(ms));
 }
 
+void apic_oneshot_ns(uint64_t ns) {
+  // a count of 0 stops the timer
+  uint64_t count = ns == 0 ? 0 : max(((uint64_t) apic_clock * ns) / NS_PER_SEC, 1);
+  apic_write(APIC_INITIAL_COUNT, min(count, UINT32_MAX));
+}
+
 void apic_udelay(uint64_t us) {
   apic_reg_lvt_timer_t timer = apic_read_timer();
   timer.timer_mode = APIC_ONE_SHOT;
@@ -9,18 +9,25 @@
 #include <sched.h>
 #include <irq.h>
 #include <mm.h>
+#include <mm/tlb.h>
 
-#include <spinlock.h>
 #include <panic.h>
 #include <printf.h>
 #include <atomic.h>
 
 #include <cpu/io.h>
 
-static uint8_t ipi_type;
-static uint64_t ipi_data;
-static spinlock_t ipi_lock;
-static uint8_t ipi_ack;
+// Each cpu has its own mailbox. Regular IPIs keep only the most recent data
+// for each type, while shootdowns get one slot per sending cpu since a cpu
+// never has more than one shootdown in flight.
+typedef struct ipi_mailbox {
+  volatile uint64_t pending;        // pending ipi types
+  uint64_t data[NUM_IPIS];          // latest data for each ipi type
+  volatile uint64_t invlpg_pending; // cpus with a pending shootdown
+  uint64_t invlpg_data[MAX_CPUS];   // shootdown data from each cpu
+} ipi_mailbox_t;
+
+static ipi_mailbox_t ipi_mailboxes[MAX_CPUS];
 
 typedef void (*panic_fn_t)(cpu_irq_stack_t *frame, cpu_registers_t *regs);
 
@@ -36,100 +43,128 @@ typedef void (*panic_fn_t)(cpu_irq_stack_t *frame, cpu_registers_t *regs);
   })
 
 
+static void ipi_post(ipi_type_t type, uint8_t cpu_id, uint64_t data) {
+  ipi_mailbox_t *mailbox = &ipi_mailboxes[cpu_id];
+  if (type == IPI_INVLPG) {
+    uint8_t id = PERCPU_ID;
+    mailbox->invlpg_data[id] = data;
+    atomic_fetch_or(&mailbox->invlpg_pending, 1ULL << id);
+  } else {
+    mailbox->data[type] = data;
+    atomic_fetch_or(&mailbox->pending, 1ULL << type);
+  }
+}
+
+static bool ipi_take(ipi_mailbox_t *mailbox, ipi_type_t type, uint64_t *data) {
+  if (!(mailbox->pending & (1ULL << type))) {
+    return false;
+  }
+
+  atomic_fetch_and(&mailbox->pending, ~(1ULL << type));
+  *data = mailbox->data[type];
+  return true;
+}
+
+void ipi_poll_invlpg() {
+  ipi_mailbox_t *mailbox = &ipi_mailboxes[PERCPU_ID];
+  while (mailbox->invlpg_pending != 0) {
+    uint8_t cpu = __builtin_ctzll(mailbox->invlpg_pending);
+    atomic_fetch_and(&mailbox->invlpg_pending, ~(1ULL << cpu));
+    tlb_shootdown_handler((void *) mailbox->invlpg_data[cpu]);
+  }
+}
+
+//
+
 __used void ipi_handler(cpu_irq_stack_t *frame, cpu_registers_t *regs) {
-  uint8_t type = ipi_type;
-  uint64_t data = ipi_data;
-  kassert(type < NUM_IPIS);
-  atomic_fetch_add(&ipi_ack, 1);
+  ipi_mailbox_t *mailbox = &ipi_mailboxes[PERCPU_ID];
   QDEBUG_PRINT("RECEIVED IPI");
 
-  // kprintf("[CPU#%d] ipi %d\n", PERCPU_ID, type);
-  switch (type) {
-    case IPI_PANIC:
-      if (data != 0) {
-        if (!mm_is_kernel_code_ptr(data)) {
-          kprintf("CPU#%d IPI panic - bad handler!\n", PERCPU_ID);
-          while (true) cpu_pause();
-        }
+  // shootdowns may have already been handled while polling
+  ipi_poll_invlpg();
 
-        ((panic_fn_t)((void *) data))(frame, regs);
+  uint64_t data;
+  if (ipi_take(mailbox, IPI_PANIC, &data)) {
+    if (data != 0) {
+      if (!mm_is_kernel_code_ptr(data)) {
+        kprintf("CPU#%d IPI panic - bad handler!\n", PERCPU_ID);
         while (true) cpu_pause();
       }
-      unreachable;
-    case IPI_INVLPG:
-      kassert(false && "not implemented");
-      unreachable;
-    case IPI_SCHEDULE:
-      sched_reschedule((sched_cause_t) data);
-      break;
-    case IPI_NOOP:
-      break;
-    default: unreachable;
+
+      ((panic_fn_t)((void *) data))(frame, regs);
+      while (true) cpu_pause();
+    }
+    unreachable;
+  }
+
+  if (ipi_take(mailbox, IPI_TIMESLICE, &data)) {
+    sched_timer_update();
   }
+  if (ipi_take(mailbox, IPI_SCHEDULE, &data)) {
+    sched_reschedule_remote((sched_cause_t) data);
+  }
+  if (ipi_take(mailbox, IPI_PCP_DRAIN, &data)) {
+    pcp_drain_handler();
+  }
+  ipi_take(mailbox, IPI_NOOP, &data);
 }
 
 //
 
 int ipi_deliver_cpu_id(ipi_type_t type, uint8_t cpu_id, uint64_t data) {
   kassert(type < NUM_IPIS);
-  if (cpu_id > system_num_cpus) {
+  if (cpu_id >= system_num_cpus) {
     return -1;
   }
 
   // kprintf("[CPU#%d] delivering ipi to CPU#%d\n", PERCPU_ID, cpu_id);
-
-  // we cant use spin_lock here because it disables interrupts
-  while (!spin_trylock(&ipi_lock)) {
-    cpu_pause();
-  }
-  ipi_type = type;
-  ipi_data = data;
-  ipi_ack = 0;
+  ipi_post(type, cpu_id, data);
 
   QDEBUG_PRINT("SENDING IPI");
   apic_write_icr(APIC_DM_FIXED | APIC_LVL_ASSERT | ipi_vectornum, cpu_id);
-
-  // cpu_enable_interrupts();
-  // while (*((volatile uint8_t *)(&ipi_ack)) != 1) {
-  //   cpu_pause();
-  // }
-  // cpu_disable_interrupts();
-
-  spin_unlock(&ipi_lock);
   return 0;
 }
 
 int ipi_deliver_mode(ipi_type_t type, ipi_mode_t mode, uint64_t data) {
-  kassert(type < NUM_IPIS);
+  kassert(type < NUM_IPIS && type != IPI_INVLPG);
   kprintf("[CPU#%d] delivering ipi using mode %d\n", PERCPU_ID, mode);
 
+  uint8_t id = PERCPU_ID;
+  uint64_t all_cpus = system_num_cpus == 64 ? UINT64_MAX : (1ULL << system_num_cpus) - 1;
   uint32_t apic_flags;
-  uint32_t num_acks;
+  uint64_t targets;
   switch (mode) {
     case IPI_SELF:
       apic_flags = APIC_DS_SELF;
-      num_acks = 1;
+      targets = 1ULL << id;
       break;
     case IPI_ALL_INCL:
       apic_flags = APIC_DS_ALLINC;
-      num_acks = system_num_cpus;
+      targets = all_cpus;
       break;
     case IPI_ALL_EXCL:
       apic_flags = APIC_DS_ALLBUT;
-      num_acks = system_num_cpus - 1;
+      targets = all_cpus & ~(1ULL << id);
       break;
     default:
       panic("invalid ipi mode");
   }
 
-  spin_lock(&ipi_lock);
-  ipi_type = type;
-  ipi_data = data;
-  ipi_ack = 0;
+  for (uint8_t cpu = 0; cpu < system_num_cpus; cpu++) {
+    if (targets & (1ULL << cpu)) {
+      ipi_post(type, cpu, data);
+    }
+  }
   apic_write_icr(APIC_DM_FIXED | APIC_LVL_ASSERT | apic_flags | ipi_vectornum, 0);
-  while (ipi_ack != num_acks) {
-    cpu_pause();
+
+  // wait for the other cpus to pick up the message
+  targets &= ~(1ULL << id);
+  for (uint8_t cpu = 0; cpu < system_num_cpus; cpu++) {
+    if (targets & (1ULL << cpu)) {
+      while (ipi_mailboxes[cpu].pending & (1ULL << type)) {
+        cpu_pause();
+      }
+    }
   }
-  spin_unlock(&ipi_lock);
   return 0;
 }
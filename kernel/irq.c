@@ -43,6 +43,7 @@ struct isa_irq_override {
 };
 
 uint8_t ipi_vectornum;
+uint8_t timer_vectornum;
 static int irq_external_max;
 static spinlock_t irqnum_hardware_lock;
 static bitmap_t *irqnum_hardware_map;
@@ -54,6 +55,7 @@ struct isa_irq_override irq_isa_overrides[IRQ_NUM_ISA];
 
 
 extern void ipi_handler(cpu_irq_stack_t *frame, cpu_registers_t *regs);
+extern void sched_timer_handler();
 
 
 __used void irq_handler(uint8_t vector, cpu_irq_stack_t *frame, cpu_registers_t *regs) {
@@ -64,6 +66,9 @@ __used void irq_handler(uint8_t vector, cpu_irq_stack_t *frame, cpu_registers_t
   if (vector == ipi_vectornum) {
     ipi_handler(frame, regs);
     goto done;
+  } else if (vector == timer_vectornum) {
+    sched_timer_handler();
+    goto done;
   }
 
   if (irq_handlers[vector].ptr != NULL) {
@@ -169,6 +174,10 @@ void irq_init() {
   ipi_vectornum = IRQ_NUM_VECTORS - 2;
   irq_reserve_irqnum(ipi_vectornum - IRQ_VECTOR_BASE);
   irq_enable_interrupt(ipi_vectornum);
+
+  // and the next one for the local apic timer which drives preemption
+  timer_vectornum = IRQ_NUM_VECTORS - 3;
+  irq_reserve_irqnum(timer_vectornum - IRQ_VECTOR_BASE);
 }
 
 //
@@ -23,11 +23,23 @@ int elf_pt_load(Elf64_Phdr *pheader, void *buf, elf_program_t *prog) {
     flags |= PG_WRITE;
 
   size_t memsz = align_down(pheader->p_memsz, pheader->p_align) + pheader->p_align;
-
-  page_t *pages = _alloc_pages(SIZE_TO_PAGES(memsz), flags);
   uintptr_t v_aligned = align_down(pheader->p_vaddr + prog->base, pheader->p_align);
   void *addr = (void *)(pheader->p_vaddr + prog->base);
 
+  if (flags & PG_WRITE) {
+    // writable segments are anonymous so that fork shares them copy-on-write
+    // instead of leaving both processes writing to the same pages. the pages
+    // are zeroed as they are faulted in so only the file contents are copied
+    vm_mapping_t *mapping = _vmap_anon_addr(v_aligned, memsz, flags, "elf data");
+    if (mapping == NULL) {
+      panic("exec: could not load executable");
+    }
+
+    memcpy(addr, buf + pheader->p_offset, pheader->p_filesz);
+    return 0;
+  }
+
+  page_t *pages = _alloc_pages(SIZE_TO_PAGES(memsz), flags);
   void *res = _vmap_pages_addr(v_aligned, pages);
   if (res == NULL) {
     panic("exec: could not load executable");
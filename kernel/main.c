@@ -63,6 +63,7 @@ __used void kmain() {
   irq_init();
   init_mem_zones();
   init_address_space();
+  kheap_init_cpu_arena();
   syscalls_init();
   fs_early_init();
 
@@ -93,6 +94,7 @@ __used void ap_main() {
   kprintf("[CPU#%d] initializing\n", PERCPU_ID);
 
   init_ap_address_space();
+  kheap_init_cpu_arena();
   syscalls_init();
 
   kprintf("[CPU#%d] done!\n", PERCPU_ID);
@@ -63,20 +63,23 @@
 
 
 ; __memset_fast_aligned - memset into 16-byte aligned memory
-; dest = rdi, len = r9, val = xmm0
+; dest = rdi, len = r9, val = rax
 __memset_fast_aligned:
 .loop:
-  movntdq [rdi], xmm0
+  movnti [rdi], rax
+  movnti [rdi + 8], rax
   add rdi, 16
   sub r9, 1
   jnz .loop
+  sfence                       ; order the stores before the memory is used
   ret
 
 ; __memset_fast_unaligned - memset into unaligned memory
-; dest = rdi, len = r9, val = xmm0
+; dest = rdi, len = r9, val = rax
 __memset_fast_unaligned:
 .loop:
-  movdqu [rdi], xmm0
+  mov [rdi], rax
+  mov [rdi + 8], rax
   add rdi, 16
   sub r9, 1
   jnz .loop
@@ -110,8 +113,6 @@ __memset8:
 ; ------------------
   mov qword rax, 0x0101010101010101
   imul rax, rsi                ; repeat byte 8 times
-  movq xmm0, rax               ; load bytes into xmm0
-  movddup xmm0, xmm0           ; repeat sequence again (16 repeated bytes)
   call r8                      ; call memset loop
 ; ------------------
   memset_fast_bottom sil, 1
@@ -124,9 +125,7 @@ __memset32:
 ; ------------------
   mov rax, rsi
   shl rax, 32
-  or rax, rsi
-  movq xmm0, rax               ; load dwords into xmm0
-  movddup xmm0, xmm0           ; repeat sequence again (4 repeated dwords)
+  or rax, rsi                  ; repeat dword 2 times
   call r8                      ; call memset loop
 ; ------------------
   memset_fast_bottom eax, 4
@@ -138,9 +137,31 @@ __memset64:
   memset_fast_top 8
 ; ------------------
   mov rax, rsi
-  movq xmm0, rax               ; load qword into xmm0
-  movddup xmm0, xmm0           ; repeat qword again (2 repeated qwords)
   call r8                      ; call memset loop
 ; ------------------
   memset_fast_bottom rax, 8
   ret
+
+; void __memzero_nt(void *dest, size_t len)
+;   zeroes memory using non-temporal stores which bypass the cache. dest must
+;   be 8-byte aligned and len a multiple of 64. no vector registers are used.
+global __memzero_nt
+__memzero_nt:
+  xor eax, eax
+  shr rsi, 6                   ; number of 64-byte blocks
+  jz .end
+.loop:
+  movnti [rdi], rax
+  movnti [rdi + 8], rax
+  movnti [rdi + 16], rax
+  movnti [rdi + 24], rax
+  movnti [rdi + 32], rax
+  movnti [rdi + 40], rax
+  movnti [rdi + 48], rax
+  movnti [rdi + 56], rax
+  add rdi, 64
+  sub rsi, 1
+  jnz .loop
+  sfence                       ; order the stores before the memory is used
+.end:
+  ret
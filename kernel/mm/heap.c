@@ -5,12 +5,21 @@
 #include <mm/heap.h>
 #include <mm/init.h>
 #include <mm/pgtable.h>
+#include <mm/pmalloc.h>
+#include <mm/vmalloc.h>
+
+#include <cpu/cpu.h>
 
 #include <printf.h>
 #include <string.h>
 #include <spinlock.h>
 #include <panic.h>
 #include <mutex.h>
+#include <ipi.h>
+
+#include <atomic.h>
+#include <init.h>
+#include <asm/bits.h>
 
 
 #define END_ADDR(heap) ((heap)->virt_addr + (heap)->size)
@@ -19,6 +28,16 @@ mm_heap_t kheap;
 spinlock_t kheap_lock;
 mutex_t kheap_mutex;
 
+// per-cpu heap arenas (kheap is the shared fallback)
+static mm_heap_t *heap_arenas[MAX_CPUS];
+static bool arena_growing[MAX_CPUS];
+static volatile uintptr_t shared_grower = 0; // thread (or cpu) mapping a new shared region
+// open addressed set of region addresses. entries are only ever added
+static volatile uintptr_t heap_regions[HEAP_MAX_REGIONS];
+static spinlock_t heap_regions_lock;
+// set once new regions can be mapped through vmalloc
+static bool heap_vm_ready = false;
+
 static const char *hist_labels[9] = {
   "0-8", "9-16", "17-32", "33-64", "65-128", "129-512", "513-1024", "larger"
 };
@@ -37,40 +56,6 @@ static inline int get_hist_bucket(size_t size) {
   }
 }
 
-static inline mm_chunk_t *get_prev_chunk(mm_chunk_t *chunk) {
-  if (chunk->prev_offset == 0) {
-    return NULL;
-  }
-
-  mm_chunk_t *prev = offset_ptr(chunk, -chunk->prev_offset);
-  if (prev->magic != CHUNK_MAGIC) {
-    panic("[get_prev_chunk] chunk magic is invalid");
-  }
-  return prev;
-}
-
-static inline mm_chunk_t *get_next_chunk(mm_heap_t *heap, mm_chunk_t *chunk) {
-  if (chunk == heap->last_chunk) {
-    return NULL;
-  }
-
-  uintptr_t next_addr = offset_addr(chunk, sizeof(mm_chunk_t) + chunk->size);
-  if (next_addr < END_ADDR(heap) && ((uint16_t *) next_addr)[0] == HOLE_MAGIC) {
-    uint16_t hole_size = ((uint16_t *) next_addr)[1];
-    next_addr += hole_size;
-  }
-
-  if (next_addr >= END_ADDR(heap)) {
-    return NULL;
-  }
-
-  mm_chunk_t *next = (void *) next_addr;
-  if (next->magic != CHUNK_MAGIC) {
-    panic("[get_next_chunk] chunk magic is invalid");
-  }
-  return next;
-}
-
 static inline void aquire_heap(mm_heap_t *heap) {
   // PERCPU_THREAD will only be null on initial bootup
   spin_lock(&kheap_lock);
@@ -92,10 +77,15 @@ static inline void release_heap(mm_heap_t *heap) {
 
 // ----- heap creation -----
 
+static void kheap_vm_ready(void *_arg) {
+  heap_vm_ready = true;
+}
+
 void mm_init_kheap() {
   size_t page_count = SIZE_TO_PAGES(KERNEL_HEAP_SIZE);
   uintptr_t phys_addr = mm_early_alloc_pages(page_count);
   uintptr_t virt_addr = KERNEL_HEAP_VA;
+  kheap.phys_addr = phys_addr;
   if (KERNEL_HEAP_SIZE >= BIGPAGE_SIZE && is_aligned(phys_addr, BIGPAGE_SIZE)) {
     uintptr_t num_bigpages = KERNEL_HEAP_SIZE / BIGPAGE_SIZE;
     page_count = PAGES_TO_SIZE(page_count) % BIGPAGE_SIZE;
@@ -108,196 +98,676 @@ void mm_init_kheap() {
     early_map_entries(virt_addr, phys_addr, page_count, PG_WRITE);
   }
 
-  kheap.phys_addr = phys_addr;
+  kheap.magic = HEAP_MAGIC;
   kheap.virt_addr = KERNEL_HEAP_VA;
   kheap.size = KERNEL_HEAP_SIZE;
   kheap.used = 0;
   kheap.last_chunk = NULL;
-  LIST_INIT(&kheap.chunks);
+  for (int i = 0; i < HEAP_NUM_BINS; i++) {
+    LIST_INIT(&kheap.bins[i]);
+  }
+  kheap.bin_map[0] = 0;
+  kheap.bin_map[1] = 0;
+  kheap.cpu_id = HEAP_SHARED_CPU;
+  kheap.next = NULL;
   spin_init(&kheap_lock);
+  spin_init(&heap_regions_lock);
   mutex_init(&kheap_mutex, MUTEX_REENTRANT | MUTEX_SHARED);
   mutex_init(&kheap.lock, MUTEX_REENTRANT | MUTEX_SHARED);
 
+  register_init_address_space_callback(kheap_vm_ready, NULL);
   kprintf("initialized kernel heap\n");
 }
 
-// ----- kmalloc -----
+static inline size_t chunk_span(mm_chunk_t *chunk) {
+  return sizeof(mm_chunk_t) + chunk->size;
+}
 
-void *__kmalloc(mm_heap_t *heap, size_t size, size_t alignment) {
-  kassert(heap != NULL);
-  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
-    panic("[kmalloc] invalid alignment given: %zu\n", alignment);
+static inline void set_prev_chunk(mm_chunk_t *chunk, mm_chunk_t *prev) {
+  if (prev == NULL) {
+    chunk->prev_offset = 0;
+    return;
   }
 
-  if (size == 0) {
+  uintptr_t offset = (uintptr_t) chunk - (uintptr_t) prev;
+  kassert(offset / CHUNK_SIZE_ALIGN <= UINT16_MAX);
+  chunk->prev_offset = offset / CHUNK_SIZE_ALIGN;
+}
+
+static inline mm_chunk_t *get_prev_chunk(mm_chunk_t *chunk) {
+  if (chunk->prev_offset == 0) {
     return NULL;
-  } else if (size > CHUNK_MAX_SIZE) {
-    panic("[kmalloc] error - request too large (%zu)\n", size);
   }
 
-  aquire_heap(heap);
-  heap->stats.alloc_count++;
-  heap->stats.alloc_sizes[get_hist_bucket(size)]++;
-  size = align(max(size, CHUNK_MIN_SIZE), CHUNK_SIZE_ALIGN);
-
-  // search for the best fitting chunk. If one is not found,
-  // we will create a new chunk in the unmanaged heap memory.
-  if (LIST_FIRST(&heap->chunks)) {
-    // kprintf("[kmalloc] searching used chunks\n");
-    mm_chunk_t *chunk = NULL;
-    mm_chunk_t *curr = NULL;
-    LIST_FOREACH(curr, &heap->chunks, list) {
-      // check if chunk is properly aligned
-      if (offset_addr(curr, sizeof(mm_chunk_t)) % alignment != 0) {
-        continue;
+  mm_chunk_t *prev = offset_ptr(chunk, -(chunk->prev_offset * CHUNK_SIZE_ALIGN));
+  if (prev->magic != CHUNK_MAGIC) {
+    panic("[get_prev_chunk] chunk magic is invalid");
+  }
+  return prev;
+}
+
+static inline mm_chunk_t *get_next_chunk(mm_heap_t *heap, mm_chunk_t *chunk) {
+  if (chunk == heap->last_chunk) {
+    return NULL;
+  }
+
+  mm_chunk_t *next = offset_ptr(chunk, chunk_span(chunk));
+  if (next->magic != CHUNK_MAGIC) {
+    panic("[get_next_chunk] chunk magic is invalid");
+  }
+  return next;
+}
+
+static inline mm_chunk_t *make_chunk(uintptr_t addr, size_t size, mm_chunk_t *prev) {
+  mm_chunk_t *chunk = (void *) addr;
+  chunk->magic = CHUNK_MAGIC;
+  chunk->size = size;
+  chunk->free = false;
+  chunk->list.next = NULL;
+  chunk->list.prev = NULL;
+  set_prev_chunk(chunk, prev);
+  return chunk;
+}
+
+// ----- bins -----
+
+static inline int get_bin_index(size_t size) {
+  if (size <= HEAP_SMALL_BIN_MAX) {
+    return (int)(size / CHUNK_SIZE_ALIGN) - 1;
+  }
+  // large bin `i` holds sizes in (512 << i, 512 << (i + 1)]
+  int index = HEAP_NUM_SMALL_BINS + __bsr64(size - 1) - __bsr64(HEAP_SMALL_BIN_MAX);
+  return min(index, HEAP_NUM_BINS - 1);
+}
+
+/* returns the first non-empty bin with an index >= `index` or -1 */
+static inline int find_next_bin(mm_heap_t *heap, int index) {
+  while (index < HEAP_NUM_BINS) {
+    uint64_t word = heap->bin_map[index / 64] & (UINT64_MAX << (index % 64));
+    if (word != 0) {
+      return (index & ~63) + __bsf64(word);
+    }
+    index = (index & ~63) + 64;
+  }
+  return -1;
+}
+
+static inline void bin_insert(mm_heap_t *heap, mm_chunk_t *chunk) {
+  int index = get_bin_index(chunk->size);
+  chunk->free = true;
+  LIST_ADD_FRONT(&heap->bins[index], chunk, list);
+  heap->bin_map[index / 64] |= 1ULL << (index % 64);
+  heap->stats.bin_chunks[index]++;
+  heap->stats.bin_bytes[index] += chunk->size;
+}
+
+static inline void bin_remove(mm_heap_t *heap, mm_chunk_t *chunk) {
+  int index = get_bin_index(chunk->size);
+  LIST_REMOVE(&heap->bins[index], chunk, list);
+  if (LIST_FIRST(&heap->bins[index]) == NULL) {
+    heap->bin_map[index / 64] &= ~(1ULL << (index % 64));
+  }
+  heap->stats.bin_chunks[index]--;
+  heap->stats.bin_bytes[index] -= chunk->size;
+  chunk->free = false;
+}
+
+/* finds and removes a free chunk of at least `size` bytes */
+static mm_chunk_t *bin_take(mm_heap_t *heap, size_t size) {
+  int index = get_bin_index(size);
+  if (index >= HEAP_NUM_SMALL_BINS) {
+    // chunks in a large bin vary in size so this one needs a search
+    mm_chunk_t *chunk;
+    LIST_FOREACH(chunk, &heap->bins[index], list) {
+      if (chunk->size >= size) {
+        bin_remove(heap, chunk);
+        return chunk;
       }
+    }
+    index++;
+  }
 
-      if (curr->size >= size) {
-        if (chunk == NULL || (curr->size < chunk->size)) {
-          chunk = curr;
-        }
-      } else if (curr->size == size) {
-        // if current chunk is exact match use it right away
-        chunk = curr;
-        break;
+  // every chunk in the following bins is large enough
+  index = find_next_bin(heap, index);
+  if (index < 0) {
+    return NULL;
+  }
+
+  mm_chunk_t *chunk = LIST_FIRST(&heap->bins[index]);
+  bin_remove(heap, chunk);
+  return chunk;
+}
+
+// ----- splitting/coalescing -----
+
+/* splits the tail of a chunk off into a new free chunk if large enough */
+static void split_chunk(mm_heap_t *heap, mm_chunk_t *chunk, size_t size) {
+  if (chunk->size - size < sizeof(mm_chunk_t) + CHUNK_MIN_SIZE) {
+    return;
+  }
+
+  mm_chunk_t *next = get_next_chunk(heap, chunk);
+  size_t rest = chunk->size - size - sizeof(mm_chunk_t);
+  chunk->size = size;
+
+  mm_chunk_t *tail = make_chunk(offset_addr(chunk, chunk_span(chunk)), rest, chunk);
+  if (next != NULL) {
+    set_prev_chunk(next, tail);
+  } else {
+    heap->last_chunk = tail;
+  }
+  bin_insert(heap, tail);
+}
+
+/* merges a chunk with the chunk that follows it */
+static void merge_next_chunk(mm_heap_t *heap, mm_chunk_t *chunk, mm_chunk_t *next) {
+  mm_chunk_t *after = get_next_chunk(heap, next);
+  chunk->size += chunk_span(next);
+  next->magic = 0;
+  if (after != NULL) {
+    set_prev_chunk(after, chunk);
+  } else {
+    heap->last_chunk = chunk;
+  }
+}
+
+static inline bool can_merge(mm_chunk_t *a, mm_chunk_t *b) {
+  return a->size + chunk_span(b) <= CHUNK_MAX_SIZE;
+}
+
+// ----- kmalloc -----
+
+static noreturn void heap_out_of_memory(mm_heap_t *heap) {
+  kprintf("heap: heap out of memory\n");
+  kprintf("      size = %zu\n", heap->size);
+  kprintf("      used = %zu\n", heap->used);
+  kprintf("      alloc count = %zu\n", heap->stats.alloc_count);
+  kprintf("      free count = %zu\n", heap->stats.free_count);
+
+  kprintf("      request_sizes:\n");
+  for (int i = 0; i < ARRAY_SIZE(hist_labels); i++) {
+    kprintf("        %s - %zu\n", hist_labels[i], heap->stats.alloc_sizes[i]);
+  }
+
+  panic("[kmalloc] error - out of memory");
+}
+
+/* returns the padding needed in front of a chunk so that its data is aligned */
+static inline size_t chunk_align_padding(uintptr_t chunk_addr, size_t alignment) {
+  uintptr_t mem = chunk_addr + sizeof(mm_chunk_t);
+  size_t padding = align(mem, alignment) - mem;
+  // the padding becomes a free chunk so it must be large enough to hold one
+  while (padding != 0 && padding < sizeof(mm_chunk_t) + CHUNK_MIN_SIZE) {
+    padding += alignment;
+  }
+  return padding;
+}
+
+/* allocates a chunk from the given heap or returns NULL if it is out of memory */
+static void *heap_alloc(mm_heap_t *heap, size_t req_size, size_t alignment) {
+  size_t size = align(max(req_size, CHUNK_MIN_SIZE), CHUNK_SIZE_ALIGN);
+
+  // chunk memory is always CHUNK_SIZE_ALIGN aligned, larger alignments
+  // need enough extra space to split off a free chunk in front
+  size_t search_size = size;
+  if (alignment > CHUNK_SIZE_ALIGN) {
+    search_size += alignment + sizeof(mm_chunk_t) + CHUNK_MIN_SIZE;
+  }
+
+  mm_chunk_t *chunk = NULL;
+  if (search_size <= CHUNK_MAX_SIZE) {
+    chunk = bin_take(heap, search_size);
+  }
+
+  if (chunk != NULL) {
+    size_t padding = chunk_align_padding((uintptr_t) chunk, alignment);
+    if (padding > 0) {
+      // split off the front of the chunk
+      mm_chunk_t *front = chunk;
+      mm_chunk_t *next = get_next_chunk(heap, front);
+      size_t front_size = padding - sizeof(mm_chunk_t);
+      chunk = make_chunk(offset_addr(front, padding), front->size - padding, front);
+      front->size = front_size;
+      if (next != NULL) {
+        set_prev_chunk(next, chunk);
+      } else {
+        heap->last_chunk = chunk;
       }
+      bin_insert(heap, front);
+    }
+  } else {
+    // nothing fits so carve a new chunk out of the unmanaged heap memory
+    uintptr_t chunk_addr = heap->virt_addr;
+    if (heap->last_chunk != NULL) {
+      chunk_addr = offset_addr(heap->last_chunk, chunk_span(heap->last_chunk));
     }
 
-    if (chunk != NULL) {
-      // kprintf("[kmalloc] used chunk found (size %d)\n", chunk->size);
-      // if a chunk was found remove it from the list
-      LIST_REMOVE(&heap->chunks, chunk, list);
-      chunk->free = false;
+    size_t padding = chunk_align_padding(chunk_addr, alignment);
+    if (chunk_addr + padding + sizeof(mm_chunk_t) + size > END_ADDR(heap)) {
+      return NULL;
+    }
 
-      heap->used += size + sizeof(mm_chunk_t);
-      release_heap(heap);
-      return offset_ptr(chunk, sizeof(mm_chunk_t));
+    if (padding > 0) {
+      mm_chunk_t *front = make_chunk(chunk_addr, padding - sizeof(mm_chunk_t), heap->last_chunk);
+      heap->last_chunk = front;
+      bin_insert(heap, front);
+      chunk_addr += padding;
     }
+
+    chunk = make_chunk(chunk_addr, size, heap->last_chunk);
+    heap->last_chunk = chunk;
+  }
+
+  split_chunk(heap, chunk, size);
+  heap->used += chunk_span(chunk);
+  heap->stats.alloc_count++;
+  heap->stats.alloc_sizes[get_hist_bucket(req_size)]++;
+  return offset_ptr(chunk, sizeof(mm_chunk_t));
+}
+
+/* returns a chunk to the heap it was allocated from */
+static void heap_free(mm_heap_t *heap, mm_chunk_t *chunk) {
+  if (chunk->free) {
+    kprintf("[kfree] freeing already freed chunk\n");
+    return;
+  }
+  if (!(LIST_NEXT(chunk, list) == NULL && LIST_PREV(chunk, list) == NULL)) {
+    panic("[kfree] error - chunk linked to other chunks");
+  }
+
+  heap->stats.free_count++;
+  heap->used -= chunk_span(chunk);
+
+  // coalesce with the free neighbours
+  mm_chunk_t *next = get_next_chunk(heap, chunk);
+  if (next != NULL && next->free && can_merge(chunk, next)) {
+    bin_remove(heap, next);
+    merge_next_chunk(heap, chunk, next);
   }
 
-  // kprintf("[kmalloc] creating new chunk\n");
-  // if we get this far it means that no existing chunk could
-  // fit the requested size therefore a new chunk must be made.
+  mm_chunk_t *prev = get_prev_chunk(chunk);
+  if (prev != NULL && prev->free && can_merge(prev, chunk)) {
+    bin_remove(heap, prev);
+    merge_next_chunk(heap, prev, chunk);
+    chunk = prev;
+  }
 
-  // create new chunk
-  uintptr_t chunk_addr;
-  if (heap->last_chunk == NULL) {
-    chunk_addr = heap->virt_addr;
+  if (chunk == heap->last_chunk) {
+    // give the trailing free chunks back to the unmanaged heap memory
+    heap->last_chunk = get_prev_chunk(chunk);
+    chunk->magic = 0;
+    while (heap->last_chunk != NULL && heap->last_chunk->free) {
+      chunk = heap->last_chunk;
+      bin_remove(heap, chunk);
+      heap->last_chunk = get_prev_chunk(chunk);
+      chunk->magic = 0;
+    }
   } else {
-    chunk_addr = offset_addr(heap->last_chunk, sizeof(mm_chunk_t) + heap->last_chunk->size);
+    bin_insert(heap, chunk);
   }
+}
 
-  // fix alignment
-  uintptr_t aligned_mem = align(chunk_addr + sizeof(mm_chunk_t), alignment);
-  uintptr_t aligned_chunk = aligned_mem - sizeof(mm_chunk_t);
+// ----- regions -----
+//
+// Besides the initial kheap all heap memory comes from 2MB regions which are
+// each backed by a single big page. A region holds its heap struct at the start
+// of its naturally aligned mapping so the owning heap of any chunk is found by
+// aligning the chunk address down. The aligned address is only dereferenced
+// once the region registry confirms that it really is a region. Every cpu
+// allocates from its own chain of regions (arenas) and the shared kheap grows
+// by chaining shared regions.
+//
 
-  if (aligned_chunk != chunk_addr) {
-    size_t hole_size = aligned_chunk - chunk_addr;
-    if (hole_size < sizeof(mm_chunk_t) + CHUNK_MIN_SIZE) {
-      // we can't create a new chunk here, so we need to create a hole
-      ((uint16_t *) chunk_addr)[0] = HOLE_MAGIC;
-      ((uint16_t *) chunk_addr)[1] = hole_size;
-      heap->used += hole_size;
-    } else {
-      // create a new free chunk
-      mm_chunk_t *free_chunk = (void *) chunk_addr;
-      free_chunk->magic = CHUNK_MAGIC;
-      free_chunk->size = hole_size - sizeof(mm_chunk_t);
-      free_chunk->free = true;
-      LIST_ADD_FRONT(&heap->chunks, free_chunk, list);
+static inline size_t heap_region_slot(uintptr_t addr) {
+  return (addr / HEAP_REGION_SIZE) & (HEAP_MAX_REGIONS - 1);
+}
+
+static bool heap_register_region(mm_heap_t *region) {
+  uintptr_t addr = (uintptr_t) region;
+  size_t slot = heap_region_slot(addr);
+  spin_lock(&heap_regions_lock);
+  for (size_t i = 0; i < HEAP_MAX_REGIONS; i++) {
+    if (heap_regions[slot] == 0) {
+      // the region is fully initialized before it can be found
+      heap_regions[slot] = addr;
+      spin_unlock(&heap_regions_lock);
+      return true;
     }
+    slot = (slot + 1) & (HEAP_MAX_REGIONS - 1);
+  }
+  spin_unlock(&heap_regions_lock);
+  return false;
+}
+
+static bool heap_is_region(uintptr_t addr) {
+  // lookups are lock-free since entries are never removed
+  size_t slot = heap_region_slot(addr);
+  for (size_t i = 0; i < HEAP_MAX_REGIONS; i++) {
+    uintptr_t entry = heap_regions[slot];
+    if (entry == addr) {
+      return true;
+    } else if (entry == 0) {
+      return false;
+    }
+    slot = (slot + 1) & (HEAP_MAX_REGIONS - 1);
+  }
+  return false;
+}
+
+/* returns the heap which owns the given pointer or NULL */
+static mm_heap_t *get_owning_heap(void *ptr) {
+  uintptr_t addr = (uintptr_t) ptr;
+  if (addr >= kheap.virt_addr && addr < END_ADDR(&kheap)) {
+    return &kheap;
+  }
+
+  uintptr_t region_addr = align_down(addr, HEAP_REGION_SIZE);
+  if (!heap_is_region(region_addr)) {
+    return NULL;
+  }
+
+  mm_heap_t *region = (void *) region_addr;
+  if (addr < region->virt_addr || addr >= END_ADDR(region)) {
+    return NULL;
+  }
+  return region;
+}
+
+static mm_heap_t *heap_create_region(uint32_t cpu_id) {
+  page_t *page = _try_alloc_pages(1, PG_WRITE | PG_BIGPAGE);
+  if (page == NULL) {
+    return NULL;
+  }
+
+  mm_heap_t *region = _vmap_named_pages(page, "heap region");
+  if (region == NULL) {
+    _free_pages(page);
+    return NULL;
+  }
+  kassert(is_aligned((uintptr_t) region, HEAP_REGION_SIZE));
+  memset(region, 0, sizeof(mm_heap_t));
+
+  size_t offset = align(sizeof(mm_heap_t), CHUNK_SIZE_ALIGN);
+  region->magic = HEAP_MAGIC;
+  region->phys_addr = page->address + offset;
+  region->virt_addr = (uintptr_t) region + offset;
+  region->pages = page;
+  region->size = HEAP_REGION_SIZE - offset;
+  region->cpu_id = cpu_id;
+  for (int i = 0; i < HEAP_NUM_BINS; i++) {
+    LIST_INIT(&region->bins[i]);
+  }
+  mutex_init(&region->lock, MUTEX_REENTRANT | MUTEX_SHARED);
+  if (!heap_register_region(region)) {
+    kprintf("heap: region registry is full\n");
+    _vunmap_pages(page);
+    _free_pages(page);
+    return NULL;
+  }
+  return region;
+}
+
+/* frees the chunks that other cpus have pushed onto the remote free list */
+static void arena_drain_remote_frees(mm_heap_t *arena) {
+  if (arena->remote_free == NULL) {
+    return;
   }
 
-  if (aligned_mem + size > END_ADDR(heap)) {
-    kprintf("heap: heap out of memory\n");
-    kprintf("      size = %zu\n", heap->size);
-    kprintf("      used = %zu\n", heap->used);
-    kprintf("      alloc count = %zu\n", heap->stats.alloc_count);
-    kprintf("      free count = %zu\n", heap->stats.free_count);
+  mm_chunk_t *chunk = atomic_xchg(&arena->remote_free, NULL);
+  while (chunk != NULL) {
+    mm_chunk_t *next = LIST_NEXT(chunk, list);
+    chunk->list.next = NULL;
+    heap_free(arena, chunk);
+    chunk = next;
+  }
+}
+
+static void arena_push_remote_free(mm_heap_t *arena, mm_chunk_t *chunk) {
+  mm_chunk_t *head;
+  do {
+    head = arena->remote_free;
+    chunk->list.next = head;
+  } while (!atomic_cas(&arena->remote_free, head, chunk));
+  atomic_fetch_add(&arena->stats.remote_free_count, 1);
+}
+
+/* allocates from the arenas of the current cpu (interrupts disabled) */
+static void *arena_alloc(size_t size, size_t alignment) {
+  uint32_t cpu_id = PERCPU_ID;
+  mm_heap_t *arena = heap_arenas[cpu_id];
+  if (arena == NULL) {
+    return NULL;
+  }
 
-    kprintf("      request_sizes:\n");
-    for (int i = 0; i < ARRAY_SIZE(hist_labels); i++) {
-      kprintf("        %s - %zu\n", hist_labels[i], heap->stats.alloc_sizes[i]);
+  for (mm_heap_t *heap = arena; heap != NULL; heap = heap->next) {
+    arena_drain_remote_frees(heap);
+    void *ptr = heap_alloc(heap, size, alignment);
+    if (ptr != NULL) {
+      return ptr;
     }
+  }
 
-    panic("[kmalloc] error - out of memory");
+  // grow the arena chain. mapping the region allocates from the heap
+  // itself so any nested allocations are served by the shared heap
+  if (arena_growing[cpu_id]) {
+    return NULL;
+  }
+  arena_growing[cpu_id] = true;
+  mm_heap_t *region = heap_create_region(cpu_id);
+  arena_growing[cpu_id] = false;
+  if (region == NULL) {
+    return NULL;
   }
 
-  mm_chunk_t *chunk = (void *) aligned_chunk;
-  chunk->magic = CHUNK_MAGIC;
-  chunk->size = size;
-  chunk->free = false;
-  chunk->list.next = NULL;
-  chunk->list.prev = NULL;
-  if (heap->last_chunk != NULL) {
-    // chunk->prev_size = heap->last_chunk->size;
-    // chunk->prev_free = heap->last_chunk->free;
-    chunk->prev_offset = aligned_chunk - (uintptr_t) heap->last_chunk;
-  } else {
-    // chunk->prev_size = 0;
-    // chunk->prev_free = false;
-    chunk->prev_offset = 0;
+  region->next = heap_arenas[cpu_id];
+  heap_arenas[cpu_id] = region;
+  return heap_alloc(region, size, alignment);
+}
+
+static inline uintptr_t shared_grower_id() {
+  // nested allocations made while mapping a region come from the same thread
+  thread_t *thread = PERCPU_THREAD;
+  return thread != NULL ? (uintptr_t) thread : PERCPU_ID + 1;
+}
+
+/* allocates from the shared heap and grows it if needed */
+static void *shared_alloc(size_t size, size_t alignment) {
+  void *ptr;
+LABEL(retry);
+  ptr = NULL;
+  aquire_heap(&kheap);
+  for (mm_heap_t *heap = &kheap; heap != NULL && ptr == NULL; heap = heap->next) {
+    ptr = heap_alloc(heap, size, alignment);
+  }
+  release_heap(&kheap);
+  if (ptr != NULL || !heap_vm_ready) {
+    return ptr;
   }
 
-  heap->last_chunk = chunk;
-  heap->used += size + sizeof(mm_chunk_t);
+  // the heap lock cant be held while the region is mapped
+  uintptr_t id = shared_grower_id();
+  if (shared_grower == id) {
+    // nested allocation from the region being mapped
+    return NULL;
+  }
+  if (!atomic_cas(&shared_grower, 0, id)) {
+    // another thread is already growing the heap so wait for it to finish
+    // and then try the new region
+    while (shared_grower != 0) {
+      uint64_t irq_flags;
+      temp_irq_save(irq_flags);
+      ipi_poll_invlpg();
+      temp_irq_restore(irq_flags);
+      cpu_pause();
+    }
+    goto retry;
+  }
+  mm_heap_t *region = heap_create_region(HEAP_SHARED_CPU);
+  atomic_xchg(&shared_grower, 0);
+  if (region == NULL) {
+    return NULL;
+  }
 
-  release_heap(heap);
-  return offset_ptr(chunk, sizeof(mm_chunk_t));
+  aquire_heap(&kheap);
+  mm_heap_t *last = &kheap;
+  while (last->next != NULL) {
+    last = last->next;
+  }
+  last->next = region;
+  ptr = heap_alloc(region, size, alignment);
+  release_heap(&kheap);
+  return ptr;
+}
+
+void kheap_init_cpu_arena() {
+  kassert(heap_arenas[PERCPU_ID] == NULL);
+  mm_heap_t *arena = heap_create_region(PERCPU_ID);
+  if (arena == NULL) {
+    kprintf("heap: failed to allocate arena for CPU#%d\n", PERCPU_ID);
+    return;
+  }
+  heap_arenas[PERCPU_ID] = arena;
+}
+
+// ----- large objects -----
+//
+// Requests of at least CHUNK_LARGE_SIZE bypass the heap and get their own page
+// mapping. The header sits right in front of the returned pointer just like a
+// chunk header, so kfree can tell the two apart by the magic number.
+//
+
+static const char *large_mapping_name = "kmalloc large";
+
+static inline mm_large_chunk_t *get_large_chunk(void *ptr) {
+  mm_large_chunk_t *large = offset_ptr(ptr, -sizeof(mm_large_chunk_t));
+  return large->magic == LARGE_CHUNK_MAGIC ? large : NULL;
+}
+
+static void *large_alloc(size_t size, size_t alignment) {
+  size_t offset = align(sizeof(mm_large_chunk_t), max(alignment, CHUNK_SIZE_ALIGN));
+  size_t count = SIZE_TO_PAGES(offset + size);
+  // the caller reports running out of memory
+  page_t *pages = _try_alloc_pages(count, PG_WRITE);
+  if (pages == NULL) {
+    return NULL;
+  }
+
+  void *base = _vmap_named_pages(pages, large_mapping_name);
+  if (base == NULL) {
+    _free_pages(pages);
+    return NULL;
+  }
+
+  mm_large_chunk_t *large = offset_ptr(base, offset - sizeof(mm_large_chunk_t));
+  large->magic = LARGE_CHUNK_MAGIC;
+  large->offset = offset;
+  large->pages = pages;
+  large->size = size;
+
+  atomic_fetch_add(&kheap.stats.large_alloc_count, 1);
+  atomic_fetch_add(&kheap.stats.large_used, PAGES_TO_SIZE(count));
+  return offset_ptr(base, offset);
+}
+
+static void large_free(mm_large_chunk_t *large) {
+  page_t *pages = large->pages;
+  large->magic = 0;
+  atomic_fetch_add(&kheap.stats.large_free_count, 1);
+  atomic_fetch_sub(&kheap.stats.large_used, pages->head.list_sz);
+  vfree_pages(pages);
+}
+
+// ----- kmalloc -----
+
+static void *kmalloc_internal(size_t size, size_t alignment) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    panic("[kmalloc] invalid alignment given: %zu\n", alignment);
+  }
+
+  if (size == 0) {
+    return NULL;
+  }
+
+  void *ptr = NULL;
+  if (size >= CHUNK_LARGE_SIZE && alignment <= PAGE_SIZE && heap_vm_ready) {
+    ptr = large_alloc(size, alignment);
+    if (ptr == NULL) {
+      heap_out_of_memory(&kheap);
+    }
+    return ptr;
+  } else if (size > CHUNK_MAX_SIZE) {
+    panic("[kmalloc] error - request too large (%zu)\n", size);
+  }
+
+  // the arenas of the current cpu are only ever touched by that cpu
+  // so interrupts just need to be disabled while we use them
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  ptr = arena_alloc(size, alignment);
+  temp_irq_restore(irq_flags);
+  if (ptr != NULL) {
+    return ptr;
+  }
+
+  // fall back to the shared heap
+  ptr = shared_alloc(size, alignment);
+  if (ptr == NULL) {
+    heap_out_of_memory(&kheap);
+  }
+  return ptr;
 }
 
 void *kmalloc(size_t size) {
-  return __kmalloc(&kheap, size, CHUNK_MIN_ALIGN);
+  return kmalloc_internal(size, CHUNK_MIN_ALIGN);
 }
 
 void *kmallocz(size_t size) {
-  void *p = __kmalloc(&kheap, size, CHUNK_MIN_ALIGN);
+  void *p = kmalloc_internal(size, CHUNK_MIN_ALIGN);
   memset(p, 0, size);
   return p;
 }
 
 void *kmalloca(size_t size, size_t alignment) {
-  return __kmalloc(&kheap, size, alignment);
+  return kmalloc_internal(size, alignment);
 }
 
 // ----- kfree -----
 
-void __kfree(mm_heap_t *heap, void *ptr) {
-  kassert(heap != NULL);
+void kfree(void *ptr) {
   if (ptr == NULL) {
     return;
   }
 
-  heap->stats.free_count++;
+  mm_large_chunk_t *large = get_large_chunk(ptr);
+  if (large != NULL) {
+    large_free(large);
+    return;
+  }
 
   mm_chunk_t *chunk = offset_ptr(ptr, -sizeof(mm_chunk_t));
-  if (chunk->magic != CHUNK_MAGIC) {
+  mm_heap_t *heap = get_owning_heap(ptr);
+  if (heap == NULL || chunk->magic != CHUNK_MAGIC) {
     kprintf("[kfree] invalid pointer\n");
     return;
-  } else if (chunk->free) {
-    kprintf("[kfree] freeing already freed chunk\n");
-    return;
   }
 
-  aquire_heap(heap);
-  if (!(LIST_NEXT(chunk, list) == NULL && LIST_PREV(chunk, list) == NULL)) {
-    panic("[kfree] error - chunk linked to other chunks");
+  if (heap->cpu_id == HEAP_SHARED_CPU) {
+    aquire_heap(&kheap);
+    heap_free(heap, chunk);
+    release_heap(&kheap);
+    return;
   }
 
-  // kprintf("[kfree] freeing pointer %p\n", ptr);
-  chunk->free = true;
-  mm_chunk_t *next_chunk = get_next_chunk(heap, chunk);
-  if (next_chunk != NULL) {
-    // next_chunk->prev_free = true;
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  if (heap->cpu_id == PERCPU_ID) {
+    arena_drain_remote_frees(heap);
+    heap_free(heap, chunk);
+  } else {
+    // chunks owned by another cpu are handed back to it
+    arena_push_remote_free(heap, chunk);
   }
-
-  LIST_ADD_FRONT(&heap->chunks, chunk, list);
-  heap->used -= chunk->size + sizeof(mm_chunk_t);
-  release_heap(heap);
-}
-
-void kfree(void *ptr) {
-  __kfree(&kheap, ptr);
+  temp_irq_restore(irq_flags);
 }
 
 // ----- kcalloc -----
@@ -308,7 +778,7 @@ void *kcalloc(size_t nmemb, size_t size) {
   }
 
   size_t total = nmemb * size;
-  if (total > CHUNK_MAX_SIZE) {
+  if (total / nmemb != size) {
     panic("[kcalloc] error - request too large (%zu, %zu)\n", nmemb, size);
   }
 
@@ -322,8 +792,15 @@ void *kcalloc(size_t nmemb, size_t size) {
 // --------------------
 
 int kheap_is_valid_ptr(void *ptr) {
+  // only look for a large chunk header inside a large allocation mapping
+  vm_mapping_t *vm = heap_vm_ready ? _vmap_get_mapping((uintptr_t) ptr) : NULL;
+  if (vm != NULL && vm->name == large_mapping_name) {
+    return (uintptr_t) ptr >= vm->address + sizeof(mm_large_chunk_t) && get_large_chunk(ptr) != NULL;
+  }
+
   uintptr_t chunk_addr = offset_addr(ptr, -sizeof(mm_chunk_t));
-  if (chunk_addr < kheap.virt_addr || chunk_addr > END_ADDR(&kheap)) {
+  mm_heap_t *heap = get_owning_heap((void *) chunk_addr);
+  if (heap == NULL) {
     return false;
   }
 
@@ -340,8 +817,15 @@ uintptr_t kheap_ptr_to_phys(void *ptr) {
   }
 
   kassert(kheap_is_valid_ptr(ptr));
-  size_t offset = ((uintptr_t) ptr) - kheap.virt_addr;
-  return kheap.phys_addr + offset;
+  mm_large_chunk_t *large = get_large_chunk(ptr);
+  if (large != NULL) {
+    // the pages of a large chunk are physically contiguous
+    return large->pages->address + large->offset;
+  }
+
+  mm_heap_t *heap = get_owning_heap(ptr);
+  size_t offset = ((uintptr_t) ptr) - heap->virt_addr;
+  return heap->phys_addr + offset;
 }
 
 //
@@ -356,4 +840,37 @@ void kheap_dump_stats() {
   for (int i = 0; i < 8; i++) {
     kprintf("    %s - %zu\n", hist_labels[i], kheap.stats.alloc_sizes[i]);
   }
+
+  kprintf("  free bins:\n");
+  for (int i = 0; i < HEAP_NUM_BINS; i++) {
+    if (kheap.stats.bin_chunks[i] == 0) {
+      continue;
+    }
+
+    size_t min_size, max_size;
+    if (i < HEAP_NUM_SMALL_BINS) {
+      min_size = max_size = (i + 1) * CHUNK_SIZE_ALIGN;
+    } else {
+      min_size = (HEAP_SMALL_BIN_MAX << (i - HEAP_NUM_SMALL_BINS)) + CHUNK_SIZE_ALIGN;
+      max_size = HEAP_SMALL_BIN_MAX << (i - HEAP_NUM_SMALL_BINS + 1);
+    }
+    kprintf("    %zu-%zu - %zu chunks (%zu bytes)\n", min_size, max_size,
+            kheap.stats.bin_chunks[i], kheap.stats.bin_bytes[i]);
+  }
+
+  size_t num_shared = 0;
+  for (mm_heap_t *heap = kheap.next; heap != NULL; heap = heap->next) {
+    num_shared++;
+  }
+  kprintf("  shared regions = %zu\n", num_shared);
+  kprintf("  large objects: alloc count = %zu, free count = %zu, used = %zu\n",
+          kheap.stats.large_alloc_count, kheap.stats.large_free_count, kheap.stats.large_used);
+
+  for (size_t i = 0; i < MAX_CPUS; i++) {
+    for (mm_heap_t *arena = heap_arenas[i]; arena != NULL; arena = arena->next) {
+      kprintf("  CPU#%zu arena: used = %zu/%zu, alloc count = %zu, free count = %zu, remote frees = %zu\n",
+              i, arena->used, arena->size, arena->stats.alloc_count, arena->stats.free_count,
+              arena->stats.remote_free_count);
+    }
+  }
 }
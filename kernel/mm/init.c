@@ -5,6 +5,7 @@
 #include <mm/init.h>
 #include <mm/heap.h>
 #include <mm/pgtable.h>
+#include <mm/vmalloc.h>
 
 #include <cpu/cpu.h>
 #include <printf.h>
@@ -31,6 +32,7 @@ void mm_early_init() {
   early_init_pgtable();
 
   size_t usable_mem_size = 0;
+  uintptr_t phys_top = 0;
   memory_map_entry_t *kernel_entry = NULL;
   memory_map_entry_t *kernel_reserved_entry = NULL;
   uintptr_t kernel_start_phys = boot_info_v2->kernel_phys_addr;
@@ -62,10 +64,16 @@ void mm_early_init() {
       default: panic("bad memory map");
     }
 
+    if (entry->type != MEMORY_MAPPED_IO) {
+      phys_top = max(phys_top, end);
+    }
+
     if (entry->type == MEMORY_USABLE) {
       usable_mem_size += size;
-      // pick suitable range for kernel heap + reserved memory
-      if (kernel_reserved_entry == NULL && start >= SIZE_16MB && entry->size >= SIZE_8MB) {
+      // pick the largest range above 16MB for the kernel heap + reserved memory
+      // since the page frame metadata is carved out of it and scales with memory
+      if (start >= SIZE_16MB && entry->size >= SIZE_8MB &&
+          (kernel_reserved_entry == NULL || entry->size > kernel_reserved_entry->size)) {
         kernel_reserved_entry = entry;
         kernel_reserved_start = start;
         kernel_reserved_end = end;
@@ -111,16 +119,26 @@ void mm_early_init() {
             initrd_phys >= kernel_reserved_end);
   }
 
+  // the direct map page tables come out of the reserved memory
+  early_init_phys_map(phys_top);
+  kprintf("phys map: %p-%p\n", PHYS_MAP_VA, PHYS_MAP_VA + phys_map_size);
+
   early_init_pgtable();
   mm_init_kheap();
 }
 
 void mm_early_reserve_pages(size_t count) {
-  reserved_map_entry->base += PAGES_TO_SIZE(count);
-  reserved_map_entry->size -= PAGES_TO_SIZE(count);
-  if (reserved_map_entry->base > kernel_reserved_end) {
+  // hold back `count` pages past the current reserved pointer so that they
+  // are not handed out to the memory zones created from the memory map
+  uintptr_t new_base = kernel_reserved_ptr + PAGES_TO_SIZE(count);
+  if (new_base > kernel_reserved_end) {
     panic("out of reserved memory");
   }
+
+  if (new_base > reserved_map_entry->base) {
+    reserved_map_entry->size -= new_base - reserved_map_entry->base;
+    reserved_map_entry->base = new_base;
+  }
 }
 
 uintptr_t mm_early_alloc_pages(size_t count) {
@@ -132,8 +150,11 @@ uintptr_t mm_early_alloc_pages(size_t count) {
     panic("out of reserved memory");
   }
 
-  reserved_map_entry->base = kernel_reserved_ptr;
-  reserved_map_entry->size -= size;
+  // previously reserved pages are already excluded from the entry
+  if (kernel_reserved_ptr > reserved_map_entry->base) {
+    reserved_map_entry->size -= kernel_reserved_ptr - reserved_map_entry->base;
+    reserved_map_entry->base = kernel_reserved_ptr;
+  }
   return addr;
 }
 
@@ -26,10 +26,8 @@
 #define U_ENTRY 0ULL
 #define R_ENTRY 510ULL
 #define K_ENTRY 511ULL
-#define T_ENTRY 509ULL
 
 #define PML4_PTR ((uint64_t *) get_virt_addr(R_ENTRY, R_ENTRY, R_ENTRY, R_ENTRY))
-#define TEMP_PTR ((uint64_t *) get_virt_addr(R_ENTRY, R_ENTRY, R_ENTRY, T_ENTRY))
 
 // page entry flags
 #define PE_PRESENT        (1ULL << 0)
@@ -40,6 +38,7 @@
 #define PE_SIZE           (1ULL << 7)
 #define PE_GLOBAL         (1ULL << 8)
 #define PE_NO_EXECUTE     (1ULL << 63)
+#define PE_FRAME_MASK     0x000FFFFFFFFFF000ULL
 
 typedef enum pg_level {
   PG_LEVEL_PT,
@@ -54,10 +53,15 @@ void _print_pgtable_address(uint16_t l4, uint16_t l3, uint16_t l2, uint16_t l1);
 
 // kernel page table
 uint64_t *early_kernel_pgtable;
+// size of the direct map of physical memory
+size_t phys_map_size;
 
 uint64_t *get_child_pgtable_address(const uint64_t *parent, pg_level_t level, uint16_t index) {
-  uintptr_t addr = (uintptr_t) parent;
-  addr |= (index << pg_level_to_shift(level));
+  // the child of a recursively mapped table is reached by shifting
+  // the table indexes up one level and appending the entry index
+  kassert(level > PG_LEVEL_PT);
+  uintptr_t addr = ((uintptr_t) parent << 9) & 0x0000FFFFFFFFF000ULL;
+  addr |= (0xFFFFULL << 48) | ((uint64_t) index << 12);
   return (uint64_t *) addr;
 }
 
@@ -184,6 +188,22 @@ void *early_map_entries(uintptr_t virt_addr, uintptr_t phys_addr, size_t count,
   return addr;
 }
 
+void early_init_phys_map(uintptr_t phys_top) {
+  uint32_t flags = PG_WRITE | PG_GLOBAL | PG_BIGPAGE;
+  size_t stride = SIZE_2MB;
+  if (cpuid_query_bit(CPUID_BIT_PDPE1GB)) {
+    flags = PG_WRITE | PG_GLOBAL | PG_HUGEPAGE;
+    stride = SIZE_1GB;
+  }
+
+  phys_map_size = align(phys_top, stride);
+  if (phys_map_size > PHYS_MAP_MAX_SIZE) {
+    kprintf("phys map: only mapping %M of %M\n", PHYS_MAP_MAX_SIZE, phys_map_size);
+    phys_map_size = PHYS_MAP_MAX_SIZE;
+  }
+  early_map_entries(PHYS_MAP_VA, 0, phys_map_size / stride, flags);
+}
+
 //
 
 void init_recursive_pgtable(uint64_t *table_virt, uintptr_t table_phys) {
@@ -203,94 +223,169 @@ void pgtable_unmap_user_mappings() {
   }
 }
 
-uint64_t *recursive_map_entry(uintptr_t virt_addr, uintptr_t phys_addr, uint32_t flags, page_t **out_pages) {
-  LIST_HEAD(page_t) table_pages = LIST_HEAD_INITR;
-  pg_level_t level = PG_LEVEL_PT;
+static pg_level_t pg_flags_to_level(uint32_t flags) {
   if (flags & PG_BIGPAGE) {
-    level = PG_LEVEL_PD;
+    return PG_LEVEL_PD;
   } else if (flags & PG_HUGEPAGE) {
-    level = PG_LEVEL_PDP;
+    return PG_LEVEL_PDP;
   }
+  return PG_LEVEL_PT;
+}
+
+static uint16_t pg_entry_flags(uintptr_t virt_addr, uint32_t flags) {
+  uint16_t entry_flags = page_to_entry_flags(flags);
+  if (virt_addr >= KERNEL_SPACE_START) {
+    // kernel pages are shared by every pcid
+    entry_flags |= PE_GLOBAL;
+  }
+  return entry_flags;
+}
 
+/* returns the table holding the entry for the address at the given level, creating any missing tables */
+static uint64_t *recursive_walk_create(uintptr_t virt_addr, pg_level_t level, page_t **table_pages) {
   uint16_t meta_flags = PE_WRITE | PE_PRESENT;
   if (virt_addr < USER_SPACE_END) {
     meta_flags |= PE_USER;
   }
 
-  uint16_t entry_flags = page_to_entry_flags(flags);
   for (pg_level_t i = PG_LEVEL_PML4; i > level; i--) {
     uint64_t *table = get_pgtable_address(virt_addr, i);
     int index = index_for_pg_level(virt_addr, i);
     uintptr_t next_table = table[index] & PAGE_FRAME_MASK;
     if (next_table == 0) {
-      // create new table
+      // create new table (cleared before it becomes reachable)
       page_t *table_page = _alloc_pages(1, 0);
-      SLIST_ADD(&table_pages, table_page, next);
+      memset(phys_to_virt(table_page->address), 0, PAGE_SIZE);
+      table_page->next = *table_pages;
+      *table_pages = table_page;
       table[index] = table_page->address | meta_flags;
-      uint64_t *new_table = get_pgtable_address(virt_addr, i - 1);
-      memset(new_table, 0, PAGE_SIZE);
     } else if (!(table[index] & PE_PRESENT)) {
       table[index] = next_table | meta_flags;
     }
   }
+  return get_pgtable_address(virt_addr, level);
+}
 
+uint64_t *recursive_map_entry(uintptr_t virt_addr, uintptr_t phys_addr, uint32_t flags, page_t **out_pages) {
+  page_t *table_pages = NULL;
+  pg_level_t level = pg_flags_to_level(flags);
+  uint64_t *table = recursive_walk_create(virt_addr, level, &table_pages);
   int index = index_for_pg_level(virt_addr, level);
-  uint64_t *table = get_pgtable_address(virt_addr, level);
-  table[index] = phys_addr | entry_flags;
+  table[index] = phys_addr | pg_entry_flags(virt_addr, flags);
   if (out_pages != NULL) {
-    *out_pages = LIST_FIRST(&table_pages);
+    *out_pages = table_pages;
   }
   return table + index;
 }
 
-void recursive_unmap_entry(uintptr_t virt_addr, uint32_t flags) {
-  flags &= PAGE_FLAGS_MASK;
-  pg_level_t level = PG_LEVEL_PT;
-  if (flags & PG_BIGPAGE) {
-    level = PG_LEVEL_PD;
-  } else if (flags & PG_HUGEPAGE) {
-    level = PG_LEVEL_PDP;
+size_t recursive_map_range(uintptr_t virt_addr, uintptr_t phys_addr, size_t count, uint32_t flags, page_t **out_pages) {
+  page_t *table_pages = NULL;
+  pg_level_t level = pg_flags_to_level(flags);
+  size_t stride = 1ULL << pg_level_to_shift(level);
+  uint64_t entry_flags = pg_entry_flags(virt_addr, flags);
+  size_t mapped = 0;
+  while (mapped < count) {
+    // the tables are only walked once for every run of entries in the same table
+    uint64_t *table = recursive_walk_create(virt_addr, level, &table_pages);
+    int index = index_for_pg_level(virt_addr, level);
+    size_t run = min(count - mapped, 512 - index);
+    for (size_t i = 0; i < run; i++) {
+      table[index + i] = (phys_addr + i * stride) | entry_flags;
+    }
+
+    virt_addr += run * stride;
+    phys_addr += run * stride;
+    mapped += run;
+  }
+
+  if (out_pages != NULL) {
+    *out_pages = table_pages;
   }
+  return mapped * stride;
+}
 
+void recursive_unmap_entry(uintptr_t virt_addr, uint32_t flags) {
+  pg_level_t level = pg_flags_to_level(flags & PAGE_FLAGS_MASK);
+  // the caller is responsible for invalidating the tlb entry
   int index = index_for_pg_level(virt_addr, level);
   get_pgtable_address(virt_addr, level)[index] = 0;
-  cpu_flush_tlb();
 }
 
-uint64_t recursive_duplicate_pgtable(
-  pg_level_t level,
-  uint64_t *dest_parent_table,
-  uint64_t *src_parent_table,
-  uint16_t index,
-  page_t **out_pages
-) {
-  if (level == PG_LEVEL_PT) {
-    return src_parent_table[index];
-  } else if ((src_parent_table[index] & PE_PRESENT) == 0) {
-    return 0;
+void recursive_unmap_range(uintptr_t virt_addr, size_t count, uint32_t flags) {
+  pg_level_t level = pg_flags_to_level(flags & PAGE_FLAGS_MASK);
+  size_t stride = 1ULL << pg_level_to_shift(level);
+  while (count > 0) {
+    int index = index_for_pg_level(virt_addr, level);
+    size_t run = min(count, 512 - index);
+    memset(get_pgtable_address(virt_addr, level) + index, 0, run * sizeof(uint64_t));
+    virt_addr += run * stride;
+    count -= run;
   }
+}
 
-  LIST_HEAD(page_t) table_pages = LIST_HEAD_INITR;
-  page_t *dest_page = _alloc_pages(1, 0);
-  dest_parent_table[index] = dest_page->address | PE_WRITE | PE_PRESENT;
-  SLIST_ADD(&table_pages, dest_page, next);
+/* returns the entry at the given level or 0 if it can not be reached */
+static uint64_t recursive_get_entry(uintptr_t virt_addr, pg_level_t level) {
+  for (pg_level_t i = PG_LEVEL_PML4; i > level; i--) {
+    uint64_t entry = get_pgtable_address(virt_addr, i)[index_for_pg_level(virt_addr, i)];
+    if (!(entry & PE_PRESENT) || (entry & PE_SIZE)) {
+      return 0;
+    }
+  }
+  return get_pgtable_address(virt_addr, level)[index_for_pg_level(virt_addr, level)];
+}
+
+bool recursive_is_bigpage(uintptr_t virt_addr) {
+  uint64_t entry = recursive_get_entry(virt_addr, PG_LEVEL_PD);
+  return (entry & (PE_PRESENT | PE_SIZE)) == (PE_PRESENT | PE_SIZE);
+}
+
+bool recursive_can_map_bigpage(uintptr_t virt_addr) {
+  // dont replace existing page tables since other cpus may still have them cached
+  return recursive_get_entry(virt_addr, PG_LEVEL_PD) == 0;
+}
 
-  uint64_t *src_table = get_child_pgtable_address(src_parent_table, index, level);
-  uint64_t *dest_table = get_child_pgtable_address(dest_parent_table, index, level);
+page_t *recursive_split_bigpage(uintptr_t virt_addr) {
+  kassert(recursive_is_bigpage(virt_addr));
+  uint64_t *table = get_pgtable_address(virt_addr, PG_LEVEL_PD);
+  int index = index_for_pg_level(virt_addr, PG_LEVEL_PD);
+  uint64_t entry = table[index];
+  uintptr_t phys_addr = entry & 0x000FFFFFFFE00000ULL;
+  uint64_t entry_flags = entry & ((PAGE_FLAGS_MASK & ~PE_SIZE) | PE_NO_EXECUTE);
+
+  // the new table is filled in before it is installed so the
+  // pages stay mapped the whole time
+  page_t *table_page = _alloc_pages(1, 0);
+  uint64_t *new_table = phys_to_virt(table_page->address);
   for (int i = 0; i < 512; i++) {
-    page_t *page_ptr = NULL;
-    dest_table[i] = recursive_duplicate_pgtable(level - 1, dest_table, src_table, i, &page_ptr);
-    if (page_ptr != NULL) {
-      SLIST_ADD_SLIST(&table_pages, page_ptr, SLIST_GET_LAST(page_ptr, next), next);
-    }
+    new_table[i] = (phys_addr + PAGES_TO_SIZE(i)) | entry_flags;
   }
 
-  if (out_pages != NULL) {
-    *out_pages = LIST_FIRST(&table_pages);
+  uint64_t meta_flags = PE_WRITE | PE_PRESENT;
+  if (virt_addr < USER_SPACE_END) {
+    meta_flags |= PE_USER;
+  }
+  table[index] = table_page->address | meta_flags;
+  // the recursive address of the new table used to alias the big page
+  cpu_invlpg((uintptr_t) get_pgtable_address(virt_addr, PG_LEVEL_PT));
+  return table_page;
+}
+
+static uint64_t fork_pgtable_entry(pg_level_t level, uint64_t entry, page_t **table_pages) {
+  if (level == PG_LEVEL_PT || !(entry & PE_PRESENT) || (entry & PE_SIZE)) {
+    // leaf entries are shared
+    return entry;
   }
 
-  uint16_t flags = src_parent_table[index] & PAGE_FLAGS_MASK;
-  return dest_page->address | flags;
+  page_t *table_page = _alloc_pages(1, 0);
+  table_page->next = *table_pages;
+  *table_pages = table_page;
+
+  uint64_t *src_table = phys_to_virt(entry & PE_FRAME_MASK);
+  uint64_t *dest_table = phys_to_virt(table_page->address);
+  for (int i = 0; i < 512; i++) {
+    dest_table[i] = fork_pgtable_entry(level - 1, src_table[i], table_pages);
+  }
+  return table_page->address | (entry & ~PE_FRAME_MASK);
 }
 
 //
@@ -322,16 +417,14 @@ uintptr_t create_new_ap_page_tables(page_t **out_pages) {
   SLIST_ADD(&table_pages, new_pml4, next);
 
   uint64_t *pml4 = PML4_PTR;
-  pml4[T_ENTRY] = PAGE_PHYS_ADDR(new_pml4) | PE_WRITE | PE_PRESENT;
-
-  uint64_t *table_virt = TEMP_PTR;
+  uint64_t *table_virt = phys_to_virt(PAGE_PHYS_ADDR(new_pml4));
   memset(table_virt, 0, PAGE_SIZE);
 
   // shallow copy kernel entries
   for (int i = PML4_INDEX(KERNEL_SPACE_START); i < PML4_INDEX(KERNEL_SPACE_END) + 1; i++) {
     if (i == R_ENTRY) {
       table_virt[i] = (uint64_t) PAGE_PHYS_ADDR(new_pml4) | PE_WRITE | PE_PRESENT;
-    } else if (i != T_ENTRY) {
+    } else {
       table_virt[i] = pml4[i];
     }
   }
@@ -339,76 +432,52 @@ uintptr_t create_new_ap_page_tables(page_t **out_pages) {
   // identity map bottom of memory
   page_t *new_low_pdpt = _alloc_pages(1, PG_WRITE);
   SLIST_ADD(&table_pages, new_low_pdpt, next);
-  table_virt[0] = PAGE_PHYS_ADDR(new_low_pdpt) | PE_WRITE | PE_PRESENT; // pml4 -> pdpe
-
-  uint64_t *low_pdpt = (void *) get_virt_addr(R_ENTRY, R_ENTRY, T_ENTRY, 0);
+  uint64_t *low_pdpt = phys_to_virt(PAGE_PHYS_ADDR(new_low_pdpt));
   memset(low_pdpt, 0, PAGE_SIZE);
+  table_virt[0] = PAGE_PHYS_ADDR(new_low_pdpt) | PE_WRITE | PE_PRESENT; // pml4 -> pdpe
 
   page_t *new_low_pde = _alloc_pages(1, PG_WRITE);
   SLIST_ADD(&table_pages, new_low_pde, next);
-  low_pdpt[0] = PAGE_PHYS_ADDR(new_low_pde) | PE_WRITE | PE_PRESENT; // pdpe -> pde
-
-  uint64_t* low_pde = (void *) get_virt_addr(R_ENTRY, T_ENTRY, 0, 0);
+  uint64_t* low_pde = phys_to_virt(PAGE_PHYS_ADDR(new_low_pde));
   memset(low_pde, 0, PAGE_SIZE);
+  low_pdpt[0] = PAGE_PHYS_ADDR(new_low_pde) | PE_WRITE | PE_PRESENT; // pdpe -> pde
   low_pde[0] = 0 | PE_SIZE | PE_WRITE | PE_PRESENT; // pde -> 2mb identity mapping
 
-  pml4[T_ENTRY] = 0;
   if (out_pages != NULL) {
     *out_pages = LIST_FIRST(&table_pages);
   }
   return PAGE_PHYS_ADDR(new_pml4);
 }
 
-uintptr_t deepcopy_fork_page_tables(page_t **out_pages) {
-  LIST_HEAD(page_t) table_pages = LIST_HEAD_INITR;
+uintptr_t fork_page_tables(page_t **out_pages) {
+  page_t *table_pages = NULL;
   page_t *new_pml4 = _alloc_pages(1, PG_WRITE);
-  SLIST_ADD(&table_pages, new_pml4, next);
-
-  PML4_PTR[T_ENTRY] = new_pml4->address | PE_WRITE | PE_PRESENT;
+  new_pml4->next = table_pages;
+  table_pages = new_pml4;
 
-  uint64_t *table_virt = TEMP_PTR;
+  // the new tables are built through the direct map so nothing
+  // has to be mapped into the current address space
+  uint64_t *pml4 = PML4_PTR;
+  uint64_t *table_virt = phys_to_virt(new_pml4->address);
   memset(table_virt, 0, PAGE_SIZE);
 
   // shallow copy kernel entries
-  for (int i = PML4_INDEX(KERNEL_SPACE_START); i < PML4_INDEX(KERNEL_SPACE_END); i++) {
-    if (i == T_ENTRY)
-      continue;
-
+  for (int i = PML4_INDEX(KERNEL_SPACE_START); i < PML4_INDEX(KERNEL_SPACE_END) + 1; i++) {
     if (i == R_ENTRY) {
       table_virt[i] = (uint64_t) new_pml4->address | PE_WRITE | PE_PRESENT;
     } else {
-      table_virt[i] = early_kernel_pgtable[i];
+      table_virt[i] = pml4[i];
     }
   }
 
-  // deep copy user entries
-  for (int i = PML4_INDEX(USER_SPACE_START); i < PML4_INDEX(USER_SPACE_END); i++) {
-    page_t *page_ptr = NULL;
-    uint64_t *src_table = (void *) get_virt_addr(R_ENTRY, R_ENTRY, R_ENTRY, i);
-    uint64_t *dest_table = TEMP_PTR;
-    TEMP_PTR[i] = recursive_duplicate_pgtable(PG_LEVEL_PDP, src_table, dest_table, i, &page_ptr);
-    if (page_ptr != NULL) {
-      SLIST_ADD_SLIST(&table_pages, page_ptr, SLIST_GET_LAST(page_ptr, next), next);
-    }
+  // copy the user paging structures. the leaf entries are copied as-is so
+  // the caller must write protect any pages which are shared copy-on-write
+  for (int i = PML4_INDEX(USER_SPACE_START); i < PML4_INDEX(USER_SPACE_END) + 1; i++) {
+    table_virt[i] = fork_pgtable_entry(PG_LEVEL_PML4, pml4[i], &table_pages);
   }
 
-  PML4_PTR[T_ENTRY] = 0;
   if (out_pages != NULL) {
-    *out_pages = LIST_FIRST(&table_pages);
+    *out_pages = table_pages;
   }
   return new_pml4->address;
 }
-
-//
-
-void _print_pgtable_indexes(uintptr_t addr) {
-  kprintf("[pgtable] %018p -> pml4[%d][%d][%d][%d]\n",
-          addr,
-          PML4_INDEX(addr), PDPT_INDEX(addr),
-          PDT_INDEX(addr), PT_INDEX(addr));
-}
-
-void _print_pgtable_address(uint16_t l4, uint16_t l3, uint16_t l2, uint16_t l1) {
-  kprintf("[pgtable] pml4[%d][%d][%d][%d] -> %018p\n",
-          l4, l3, l2, l1, get_virt_addr(l4, l3, l2, l1));
-}
@@ -5,20 +5,30 @@
 #include <mm/pmalloc.h>
 #include <mm/vmalloc.h>
 #include <mm/pgtable.h>
+#include <mm/zeropool.h>
 #include <mm/init.h>
 
+#include <cpu/cpu.h>
 #include <string.h>
 #include <printf.h>
 #include <panic.h>
-#include <bitmap.h>
 #include <init.h>
+#include <ipi.h>
+#include <atomic.h>
+
+#include <asm/bits.h>
 
 void *kmalloc(size_t size) __malloc_like;
 void kfree(void *ptr);
 
 static LIST_HEAD(mem_zone_t) mem_zones[MAX_ZONE_TYPE];
 static size_t zone_page_count[MAX_ZONE_TYPE];
-static size_t reserved_pages = 128;
+static size_t reserved_pages = 0;
+
+// flat array of page descriptors indexed by frame number (relative to mem_map_base_pfn)
+static page_t *mem_map;
+static size_t mem_map_base_pfn;
+static size_t mem_map_num_pfns;
 
 static size_t zone_limits[MAX_ZONE_TYPE] = {
   ZONE_LOW_MAX,
@@ -43,6 +53,425 @@ static mem_zone_type_t zone_alloc_order[MAX_ZONE_TYPE] = {
   [ZONE_TYPE_LOW] = MAX_ZONE_TYPE, // out of zones
 };
 
+//
+// Buddy Allocator
+//
+// The frames of each zone are managed by a binary buddy allocator which is stored
+// as an implicit binary tree. The root is node 1 and node `i` has the children `2i`
+// and `2i+1`. Each node holds the order of the largest free block in its subtree
+// plus one, or 0 if the subtree has no free frames. An allocated block is a node
+// whose value is 0 but whose children (if any) are not. The base of the tree is
+// aligned to the largest block that fits within the zone, so blocks are naturally
+// aligned in physical memory. Frames outside of the zone are marked as allocated.
+//
+
+#define BUDDY_MAX_ALIGN_ORDER 18 // 1GB
+#define BUDDY_FULL(level) ((uint8_t)((level) + 1))
+#define BUDDY_LEFT(node) ((node) << 1)
+#define BUDDY_RIGHT(node) (((node) << 1) + 1)
+
+#define buddy_index(zone, addr) ((size_t)(((addr) - (zone)->buddy_base) >> PAGE_SHIFT))
+
+static inline uint8_t order_floor(size_t n) {
+  return __bsr64(n);
+}
+
+static inline uint8_t order_ceil(size_t n) {
+  return n <= 1 ? 0 : __bsr64(n - 1) + 1;
+}
+
+static inline size_t page_frame_count(uint32_t flags) {
+  if (flags & PG_BIGPAGE) {
+    return SIZE_TO_PAGES(PAGE_SIZE_2MB);
+  } else if (flags & PG_HUGEPAGE) {
+    return SIZE_TO_PAGES(PAGE_SIZE_1GB);
+  }
+  return 1;
+}
+
+static inline bool buddy_is_block(const uint8_t *tree, size_t node, uint8_t level) {
+  return tree[node] == 0 && (level == 0 || tree[BUDDY_LEFT(node)] != 0);
+}
+
+static inline uint8_t buddy_merge(const uint8_t *tree, size_t node, uint8_t level) {
+  uint8_t left = tree[BUDDY_LEFT(node)];
+  uint8_t right = tree[BUDDY_RIGHT(node)];
+  if (left == BUDDY_FULL(level - 1) && right == BUDDY_FULL(level - 1)) {
+    // both halves are free so they coalesce into one block
+    return BUDDY_FULL(level);
+  }
+  return max(left, right);
+}
+
+static void buddy_update(uint8_t *tree, size_t node, uint8_t level) {
+  while (node > 1) {
+    node >>= 1;
+    level++;
+
+    uint8_t value = buddy_merge(tree, node, level);
+    if (tree[node] == value) {
+      break;
+    }
+    tree[node] = value;
+  }
+}
+
+/**
+ * Allocates a block of 2^order frames and returns the index of the first frame
+ * relative to the base of the tree, or -1 if no block is available.
+ */
+static ssize_t buddy_alloc(mem_zone_t *zone, uint8_t order) {
+  uint8_t *tree = zone->buddy_tree;
+  if (order > zone->buddy_order || tree[1] < BUDDY_FULL(order)) {
+    return -1;
+  }
+
+  size_t node = 1;
+  uint8_t level = zone->buddy_order;
+  while (level > order) {
+    // descend into the smallest subtree that can satisfy the request
+    // so that larger free blocks are kept intact
+    uint8_t left = tree[BUDDY_LEFT(node)];
+    uint8_t right = tree[BUDDY_RIGHT(node)];
+    node = BUDDY_LEFT(node);
+    if (left < BUDDY_FULL(order) || (right >= BUDDY_FULL(order) && right < left)) {
+      node++;
+    }
+    level--;
+  }
+
+  tree[node] = 0;
+  buddy_update(tree, node, level);
+  return (ssize_t)((node << level) - (1ULL << zone->buddy_order));
+}
+
+/**
+ * Returns `true` if all frames in the range [start, end) are free.
+ */
+static bool buddy_is_free(uint8_t *tree, size_t node, uint8_t level, size_t node_start, size_t start, size_t end) {
+  size_t node_end = node_start + (1ULL << level);
+  if (end <= node_start || start >= node_end || tree[node] == BUDDY_FULL(level)) {
+    return true;
+  } else if (tree[node] == 0) {
+    return false;
+  }
+
+  size_t half = node_start + (1ULL << (level - 1));
+  return buddy_is_free(tree, BUDDY_LEFT(node), level - 1, node_start, start, end) &&
+         buddy_is_free(tree, BUDDY_RIGHT(node), level - 1, half, start, end);
+}
+
+/**
+ * Marks all frames in the range [start, end) as allocated. The range must be free.
+ */
+static void buddy_reserve(uint8_t *tree, size_t node, uint8_t level, size_t node_start, size_t start, size_t end) {
+  size_t node_end = node_start + (1ULL << level);
+  if (end <= node_start || start >= node_end) {
+    return;
+  } else if (start <= node_start && end >= node_end) {
+    kassert(tree[node] == BUDDY_FULL(level));
+    tree[node] = 0;
+    return;
+  }
+
+  size_t half = node_start + (1ULL << (level - 1));
+  buddy_reserve(tree, BUDDY_LEFT(node), level - 1, node_start, start, end);
+  buddy_reserve(tree, BUDDY_RIGHT(node), level - 1, half, start, end);
+  tree[node] = buddy_merge(tree, node, level);
+}
+
+/**
+ * Frees all allocated frames in the range [start, end) and coalesces them with
+ * their free buddies. Allocated blocks which are only partially covered by the
+ * range are split. Returns the number of frames that were freed.
+ */
+static size_t buddy_release(uint8_t *tree, size_t node, uint8_t level, size_t node_start, size_t start, size_t end) {
+  size_t node_end = node_start + (1ULL << level);
+  if (end <= node_start || start >= node_end || tree[node] == BUDDY_FULL(level)) {
+    return 0;
+  }
+
+  if (buddy_is_block(tree, node, level)) {
+    if (start <= node_start && end >= node_end) {
+      tree[node] = BUDDY_FULL(level);
+      return 1ULL << level;
+    }
+
+    // only part of the block is being freed so split it into two allocated halves
+    tree[BUDDY_LEFT(node)] = 0;
+    tree[BUDDY_RIGHT(node)] = 0;
+  }
+
+  size_t half = node_start + (1ULL << (level - 1));
+  size_t freed = buddy_release(tree, BUDDY_LEFT(node), level - 1, node_start, start, end) +
+                 buddy_release(tree, BUDDY_RIGHT(node), level - 1, half, start, end);
+  tree[node] = buddy_merge(tree, node, level);
+  return freed;
+}
+
+static size_t buddy_tree_geometry(uintptr_t base, size_t size, uintptr_t *out_base, uint8_t *out_order) {
+  size_t num_pages = size >> PAGE_SHIFT;
+  uint8_t align_order = min(order_floor(num_pages), BUDDY_MAX_ALIGN_ORDER);
+  uintptr_t tree_base = align_down(base, PAGES_TO_SIZE(1ULL << align_order));
+  uint8_t order = order_ceil((base + size - tree_base) >> PAGE_SHIFT);
+
+  if (out_base != NULL) {
+    *out_base = tree_base;
+  }
+  if (out_order != NULL) {
+    *out_order = order;
+  }
+  return 2ULL << order; // number of tree nodes (bytes)
+}
+
+static size_t buddy_tree_reserved_pages(uintptr_t base, size_t size) {
+  size_t nbytes = buddy_tree_geometry(base, size, NULL, NULL);
+  if (nbytes < PAGES_TO_SIZE(2)) {
+    // allocated from the heap
+    return 0;
+  }
+  return SIZE_TO_PAGES(nbytes);
+}
+
+static void buddy_init(mem_zone_t *zone) {
+  size_t nbytes = buddy_tree_geometry(zone->base, zone->size, &zone->buddy_base, &zone->buddy_order);
+  if (nbytes < PAGES_TO_SIZE(2)) {
+    zone->buddy_tree = kmalloc(nbytes);
+  } else {
+    // too large for kmalloc
+    size_t num_tree_pages = SIZE_TO_PAGES(nbytes);
+    if (num_tree_pages > reserved_pages) {
+      panic("no more reserved pages (%d)", num_tree_pages);
+    }
+
+    uintptr_t buffer_phys = mm_early_alloc_pages(num_tree_pages);
+    zone->buddy_tree = mm_early_map_pages_reserved(buffer_phys, num_tree_pages, PG_WRITE);
+    reserved_pages -= num_tree_pages;
+  }
+
+  // every node starts out as one free block
+  uint8_t *tree = zone->buddy_tree;
+  for (uint8_t depth = 0; depth <= zone->buddy_order; depth++) {
+    memset(tree + (1ULL << depth), BUDDY_FULL(zone->buddy_order - depth), 1ULL << depth);
+  }
+
+  // reserve the frames before and after the zone
+  size_t start = buddy_index(zone, zone->base);
+  size_t end = buddy_index(zone, zone->base + zone->size);
+  size_t tree_end = 1ULL << zone->buddy_order;
+  if (start > 0) {
+    buddy_reserve(tree, 1, zone->buddy_order, 0, 0, start);
+  }
+  if (end < tree_end) {
+    buddy_reserve(tree, 1, zone->buddy_order, 0, end, tree_end);
+  }
+  zone->free_pages = end - start;
+}
+
+//
+// Per-CPU Page Cache
+//
+// Single 4k page allocations are served from a small per-cpu stack of frames
+// which is refilled from and drained back to the zones in batches. Only frames
+// from the normal and high zones are cached so the low and dma zones are left
+// for the callers which explicitly need them. Cached frames still look allocated
+// to the buddy tree, so requests for a specific address drain every cache before
+// giving up. A cache is only ever touched by its own cpu with interrupts disabled,
+// so other cpus ask it to drain itself with an ipi and wait for its bit in
+// `pcp_drain_pending` to clear.
+//
+
+#define PCP_CACHE_SIZE  64
+#define PCP_CACHE_BATCH 16
+
+typedef struct pcp_frame {
+  uintptr_t address;
+  mem_zone_t *zone;
+} pcp_frame_t;
+
+typedef struct __aligned(64) pcp_cache {
+  volatile size_t count;
+  pcp_frame_t frames[PCP_CACHE_SIZE];
+  struct {
+    size_t alloc_hits;   // allocations served from the cache
+    size_t alloc_misses; // allocations which required a refill
+    size_t free_hits;    // frees absorbed by the cache
+    size_t free_misses;  // frees which required a drain
+  } stats;
+} pcp_cache_t;
+
+static pcp_cache_t pcp_caches[MAX_CPUS];
+static volatile uint64_t pcp_drain_pending; // cpus asked to drain their cache
+
+static inline bool pcp_is_cached_zone(mem_zone_type_t type) {
+  return type == ZONE_TYPE_NORMAL || type == ZONE_TYPE_HIGH;
+}
+
+static void pcp_refill(pcp_cache_t *pcp) {
+  mem_zone_type_t zone_type = ZONE_ALLOC_DEFAULT;
+  while (pcp_is_cached_zone(zone_type) && pcp->count < PCP_CACHE_BATCH) {
+    mem_zone_t *zone;
+    LIST_FOREACH(zone, &mem_zones[zone_type], list) {
+      if (zone->free_pages == 0) {
+        continue;
+      }
+
+      spin_lock(&zone->lock);
+      while (pcp->count < PCP_CACHE_BATCH) {
+        ssize_t index = buddy_alloc(zone, 0);
+        if (index < 0) {
+          break;
+        }
+
+        zone->free_pages--;
+        pcp->frames[pcp->count].address = zone->buddy_base + PAGES_TO_SIZE(index);
+        pcp->frames[pcp->count].zone = zone;
+        pcp->count++;
+      }
+      spin_unlock(&zone->lock);
+
+      if (pcp->count == PCP_CACHE_BATCH) {
+        break;
+      }
+    }
+    zone_type = zone_alloc_order[zone_type];
+  }
+}
+
+static void pcp_drain(pcp_cache_t *pcp, size_t count) {
+  // the oldest frames are at the bottom of the stack so
+  // release those and keep the recently freed (hot) ones
+  count = min(count, pcp->count);
+  mem_zone_t *locked = NULL;
+  for (size_t i = 0; i < count; i++) {
+    pcp_frame_t *frame = &pcp->frames[i];
+    if (frame->zone != locked) {
+      if (locked != NULL) {
+        spin_unlock(&locked->lock);
+      }
+      locked = frame->zone;
+      spin_lock(&locked->lock);
+    }
+
+    size_t index = buddy_index(locked, frame->address);
+    locked->free_pages += buddy_release(locked->buddy_tree, 1, locked->buddy_order, 0, index, index + 1);
+  }
+  if (locked != NULL) {
+    spin_unlock(&locked->lock);
+  }
+
+  pcp->count -= count;
+  memmove(pcp->frames, pcp->frames + count, pcp->count * sizeof(pcp_frame_t));
+}
+
+static bool pcp_alloc_frame(pcp_frame_t *out_frame) {
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  pcp_cache_t *pcp = &pcp_caches[PERCPU_ID];
+  if (pcp->count == 0) {
+    pcp->stats.alloc_misses++;
+    pcp_refill(pcp);
+    if (pcp->count == 0) {
+      temp_irq_restore(irq_flags);
+      return false;
+    }
+  } else {
+    pcp->stats.alloc_hits++;
+  }
+
+  *out_frame = pcp->frames[--pcp->count];
+  temp_irq_restore(irq_flags);
+  return true;
+}
+
+static void pcp_free_frame(uintptr_t address, mem_zone_t *zone) {
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  pcp_cache_t *pcp = &pcp_caches[PERCPU_ID];
+  if (pcp->count == PCP_CACHE_SIZE) {
+    pcp->stats.free_misses++;
+    pcp_drain(pcp, PCP_CACHE_BATCH);
+  } else {
+    pcp->stats.free_hits++;
+  }
+
+  pcp->frames[pcp->count].address = address;
+  pcp->frames[pcp->count].zone = zone;
+  pcp->count++;
+  temp_irq_restore(irq_flags);
+}
+
+static void pcp_drain_all() {
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  uint8_t id = PERCPU_ID;
+  pcp_drain(&pcp_caches[id], pcp_caches[id].count);
+
+  uint64_t targets = 0;
+  for (uint8_t cpu = 0; cpu < system_num_cpus; cpu++) {
+    if (cpu != id && pcp_caches[cpu].count > 0) {
+      targets |= 1ULL << cpu;
+    }
+  }
+
+  if (targets != 0) {
+    atomic_fetch_or(&pcp_drain_pending, targets);
+    for (uint8_t cpu = 0; cpu < system_num_cpus; cpu++) {
+      if (targets & (1ULL << cpu)) {
+        ipi_deliver_cpu_id(IPI_PCP_DRAIN, cpu, 0);
+      }
+    }
+
+    while (pcp_drain_pending & targets) {
+      // another cpu may be waiting on us to drain our cache or finish a shootdown
+      pcp_drain_handler();
+      ipi_poll_invlpg();
+      cpu_pause();
+    }
+  }
+  temp_irq_restore(irq_flags);
+}
+
+void pcp_drain_handler() {
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  uint64_t bit = 1ULL << PERCPU_ID;
+  if (pcp_drain_pending & bit) {
+    // the bit is cleared only once the cache is empty
+    pcp_cache_t *pcp = &pcp_caches[PERCPU_ID];
+    pcp_drain(pcp, pcp->count);
+    atomic_fetch_and(&pcp_drain_pending, ~bit);
+  }
+  temp_irq_restore(irq_flags);
+}
+
+static bool zone_try_reserve_frames(mem_zone_t *zone, size_t start, size_t end) {
+  spin_lock(&zone->lock);
+  bool is_free = buddy_is_free(zone->buddy_tree, 1, zone->buddy_order, 0, start, end);
+  if (is_free) {
+    buddy_reserve(zone->buddy_tree, 1, zone->buddy_order, 0, start, end);
+    zone->free_pages -= end - start;
+  }
+  spin_unlock(&zone->lock);
+  return is_free;
+}
+
+/* marks the frames [start, end) of a zone as used if they are all free */
+static bool zone_reserve_frames(mem_zone_t *zone, size_t start, size_t end) {
+  if (zone_try_reserve_frames(zone, start, end)) {
+    return true;
+  }
+
+  if (pcp_is_cached_zone(zone->type)) {
+    // some of the frames may be sitting in a per-cpu cache
+    pcp_drain_all();
+    return zone_try_reserve_frames(zone, start, end);
+  }
+  return false;
+}
+
+//
+
 mem_zone_type_t get_mem_zone_type(uintptr_t addr) {
   if (addr < ZONE_LOW_MAX) {
     return ZONE_TYPE_LOW;
@@ -66,18 +495,36 @@ mem_zone_t *locate_owning_mem_zone(uintptr_t addr) {
   return NULL;
 }
 
+page_t *phys_to_page(uintptr_t addr) {
+  size_t pfn = addr >> PAGE_SHIFT;
+  if (mem_map == NULL || pfn < mem_map_base_pfn || pfn >= mem_map_base_pfn + mem_map_num_pfns) {
+    return NULL;
+  }
+  return &mem_map[pfn - mem_map_base_pfn];
+}
+
 page_t *make_page_structs(mem_zone_t *zone, uint64_t frame, size_t count, size_t stride, uint32_t flags) {
   size_t total_size = count * stride;
   kassert(total_size < UINT32_MAX);
 
   LIST_HEAD(page_t) pages = LIST_HEAD_INITR;
   while (count > 0) {
-    page_t *page = kmalloc(sizeof(page_t));
-    page->address = frame;
+    page_t *page;
+    if (zone != NULL) {
+      // frames owned by a zone use their descriptor in the mem_map
+      page = phys_to_page(frame);
+      kassert(page != NULL);
+      kassert(page->zone == zone);
+    } else {
+      // frames we dont own (or that are outside of the map) get their own
+      page = kmalloc(sizeof(page_t));
+      page->address = frame;
+      page->zone = NULL;
+    }
     page->flags = flags;
     page->reserved.raw = 0;
+    page->refcount = 1;
     page->mapping = NULL;
-    page->zone = zone;
     frame += stride;
 
     count--;
@@ -91,32 +538,27 @@ page_t *make_page_structs(mem_zone_t *zone, uint64_t frame, size_t count, size_t
   return first;
 }
 
-bitmap_t *alloc_pages_bitmap(size_t num_pages) {
-  bitmap_t *frames = NULL;
-  size_t nbytes = align(num_pages, 8) / 8;
-  if (nbytes >= PAGES_TO_SIZE(2)) {
-    // too large for kmalloc
-    size_t num_bmp_pages = SIZE_TO_PAGES(nbytes);
-    if (num_bmp_pages > reserved_pages) {
-      panic("no more reserved pages (%d)", num_bmp_pages);
-    }
-
-    uintptr_t buffer_phys = mm_early_alloc_pages(num_bmp_pages);
-    void *buffer = mm_early_map_pages_reserved(buffer_phys, num_bmp_pages, PG_WRITE | PG_NOCACHE);
-    memset(buffer, 0, nbytes);
-
-    frames = kmalloc(sizeof(bitmap_t));
-    frames->map = buffer;
-    frames->free = num_pages;
-    frames->used = 0;
-    frames->size = nbytes;
+/* zeroes the pages through the direct map (slow path for PG_ZERO) */
+static void zero_pages(page_t *pages) {
+  page_t *page = pages;
+  while (page != NULL) {
+    size_t size = PAGES_TO_SIZE(page_frame_count(page->flags));
+    memset(phys_to_virt(page->address), 0, size);
+    page = page->next;
+  }
+}
 
-    reserved_pages -= num_bmp_pages;
-  } else {
-    frames = create_bitmap(num_pages);
+static void release_page_struct(page_t *page) {
+  if (page->zone == NULL) {
+    kfree(page);
+    return;
   }
 
-  return frames;
+  page->flags = 0;
+  page->reserved.raw = 0;
+  page->refcount = 0;
+  page->mapping = NULL;
+  page->next = NULL;
 }
 
 //
@@ -132,55 +574,99 @@ static void remap_initrd_image(void *_arg) {
   initrd_vm->attr = VM_ATTR_MMIO;
 }
 
-void init_mem_zones() {
-  // reserve pages in zone entry
-  mm_early_reserve_pages(reserved_pages);
+/**
+ * Splits a usable memory range at the zone boundary it crosses (if any).
+ * Returns the number of resulting ranges.
+ */
+static int split_zone_ranges(uintptr_t base, size_t size, uintptr_t bases[2], size_t sizes[2]) {
+  mem_zone_type_t type = get_mem_zone_type(base);
+  mem_zone_type_t end_type = get_mem_zone_type(base + size - 1);
+  if (type == end_type) {
+    bases[0] = base;
+    sizes[0] = size;
+    return 1;
+  }
+
+  // an entry should never cross more than two zones
+  kassert(end_type - type == 1);
+  bases[0] = base;
+  sizes[0] = zone_limits[type] - base;
+  bases[1] = zone_limits[type];
+  sizes[1] = base + size - zone_limits[type];
+  return 2;
+}
 
+void init_mem_zones() {
   memory_map_t *memory_map = &boot_info_v2->mem_map;
   size_t num_entries = memory_map->size / sizeof(memory_map_entry_t);
+
+  // reserve enough pages for all of the buddy trees up front so that
+  // the zones do not overlap with the memory used to hold them
   for (size_t i = 0; i < num_entries; i++) {
     memory_map_entry_t *entry = &memory_map->map[i];
-    if (entry->type != MEMORY_USABLE) {
+    if (entry->type != MEMORY_USABLE || entry->size == 0) {
       continue;
     }
 
-    uintptr_t base = entry->base;
-    size_t size = entry->size;
-
-    mem_zone_type_t type = get_mem_zone_type(base);
-    mem_zone_type_t end_type = get_mem_zone_type(base + size - 1);
-    if (type != end_type) {
-      // an entry should never cross more than two zones
-      kassert(end_type - type == 1);
+    uintptr_t bases[2];
+    size_t sizes[2];
+    int count = split_zone_ranges(entry->base, entry->size, bases, sizes);
+    for (int j = 0; j < count; j++) {
+      reserved_pages += buddy_tree_reserved_pages(bases[j], sizes[j]);
+    }
+  }
 
-      // create new zone for end of entry
-      mem_zone_t *zone = kmalloc(sizeof(mem_zone_t));
-      zone->type = end_type;
-      zone->base = zone_limits[end_type];
-      zone->size = base + size - zone->base;
+  // the mem_map spans every usable frame so it also covers any holes in between
+  uintptr_t map_start = UINTPTR_MAX;
+  uintptr_t map_end = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    memory_map_entry_t *entry = &memory_map->map[i];
+    if (entry->type != MEMORY_USABLE || entry->size == 0) {
+      continue;
+    }
+    map_start = min(map_start, entry->base);
+    map_end = max(map_end, entry->base + entry->size);
+  }
+  kassert(map_start < map_end);
 
-      spin_init(&zone->lock);
+  mem_map_base_pfn = map_start >> PAGE_SHIFT;
+  mem_map_num_pfns = SIZE_TO_PAGES(map_end) - mem_map_base_pfn;
+  size_t num_map_pages = SIZE_TO_PAGES(mem_map_num_pfns * sizeof(page_t));
+  reserved_pages += num_map_pages;
+  mm_early_reserve_pages(reserved_pages);
 
-      size_t page_count = SIZE_TO_PAGES(zone->size);
-      zone->frames = alloc_pages_bitmap(page_count);
-      LIST_ADD(&mem_zones[end_type], zone, list);
-      zone_page_count[end_type] += page_count;
+  uintptr_t mem_map_phys = mm_early_alloc_pages(num_map_pages);
+  mem_map = mm_early_map_pages_reserved(mem_map_phys, num_map_pages, PG_WRITE);
+  memset(mem_map, 0, PAGES_TO_SIZE(num_map_pages));
+  reserved_pages -= num_map_pages;
 
-      // shrink original entry to end of zone
-      size = zone->base - base;
+  for (size_t i = 0; i < num_entries; i++) {
+    memory_map_entry_t *entry = &memory_map->map[i];
+    if (entry->type != MEMORY_USABLE || entry->size == 0) {
+      continue;
     }
 
-    mem_zone_t *zone = kmalloc(sizeof(mem_zone_t));
-    zone->type = type;
-    zone->base = base;
-    zone->size = size;
+    uintptr_t bases[2];
+    size_t sizes[2];
+    int count = split_zone_ranges(entry->base, entry->size, bases, sizes);
+    for (int j = 0; j < count; j++) {
+      mem_zone_t *zone = kmalloc(sizeof(mem_zone_t));
+      zone->type = get_mem_zone_type(bases[j]);
+      zone->base = bases[j];
+      zone->size = sizes[j];
+
+      spin_init(&zone->lock);
+      buddy_init(zone);
 
-    spin_init(&zone->lock);
+      page_t *zone_pages = phys_to_page(zone->base);
+      for (size_t k = 0; k < SIZE_TO_PAGES(zone->size); k++) {
+        zone_pages[k].address = zone->base + PAGES_TO_SIZE(k);
+        zone_pages[k].zone = zone;
+      }
 
-    size_t page_count = SIZE_TO_PAGES(size);
-    zone->frames = alloc_pages_bitmap(page_count);
-    LIST_ADD(&mem_zones[type], zone, list);
-    zone_page_count[type] += page_count;
+      LIST_ADD(&mem_zones[zone->type], zone, list);
+      zone_page_count[zone->type] += zone->free_pages;
+    }
   }
 
   kprintf("memory zones:\n");
@@ -218,64 +704,87 @@ page_t *_alloc_pages_zone(mem_zone_type_t zone_type, size_t count, uint32_t flag
     return NULL;
   }
 
-  size_t num_4k_pages = count;
-  size_t align = 0;
   size_t stride = PAGE_SIZE;
   if (flags & PG_BIGPAGE) {
     kassert((flags & PG_HUGEPAGE) == 0);
-    num_4k_pages = SIZE_TO_PAGES(count * PAGE_SIZE_2MB);
-    align = SIZE_TO_PAGES(PAGE_SIZE_2MB);
     stride = PAGE_SIZE_2MB;
   } else if (flags & PG_HUGEPAGE) {
-    num_4k_pages = SIZE_TO_PAGES(count * PAGE_SIZE_1GB);
-    align = SIZE_TO_PAGES(PAGE_SIZE_1GB);
     stride = PAGE_SIZE_1GB;
   }
 
+  // blocks are naturally aligned so big and huge pages need no extra alignment
+  size_t num_4k_pages = count * page_frame_count(flags);
+  uint8_t order = order_ceil(num_4k_pages);
+  size_t block_pages = 1ULL << order;
+
   // find zone to accommodate allocation
-  mem_zone_t *zone = LIST_FIRST(&mem_zones[zone_type]);
-  while (!zone || zone->frames->free < num_4k_pages) {
-    zone = zone ? LIST_NEXT(zone, list) : NULL;
-    if (!zone) {
-      if (flags & PG_FORCE) {
-        panic("out of memory in zone %s", zone_names[zone_type]);
+  mem_zone_t *zone;
+  ssize_t frame_index = -1;
+  LIST_FOREACH(zone, &mem_zones[zone_type], list) {
+    if (zone->free_pages < num_4k_pages) {
+      continue;
+    }
+
+    spin_lock(&zone->lock);
+    frame_index = buddy_alloc(zone, order);
+    if (frame_index >= 0) {
+      zone->free_pages -= block_pages;
+      if (block_pages > num_4k_pages) {
+        // give back the unused tail of the block
+        zone->free_pages += buddy_release(zone->buddy_tree, 1, zone->buddy_order, 0,
+                                          frame_index + num_4k_pages, frame_index + block_pages);
       }
-      return NULL;
     }
-  }
+    spin_unlock(&zone->lock);
 
-  // mark frames as used
-  spin_lock(&zone->lock);
-  index_t frame_index;
-  if (num_4k_pages == 1) {
-    // common case - fastest
-    frame_index = bitmap_get_set_free(zone->frames);
-  } else {
-    // less common case - slower
-    frame_index = bitmap_get_set_nfree(zone->frames, num_4k_pages, align);
+    if (frame_index >= 0) {
+      break;
+    }
   }
-  spin_unlock(&zone->lock);
+
   if (frame_index < 0) {
-    panic("out of memory");
+    if (flags & PG_FORCE) {
+      panic("out of memory in zone %s", zone_names[zone_type]);
+    }
+    return NULL;
   }
 
   // construct a list of page structs
-  uint64_t frame = zone->base + PAGES_TO_SIZE(frame_index);
+  uint64_t frame = zone->buddy_base + PAGES_TO_SIZE(frame_index);
   return make_page_structs(zone, frame, count, stride, flags);
 }
 
 /**
  * Allocates one or more physical pages from any zone. If there is insufficient
- * memory available to satisfy the request the function panic.
+ * memory available to satisfy the request the function returns NULL.
  */
-page_t *_alloc_pages(size_t count, uint32_t flags) {
+page_t *_try_alloc_pages(size_t count, uint32_t flags) {
   flags &= ~PG_FORCE;
 
+  // common case - single pages come from the per-cpu cache
+  if (count == 1 && !(flags & (PG_BIGPAGE | PG_HUGEPAGE))) {
+    if (flags & PG_ZERO) {
+      page_t *page = zero_pool_alloc(flags);
+      if (page != NULL) {
+        return page;
+      }
+    }
+
+    pcp_frame_t frame;
+    if (pcp_alloc_frame(&frame)) {
+      page_t *page = make_page_structs(frame.zone, frame.address, 1, PAGE_SIZE, flags);
+      if (flags & PG_ZERO) {
+        zero_pages(page);
+      }
+      return page;
+    }
+  }
+
   mem_zone_type_t zone_type = ZONE_ALLOC_DEFAULT;
   page_t *pages = NULL;
   while (pages == NULL) {
     if (zone_type == MAX_ZONE_TYPE) {
-      panic("out of memory");
+      return NULL;
     }
 
     pages = _alloc_pages_zone(zone_type, count, flags);
@@ -284,6 +793,21 @@ page_t *_alloc_pages(size_t count, uint32_t flags) {
     }
   }
 
+  if (flags & PG_ZERO) {
+    zero_pages(pages);
+  }
+  return pages;
+}
+
+/**
+ * Allocates one or more physical pages from any zone. If there is insufficient
+ * memory available to satisfy the request the function panic.
+ */
+page_t *_alloc_pages(size_t count, uint32_t flags) {
+  page_t *pages = _try_alloc_pages(count, flags);
+  if (pages == NULL) {
+    panic("out of memory");
+  }
   return pages;
 }
 
@@ -336,27 +860,20 @@ page_t *_alloc_pages_at(uintptr_t address, size_t count, uint32_t flags) {
 
   // mark frames as used
   kassert(zone != NULL);
-  spin_lock(&zone->lock);
-  size_t before_count;
-  index_t frame_index = SIZE_TO_PAGES(address - zone->base);
-  if (num_4k_pages == 1) {
-    // common case - fastest
-    before_count = bitmap_set(zone->frames, frame_index) ? 1 : 0;
-  } else {
-    // less common case - slower
-    before_count = bitmap_get_n(zone->frames, frame_index, num_4k_pages);
-    if (before_count == 0) {
-      bitmap_set_n(zone->frames, frame_index, num_4k_pages);
+  size_t start = buddy_index(zone, address);
+  size_t end = start + num_4k_pages;
+  bool is_free = zone_reserve_frames(zone, start, end);
+  if (!is_free) {
+    if (!(flags & PG_FORCE)) {
+      panic("requested pages are already allocated");
     }
-  }
-  spin_unlock(&zone->lock);
-  if (before_count == 0 && !(flags & PG_FORCE)) {
-    panic("requested pages are already allocated");
+    // the frames are owned by someone else so they must not be
+    // returned to the zone when these pages are freed
+    zone = NULL;
   }
 
   // construct a list of page structs
-  uint64_t frame = zone->base + PAGES_TO_SIZE(frame_index);
-  return make_page_structs(zone, frame, count, stride, flags);
+  return make_page_structs(zone, address, count, stride, flags);
 }
 
 int _reserve_pages(uintptr_t address, size_t count) {
@@ -382,21 +899,9 @@ int _reserve_pages(uintptr_t address, size_t count) {
 
   // mark frames as used
   kassert(zone != NULL);
-  spin_lock(&zone->lock);
-  size_t before_count;
-  index_t frame_index = SIZE_TO_PAGES(address - zone->base);
-  if (count == 1) {
-    // common case - fastest
-    before_count = bitmap_set(zone->frames, frame_index) ? 1 : 0;
-  } else {
-    // less common case - slower
-    before_count = bitmap_get_n(zone->frames, frame_index, count);
-    if (before_count == 0) {
-      bitmap_set_n(zone->frames, frame_index, count);
-    }
-  }
-  spin_unlock(&zone->lock);
-  if (before_count == 0) {
+  size_t start = buddy_index(zone, address);
+  size_t end = start + count;
+  if (!zone_reserve_frames(zone, start, end)) {
     panic("requested pages are already allocated");
   }
 
@@ -404,40 +909,73 @@ int _reserve_pages(uintptr_t address, size_t count) {
 }
 
 /**
- * Frees one or more physical pages.
+ * Frees one or more physical pages. Physically contiguous runs of pages are
+ * returned to their zone as a single range.
  */
 void _free_pages(page_t *page) {
   while (page != NULL) {
     mem_zone_t *zone = page->zone;
     if (zone == NULL) {
       page_t *next = page->next;
-      kfree(page);
+      release_page_struct(page);
       page = next;
       continue;
     }
 
-    size_t num_4k_pages = 1;
-    if (page->flags & PG_BIGPAGE) {
-      num_4k_pages = SIZE_TO_PAGES(PAGE_SIZE_2MB);
-    } else if (page->flags & PG_HUGEPAGE) {
-      num_4k_pages = SIZE_TO_PAGES(PAGE_SIZE_1GB);
+    uintptr_t start = page->address;
+    uintptr_t end = start + PAGES_TO_SIZE(page_frame_count(page->flags));
+    page_t *next = page->next;
+    release_page_struct(page);
+    while (next != NULL && next->zone == zone && next->address == end) {
+      end += PAGES_TO_SIZE(page_frame_count(next->flags));
+      page = next->next;
+      release_page_struct(next);
+      next = page;
     }
 
-    spin_lock(&zone->lock);
-    index_t index = SIZE_TO_PAGES(page->address - zone->base);
-    if (num_4k_pages == 1) {
-      bitmap_clear(zone->frames, index);
-    } else {
-      bitmap_clear_n(zone->frames, index, num_4k_pages);
+    if (end - start == PAGE_SIZE && pcp_is_cached_zone(zone->type)) {
+      // lone 4k frames go back to the per-cpu cache
+      pcp_free_frame(start, zone);
+      page = next;
+      continue;
     }
+
+    spin_lock(&zone->lock);
+    size_t freed = buddy_release(zone->buddy_tree, 1, zone->buddy_order, 0,
+                                 buddy_index(zone, start), buddy_index(zone, end));
+    zone->free_pages += freed;
     spin_unlock(&zone->lock);
+    if (freed != SIZE_TO_PAGES(end - start)) {
+      kprintf("pmalloc: freeing pages which are not allocated [%p-%p]\n", start, end);
+    }
 
-    page_t *next = page->next;
-    kfree(page);
     page = next;
   }
 }
 
+void pmalloc_dump_stats() {
+  for (size_t i = 0; i < MAX_ZONE_TYPE; i++) {
+    size_t free_pages = 0;
+    mem_zone_t *zone;
+    LIST_FOREACH(zone, &mem_zones[i], list) {
+      free_pages += zone->free_pages;
+    }
+    kprintf("  %s zone: %zu/%zu pages free\n", zone_names[i], free_pages, zone_page_count[i]);
+  }
+
+  kprintf("  per-cpu page caches:\n");
+  for (size_t i = 0; i < system_num_cpus; i++) {
+    pcp_cache_t *pcp = &pcp_caches[i];
+    size_t allocs = pcp->stats.alloc_hits + pcp->stats.alloc_misses;
+    size_t frees = pcp->stats.free_hits + pcp->stats.free_misses;
+    kprintf("    CPU#%zu: %zu cached, alloc %zu/%zu hits (%zu%%), free %zu/%zu hits (%zu%%)\n",
+            i, pcp->count,
+            pcp->stats.alloc_hits, allocs, allocs ? (pcp->stats.alloc_hits * 100) / allocs : 0,
+            pcp->stats.free_hits, frees, frees ? (pcp->stats.free_hits * 100) / frees : 0);
+  }
+  zero_pool_dump_stats();
+}
+
 //
 
 bool mm_is_kernel_code_ptr(uintptr_t ptr) {
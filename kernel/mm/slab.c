@@ -0,0 +1,301 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-02.
+//
+
+#include <mm/slab.h>
+#include <mm/heap.h>
+#include <mm/pmalloc.h>
+#include <mm/vmalloc.h>
+
+#include <cpu/cpu.h>
+
+#include <string.h>
+#include <printf.h>
+#include <panic.h>
+
+//
+// Slab Allocator
+//
+// Each cache carves objects out of single page slabs which are allocated from
+// pmalloc and addressed through the direct map, so growing a cache never goes
+// through the vm layer. The slab header lives at the start of its page so the
+// owning slab of an object is found by masking off the page offset. In front of the slabs each
+// cpu has a small magazine of objects which is only touched by that cpu with
+// interrupts disabled. Objects move between the magazines and the slabs in
+// batches of KMEM_MAGAZINE_BATCH under the cache lock.
+//
+
+#define KMEM_MAX_EMPTY_SLABS 1
+
+static LIST_HEAD(kmem_cache_t) kmem_caches;
+static spinlock_t kmem_caches_lock = {};
+
+static inline kmem_slab_t *obj_to_slab(void *obj) {
+  return (kmem_slab_t *) align_down((uintptr_t) obj, PAGE_SIZE);
+}
+
+static inline size_t slab_obj_offset(kmem_cache_t *cache) {
+  return align(sizeof(kmem_slab_t), cache->obj_align);
+}
+
+static kmem_slab_t *slab_create(kmem_cache_t *cache) {
+  page_t *page = _alloc_pages(1, PG_WRITE);
+  if (page == NULL) {
+    return NULL;
+  }
+
+  kmem_slab_t *slab = phys_to_virt(page->address);
+  slab->cache = cache;
+  slab->page = page;
+  slab->free = NULL;
+  slab->inuse = 0;
+  LIST_ENTRY_INIT(&slab->list);
+
+  // thread the free list through the objects in address order
+  uintptr_t obj = (uintptr_t) slab + slab_obj_offset(cache);
+  void **last = &slab->free;
+  for (size_t i = 0; i < cache->objs_per_slab; i++) {
+    *last = (void *) obj;
+    last = (void **) obj;
+    obj += cache->obj_size;
+  }
+  *last = NULL;
+  return slab;
+}
+
+static void slab_destroy(kmem_slab_t *slab) {
+  kassert(slab->inuse == 0);
+  _free_pages(slab->page);
+}
+
+//
+
+/* moves up to `count` objects from the slabs into the magazine (cache lock held) */
+static void cache_fill_magazine(kmem_cache_t *cache, kmem_magazine_t *mag, size_t count) {
+  while (mag->count < count) {
+    kmem_slab_t *slab = LIST_FIRST(&cache->partial);
+    if (slab == NULL) {
+      slab = LIST_FIRST(&cache->empty);
+      if (slab == NULL) {
+        break;
+      }
+      LIST_REMOVE(&cache->empty, slab, list);
+      LIST_ADD(&cache->partial, slab, list);
+      cache->num_empty--;
+    }
+
+    while (mag->count < count && slab->free != NULL) {
+      void *obj = slab->free;
+      slab->free = *((void **) obj);
+      slab->inuse++;
+      mag->objs[mag->count++] = obj;
+      cache->num_inuse++;
+    }
+
+    if (slab->free == NULL) {
+      LIST_REMOVE(&cache->partial, slab, list);
+      LIST_ADD(&cache->full, slab, list);
+    }
+  }
+}
+
+/* returns the `count` oldest objects in the magazine to their slabs (cache lock held) */
+static void cache_flush_magazine(kmem_cache_t *cache, kmem_magazine_t *mag, size_t count, kmem_slab_t **out_slabs) {
+  count = min(count, mag->count);
+  for (size_t i = 0; i < count; i++) {
+    void *obj = mag->objs[i];
+    kmem_slab_t *slab = obj_to_slab(obj);
+    kassert(slab->cache == cache);
+
+    if (slab->free == NULL) {
+      LIST_REMOVE(&cache->full, slab, list);
+      LIST_ADD(&cache->partial, slab, list);
+    }
+
+    *((void **) obj) = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    cache->num_inuse--;
+
+    if (slab->inuse == 0) {
+      LIST_REMOVE(&cache->partial, slab, list);
+      if (cache->num_empty < KMEM_MAX_EMPTY_SLABS) {
+        LIST_ADD(&cache->empty, slab, list);
+        cache->num_empty++;
+      } else {
+        // released by the caller once the lock is dropped
+        slab->list.next = *out_slabs;
+        *out_slabs = slab;
+        cache->num_slabs--;
+      }
+    }
+  }
+
+  mag->count -= count;
+  memmove(mag->objs, mag->objs + count, mag->count * sizeof(void *));
+}
+
+static void release_slabs(kmem_slab_t *slabs) {
+  while (slabs != NULL) {
+    kmem_slab_t *next = slabs->list.next;
+    slab_destroy(slabs);
+    slabs = next;
+  }
+}
+
+//
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t alignment) {
+  if (alignment == 0) {
+    alignment = sizeof(void *);
+  }
+  kassert((alignment & (alignment - 1)) == 0 && alignment <= PAGE_SIZE / 8);
+  kassert(size > 0 && size <= KMEM_MAX_OBJ_SIZE);
+
+  kmem_cache_t *cache = kmallocz(sizeof(kmem_cache_t));
+  cache->name = name;
+  cache->obj_size = align(max(size, sizeof(void *)), alignment);
+  cache->obj_align = alignment;
+  cache->objs_per_slab = (PAGE_SIZE - slab_obj_offset(cache)) / cache->obj_size;
+  kassert(cache->objs_per_slab > 0);
+
+  spin_init(&cache->lock);
+  LIST_INIT(&cache->partial);
+  LIST_INIT(&cache->full);
+  LIST_INIT(&cache->empty);
+
+  cache->magazines = kmalloca(sizeof(kmem_magazine_t) * MAX_CPUS, 64);
+  memset(cache->magazines, 0, sizeof(kmem_magazine_t) * MAX_CPUS);
+
+  spin_lock(&kmem_caches_lock);
+  LIST_ADD(&kmem_caches, cache, list);
+  spin_unlock(&kmem_caches_lock);
+  return cache;
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache) {
+  spin_lock(&kmem_caches_lock);
+  LIST_REMOVE(&kmem_caches, cache, list);
+  spin_unlock(&kmem_caches_lock);
+
+  kmem_slab_t *slabs = NULL;
+  spin_lock(&cache->lock);
+  for (size_t i = 0; i < MAX_CPUS; i++) {
+    kmem_magazine_t *mag = &cache->magazines[i];
+    cache_flush_magazine(cache, mag, mag->count, &slabs);
+  }
+
+  if (cache->num_inuse > 0 || LIST_FIRST(&cache->partial) || LIST_FIRST(&cache->full)) {
+    panic("kmem_cache_destroy: cache %s has %zu objects in use", cache->name, cache->num_inuse);
+  }
+
+  kmem_slab_t *slab;
+  while ((slab = LIST_FIRST(&cache->empty)) != NULL) {
+    LIST_REMOVE(&cache->empty, slab, list);
+    slab->list.next = slabs;
+    slabs = slab;
+  }
+  spin_unlock(&cache->lock);
+
+  release_slabs(slabs);
+  kfree(cache->magazines);
+  kfree(cache);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  kmem_magazine_t *mag = &cache->magazines[PERCPU_ID];
+  if (mag->count > 0) {
+    mag->stats.alloc_hits++;
+    void *obj = mag->objs[--mag->count];
+    temp_irq_restore(irq_flags);
+    return obj;
+  }
+
+  mag->stats.alloc_misses++;
+  spin_lock(&cache->lock);
+  cache_fill_magazine(cache, mag, KMEM_MAGAZINE_BATCH);
+  spin_unlock(&cache->lock);
+
+  if (mag->count == 0) {
+    // grow the cache
+    kmem_slab_t *slab = slab_create(cache);
+    if (slab == NULL) {
+      temp_irq_restore(irq_flags);
+      return NULL;
+    }
+
+    spin_lock(&cache->lock);
+    LIST_ADD(&cache->partial, slab, list);
+    cache->num_slabs++;
+    cache_fill_magazine(cache, mag, KMEM_MAGAZINE_BATCH);
+    spin_unlock(&cache->lock);
+  }
+
+  void *obj = mag->objs[--mag->count];
+  temp_irq_restore(irq_flags);
+  return obj;
+}
+
+void *kmem_cache_allocz(kmem_cache_t *cache) {
+  void *obj = kmem_cache_alloc(cache);
+  if (obj != NULL) {
+    memset(obj, 0, cache->obj_size);
+  }
+  return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+  if (obj == NULL) {
+    return;
+  }
+  kassert(obj_to_slab(obj)->cache == cache);
+
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  kmem_magazine_t *mag = &cache->magazines[PERCPU_ID];
+  kmem_slab_t *slabs = NULL;
+  if (mag->count == KMEM_MAGAZINE_SIZE) {
+    mag->stats.free_misses++;
+    spin_lock(&cache->lock);
+    cache_flush_magazine(cache, mag, KMEM_MAGAZINE_BATCH, &slabs);
+    spin_unlock(&cache->lock);
+  } else {
+    mag->stats.free_hits++;
+  }
+
+  mag->objs[mag->count++] = obj;
+  release_slabs(slabs);
+  temp_irq_restore(irq_flags);
+}
+
+//
+
+void kmem_cache_dump_stats() {
+  spin_lock(&kmem_caches_lock);
+  kmem_cache_t *cache;
+  LIST_FOREACH(cache, &kmem_caches, list) {
+    size_t cached = 0;
+    size_t alloc_hits = 0, alloc_misses = 0;
+    size_t free_hits = 0, free_misses = 0;
+    for (size_t i = 0; i < system_num_cpus; i++) {
+      kmem_magazine_t *mag = &cache->magazines[i];
+      cached += mag->count;
+      alloc_hits += mag->stats.alloc_hits;
+      alloc_misses += mag->stats.alloc_misses;
+      free_hits += mag->stats.free_hits;
+      free_misses += mag->stats.free_misses;
+    }
+
+    size_t allocs = alloc_hits + alloc_misses;
+    size_t frees = free_hits + free_misses;
+    kprintf("  %s: %zu bytes, %zu slabs (%zu empty), %zu/%zu objects in use, %zu cached\n",
+            cache->name, cache->obj_size, cache->num_slabs, cache->num_empty,
+            cache->num_inuse - cached, cache->num_slabs * cache->objs_per_slab, cached);
+    kprintf("    alloc %zu/%zu hits (%zu%%), free %zu/%zu hits (%zu%%)\n",
+            alloc_hits, allocs, allocs ? (alloc_hits * 100) / allocs : 0,
+            free_hits, frees, frees ? (free_hits * 100) / frees : 0);
+  }
+  spin_unlock(&kmem_caches_lock);
+}
@@ -0,0 +1,204 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-10.
+//
+
+#include <mm/tlb.h>
+#include <mm/heap.h>
+#include <mm/pgtable.h>
+
+#include <cpu/cpu.h>
+
+#include <ipi.h>
+#include <atomic.h>
+#include <panic.h>
+
+//
+// TLB Shootdown
+//
+// Page invalidations are collected into a per-cpu batch which is flushed once
+// the caller is done changing the page tables. Flushing a batch invalidates the
+// pages locally and sends a single IPI_INVLPG to every other cpu which has the
+// address space loaded. The remote cpus read the pages straight out of the batch
+// and clear their bit in `pending` once done, so the batch can not be reused until
+// every remote cpu has finished with it.
+//
+
+// Process-Context Identifiers
+//
+// Each cpu hands out pcids from its own counter and every address space records
+// the pcid it was given on each cpu along with the generation of that counter.
+// Once the counter runs out, the generation is bumped which invalidates every
+// pcid handed out before it. A pcid is always first loaded with a flushing cr3
+// write so stale entries left behind by its previous owner are dropped. Pages
+// invalidated while a space is not loaded on a cpu are caught by comparing the
+// tlb_gen of the space against the one recorded at the last load. Kernel pages
+// are mapped global so invlpg drops them from every pcid.
+//
+
+#define PCID_MAX         4095
+#define CR3_NOFLUSH      (1ULL << 63)
+
+#define INVPCID_ADDR     0 // individual address in a pcid
+#define INVPCID_CONTEXT  1 // all non-global entries in a pcid
+#define INVPCID_ALL      2 // all entries including global ones
+#define INVPCID_NON_GLOBAL 3 // all non-global entries
+
+typedef struct tlb_pcid_state {
+  uint64_t gen;
+  uint16_t next;
+} tlb_pcid_state_t;
+
+extern address_space_t *kernel_space;
+
+static tlb_batch_t tlb_batches[MAX_CPUS];
+static tlb_pcid_state_t tlb_pcid_states[MAX_CPUS];
+
+/* flushes the entire tlb of the current cpu, including global entries */
+static void tlb_flush_global() {
+  if (cpuid_query_bit(CPUID_BIT_INVPCID)) {
+    cpu_invpcid(INVPCID_ALL, 0, 0);
+  } else if (cpuid_query_bit(CPUID_BIT_PGE)) {
+    // toggling cr4.pge flushes every pcid
+    uint64_t cr4 = __read_cr4();
+    __write_cr4(cr4 ^ (1 << 7));
+    __write_cr4(cr4);
+  } else {
+    cpu_flush_tlb();
+  }
+}
+
+static void tlb_invalidate_local(tlb_batch_t *batch) {
+  if (batch->flush_all) {
+    if (batch->space == kernel_space) {
+      tlb_flush_global();
+    } else {
+      cpu_flush_tlb();
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < batch->count; i++) {
+    cpu_invlpg(batch->pages[i]);
+  }
+}
+
+//
+
+void tlb_invalidate_page(address_space_t *space, uintptr_t virt_addr) {
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  tlb_batch_t *batch = &tlb_batches[PERCPU_ID];
+  if (batch->space != space && (batch->count > 0 || batch->flush_all)) {
+    // batches only ever cover a single address space
+    tlb_flush_batch();
+  }
+
+  batch->space = space;
+  if (batch->count == TLB_BATCH_SIZE) {
+    batch->flush_all = true;
+  } else if (!batch->flush_all) {
+    batch->pages[batch->count++] = virt_addr;
+  }
+  temp_irq_restore(irq_flags);
+}
+
+void tlb_invalidate_range(address_space_t *space, uintptr_t virt_addr, size_t size) {
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  tlb_batch_t *batch = &tlb_batches[PERCPU_ID];
+  if (batch->space != space && (batch->count > 0 || batch->flush_all)) {
+    tlb_flush_batch();
+  }
+
+  batch->space = space;
+  size_t count = SIZE_TO_PAGES(size);
+  if (batch->count + count > TLB_BATCH_SIZE) {
+    batch->flush_all = true;
+  } else if (!batch->flush_all) {
+    for (size_t i = 0; i < count; i++) {
+      batch->pages[batch->count++] = virt_addr + PAGES_TO_SIZE(i);
+    }
+  }
+  temp_irq_restore(irq_flags);
+}
+
+void tlb_flush_batch() {
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  uint8_t id = PERCPU_ID;
+  tlb_batch_t *batch = &tlb_batches[id];
+  if (batch->count == 0 && !batch->flush_all) {
+    temp_irq_restore(irq_flags);
+    return;
+  }
+
+  tlb_invalidate_local(batch);
+
+  // any cpu loading the space after this point must not trust its old entries
+  atomic_fetch_add(&batch->space->tlb_gen, 1);
+  uint64_t targets = batch->space->cpu_mask & ~(1ULL << id);
+  if (targets != 0) {
+    atomic_fetch_or(&batch->pending, targets);
+    for (uint8_t cpu = 0; cpu < system_num_cpus; cpu++) {
+      if (targets & (1ULL << cpu)) {
+        ipi_deliver_cpu_id(IPI_INVLPG, cpu, (uint64_t) batch);
+      }
+    }
+
+    while (batch->pending != 0) {
+      // another cpu may be waiting on us to finish its own shootdown
+      ipi_poll_invlpg();
+      cpu_pause();
+    }
+  }
+
+  batch->space = NULL;
+  batch->count = 0;
+  batch->flush_all = false;
+  temp_irq_restore(irq_flags);
+}
+
+void tlb_shootdown_handler(tlb_batch_t *batch) {
+  tlb_invalidate_local(batch);
+  atomic_fetch_and(&batch->pending, ~(1ULL << PERCPU_ID));
+}
+
+//
+
+void tlb_load_address_space(address_space_t *space) {
+  if (space->pcids == NULL || !cpuid_query_bit(CPUID_BIT_PCID)) {
+    set_current_pgtable(space->page_table);
+    return;
+  }
+
+  uint64_t irq_flags;
+  temp_irq_save(irq_flags);
+  tlb_pcid_state_t *state = &tlb_pcid_states[PERCPU_ID];
+  tlb_pcid_t *ctx = &space->pcids[PERCPU_ID];
+  uint64_t tlb_gen = space->tlb_gen;
+  uint64_t cr3 = space->page_table;
+
+  if (state->gen != 0 && ctx->pcid_gen == state->gen) {
+    cr3 |= ctx->pcid;
+    if (ctx->tlb_gen == tlb_gen) {
+      cr3 |= CR3_NOFLUSH;
+    }
+  } else {
+    if (state->gen == 0 || state->next > PCID_MAX) {
+      // recycle the pcids of the previous generation (pcid 0 is never used)
+      state->gen++;
+      state->next = 1;
+    }
+    ctx->pcid = state->next++;
+    ctx->pcid_gen = state->gen;
+    cr3 |= ctx->pcid;
+  }
+
+  ctx->tlb_gen = tlb_gen;
+  __write_cr3(cr3);
+  temp_irq_restore(irq_flags);
+}
+
+tlb_pcid_t *tlb_alloc_pcids() {
+  return kmallocz(sizeof(tlb_pcid_t) * MAX_CPUS);
+}
@@ -7,11 +7,15 @@
 #include <mm/pgtable.h>
 #include <mm/heap.h>
 #include <mm/init.h>
+#include <mm/tlb.h>
+#include <mm/zeropool.h>
+#include <mm/slab.h>
 
 #include <cpu/cpu.h>
 #include <debug/debug.h>
 
 #include <irq.h>
+#include <atomic.h>
 #include <panic.h>
 #include <string.h>
 #include <printf.h>
@@ -24,9 +28,26 @@
 #define VMAP_DOWNWARD   (1 << 2) // the mapping grows downward
 #define VMAP_SHORTLIVED (1 << 3) // the mapping does not need to be bound to a page
 
+// page fault error code bits
+#define PF_PRESENT (1 << 0) // fault was caused by a protection violation
+#define PF_WRITE   (1 << 1) // fault was caused by a write
+#define PF_USER    (1 << 2) // fault occurred in user mode
+#define PF_RSVD    (1 << 3) // reserved bit set in a paging structure
+#define PF_EXEC    (1 << 4) // fault was caused by an instruction fetch
+
+// page flags which must match for 4k pages to be promoted to a big page
+#define PROMOTE_FLAGS_MASK (PG_WRITE | PG_EXEC | PG_USER | PG_NOCACHE | PG_WRITETHRU | PG_GLOBAL)
+#define PAGES_PER_BIGPAGE  SIZE_TO_PAGES(BIGPAGE_SIZE)
+
 void execute_init_address_space_callbacks();
 extern uintptr_t entry_initial_stack_top;
 address_space_t *kernel_space;
+static kmem_cache_t *vm_mapping_cache;
+
+static void *copy_vm_mapping(void *data);
+static intvl_tree_events_t user_space_events = {
+  .copy_data = copy_vm_mapping,
+};
 
 
 __used int fault_handler(uintptr_t rip_addr, uintptr_t fault_addr, uint32_t err) {
@@ -56,11 +77,11 @@ static always_inline uintptr_t select_vmap_hint(uint32_t vm_flags) {
 uintptr_t locate_free_address_region(address_space_t *space, uintptr_t base, size_t size, uint32_t vm_flags) {
   kassert(base >= space->min_addr && (base + size) <= space->max_addr);
 
-  int alignment = PAGE_SIZE;
-  if (size >= SIZE_2MB) {
-    alignment = SIZE_2MB;
-  } else if (size >= SIZE_1GB) {
+  uint64_t alignment = PAGE_SIZE;
+  if (size >= SIZE_1GB) {
     alignment = SIZE_1GB;
+  } else if (size >= SIZE_2MB) {
+    alignment = SIZE_2MB;
   }
 
   uintptr_t addr = base;
@@ -78,54 +99,14 @@ uintptr_t locate_free_address_region(address_space_t *space, uintptr_t base, siz
     return addr;
   }
 
-  rb_iter_type_t iter_type = FORWARD;
-  if (vm_flags & VMAP_DOWNWARD) {
-    iter_type = REVERSE;
-  }
-
-  rb_node_t *node = NULL;
-  rb_node_t *last = NULL;
-  rb_iter_t *iter = rb_tree_make_iter(space->root->tree, closest->node, iter_type);
-  while ((node = rb_iter_next(iter))) {
-    interval_t i = ((intvl_node_t *) node->data)->interval;
-    interval_t j = last ? ((intvl_node_t *) last->data)->interval : i;
-
-    // if two consequtive nodes are not contiguous in memory
-    // check that there is enough space between the them to
-    // fit the requested area.
-
-    if (vm_flags & VMAP_DOWNWARD) {
-      bool contig = contiguous(j, i);
-      if (!contig && j.start >= addr && j.start - addr >= size) {
-        kassert(addr + size <= space->max_addr);
-        kfree(iter);
-        return addr;
-      }
-
-      if (i.start < size) {
-        // no space
-        kfree(iter);
-        return 0;
-      }
-      addr = align(i.start - size, alignment);
-    } else {
-      bool contig = contiguous(i, j);
-      if (!contig && i.start > addr && i.start - addr >= size) {
-        kassert(addr + size <= space->max_addr);
-        kfree(iter);
-        return addr;
-      }
-      addr = align(i.end, alignment);
-    }
-
-    last = node;
-  }
-
-  kfree(iter);
-  if (addr + size <= space->max_addr) {
-    return addr;
+  // search the holes between mappings on the far side of the hint
+  bool reverse = (vm_flags & VMAP_DOWNWARD) != 0;
+  interval_t bounds = reverse ? intvl(space->min_addr, base) : intvl(base, space->max_addr);
+  addr = intvl_tree_find_free(space->root, bounds, size, alignment, reverse);
+  if (addr == UINT64_MAX) {
+    return 0;
   }
-  return 0;
+  return addr;
 }
 
 bool check_address_region_free(address_space_t *space, uintptr_t base, size_t size) {
@@ -140,7 +121,7 @@ bool check_address_region_free(address_space_t *space, uintptr_t base, size_t si
 }
 
 vm_mapping_t *allocate_vm_mapping(address_space_t *space, uintptr_t addr, size_t size, uint32_t vm_flags) {
-  vm_mapping_t *mapping = kmalloc(sizeof(vm_mapping_t));
+  vm_mapping_t *mapping = kmem_cache_alloc(vm_mapping_cache);
 
   spin_lock(&space->lock);
   uintptr_t virt_addr;
@@ -148,7 +129,7 @@ vm_mapping_t *allocate_vm_mapping(address_space_t *space, uintptr_t addr, size_t
     virt_addr = addr;
     if (!check_address_region_free(space, addr, size)) {
       spin_unlock(&space->lock);
-      kfree(mapping);
+      kmem_cache_free(vm_mapping_cache, mapping);
       kprintf("allocate_vm_mapping: address region already allocated");
       return NULL;
     }
@@ -156,7 +137,7 @@ vm_mapping_t *allocate_vm_mapping(address_space_t *space, uintptr_t addr, size_t
     virt_addr = locate_free_address_region(space, addr, size, vm_flags);
     if (virt_addr == 0) {
       spin_unlock(&space->lock);
-      kfree(mapping);
+      kmem_cache_free(vm_mapping_cache, mapping);
       panic("no free address space");
     }
   }
@@ -176,6 +157,133 @@ vm_mapping_t *allocate_vm_mapping(address_space_t *space, uintptr_t addr, size_t
   return mapping;
 }
 
+//
+// Page Mapping
+//
+// Naturally aligned 2MB spans of 4K pages are transparently mapped with a single
+// big page whenever the frames behind them are physically contiguous and aligned.
+// The 4K page structs are kept so the rest of the code does not need to know
+// about the promotion, and the page tables are the only record of it. Big pages
+// are split back into 4K pages when only part of the span needs to change.
+//
+
+static size_t *vm_mapped_counter(address_space_t *space, size_t pgsz) {
+  if (pgsz == SIZE_1GB) {
+    return &space->stats.mapped_1gb;
+  } else if (pgsz == SIZE_2MB) {
+    return &space->stats.mapped_2mb;
+  }
+  return &space->stats.mapped_4k;
+}
+
+/* maps a single page of any size and accounts for it in the address space stats */
+static void vm_map_entry(address_space_t *space, uintptr_t virt_addr, uintptr_t phys_addr, uint32_t flags) {
+  page_t *out_table_pages = NULL;
+  recursive_map_entry(virt_addr, phys_addr, flags, &out_table_pages);
+  if (out_table_pages != NULL) {
+    SLIST_ADD_SLIST(&space->table_pages, out_table_pages, SLIST_GET_LAST(out_table_pages, next), next);
+  }
+
+  size_t pgsz = pg_flags_to_size(flags);
+  atomic_fetch_add(vm_mapped_counter(space, pgsz), pgsz);
+}
+
+/* unmaps the page at the address and queues its invalidation, returns the size of the entry */
+static size_t vm_unmap_entry(address_space_t *space, uintptr_t virt_addr, uint32_t flags) {
+  if (!(flags & (PG_BIGPAGE | PG_HUGEPAGE)) && is_aligned(virt_addr, BIGPAGE_SIZE) && recursive_is_bigpage(virt_addr)) {
+    // the 4k pages here were promoted
+    flags |= PG_BIGPAGE;
+  }
+
+  recursive_unmap_entry(virt_addr, flags);
+  tlb_invalidate_page(space, virt_addr);
+
+  size_t pgsz = pg_flags_to_size(flags);
+  atomic_fetch_sub(vm_mapped_counter(space, pgsz), pgsz);
+  return pgsz;
+}
+
+/* maps physically contiguous pages of the same size with one walk per page table */
+static void vm_map_range(address_space_t *space, uintptr_t virt_addr, uintptr_t phys_addr, size_t count, uint32_t flags) {
+  page_t *out_table_pages = NULL;
+  size_t size = recursive_map_range(virt_addr, phys_addr, count, flags, &out_table_pages);
+  if (out_table_pages != NULL) {
+    SLIST_ADD_SLIST(&space->table_pages, out_table_pages, SLIST_GET_LAST(out_table_pages, next), next);
+  }
+  atomic_fetch_add(vm_mapped_counter(space, pg_flags_to_size(flags)), size);
+}
+
+/* unmaps a range of 4k pages (some of which may be promoted) and queues its invalidation */
+static void vm_unmap_range(address_space_t *space, uintptr_t virt_addr, size_t size) {
+  uintptr_t end = virt_addr + size;
+  while (virt_addr < end) {
+    if (is_aligned(virt_addr, BIGPAGE_SIZE) && recursive_is_bigpage(virt_addr)) {
+      virt_addr += vm_unmap_entry(space, virt_addr, 0);
+      continue;
+    }
+
+    // the entries up to the next big page boundary all live in the same table
+    size_t run = min(end - virt_addr, BIGPAGE_SIZE - (virt_addr & (BIGPAGE_SIZE - 1)));
+    recursive_unmap_range(virt_addr, SIZE_TO_PAGES(run), 0);
+    tlb_invalidate_range(space, virt_addr, run);
+    atomic_fetch_sub(&space->stats.mapped_4k, run);
+    virt_addr += run;
+  }
+}
+
+/* splits the big page containing the address (caller invalidates the old entry) */
+static void vm_split_bigpage(address_space_t *space, uintptr_t virt_addr) {
+  uintptr_t span = align_down(virt_addr, BIGPAGE_SIZE);
+  spin_lock(&space->lock);
+  page_t *table_page = recursive_split_bigpage(span);
+  SLIST_ADD(&space->table_pages, table_page, next);
+  spin_unlock(&space->lock);
+
+  atomic_fetch_sub(&space->stats.mapped_2mb, BIGPAGE_SIZE);
+  atomic_fetch_add(&space->stats.mapped_4k, BIGPAGE_SIZE);
+  atomic_fetch_add(&space->stats.splits, 1);
+}
+
+static bool vm_can_promote(uintptr_t virt_addr, uintptr_t phys_addr, size_t remaining) {
+  return remaining >= BIGPAGE_SIZE && is_aligned(virt_addr, BIGPAGE_SIZE) &&
+    is_aligned(phys_addr, BIGPAGE_SIZE) && recursive_can_map_bigpage(virt_addr);
+}
+
+/* returns true if the first PAGES_PER_BIGPAGE pages of the list can share one big page */
+static bool vm_can_promote_pages(page_t *pages, uintptr_t virt_addr) {
+  page_t *curr = pages;
+  for (size_t i = 0; i < PAGES_PER_BIGPAGE; i++) {
+    if (curr == NULL || (curr->flags & (PG_BIGPAGE | PG_HUGEPAGE))) {
+      return false;
+    } else if (curr->address != pages->address + PAGES_TO_SIZE(i)) {
+      return false;
+    } else if ((curr->flags & PROMOTE_FLAGS_MASK) != (pages->flags & PROMOTE_FLAGS_MASK)) {
+      return false;
+    }
+    curr = curr->next;
+  }
+  return vm_can_promote(virt_addr, pages->address, BIGPAGE_SIZE);
+}
+
+/* returns the number of pages at the start of the list which can be mapped as one run */
+static size_t vm_contiguous_run(page_t *pages, uintptr_t virt_addr) {
+  size_t pgsz = pg_flags_to_size(pages->flags);
+  uint32_t mask = PROMOTE_FLAGS_MASK | PG_BIGPAGE | PG_HUGEPAGE;
+  page_t *curr = pages->next;
+  size_t count = 1;
+  while (curr != NULL && curr->address == pages->address + count * pgsz) {
+    if ((curr->flags & mask) != (pages->flags & mask)) {
+      break;
+    } else if (pgsz == PAGE_SIZE && is_aligned(virt_addr + PAGES_TO_SIZE(count), BIGPAGE_SIZE)) {
+      // give the next span a chance to be promoted
+      break;
+    }
+    curr = curr->next;
+    count++;
+  }
+  return count;
+}
+
 //
 
 void vmap_fill_from_pages(page_t *pages, address_space_t *space, vm_mapping_t *vm, uint32_t vm_flags) {
@@ -183,23 +291,30 @@ void vmap_fill_from_pages(page_t *pages, address_space_t *space, vm_mapping_t *v
   uintptr_t ptr = vm->address;
   size_t realsize = 0;
   while (curr != NULL) {
-    page_t *out_table_pages = NULL;
-    recursive_map_entry(ptr, curr->address, curr->flags, &out_table_pages);
-    if (out_table_pages != NULL) {
-      SLIST_ADD(&space->table_pages, out_table_pages, next);
+    size_t count;
+    if (vm_can_promote_pages(curr, ptr)) {
+      count = PAGES_PER_BIGPAGE;
+      vm_map_entry(space, ptr, curr->address, curr->flags | PG_BIGPAGE);
+      atomic_fetch_add(&space->stats.promotions, 1);
+    } else {
+      count = vm_contiguous_run(curr, ptr);
+      vm_map_range(space, ptr, curr->address, count, curr->flags);
     }
 
-    curr->flags |= PG_MAPPED;
-    if (!(vm_flags & VMAP_SHORTLIVED)) {
-      curr->mapping = vm;
-    }
+    while (count > 0) {
+      curr->flags |= PG_MAPPED;
+      if (!(vm_flags & VMAP_SHORTLIVED)) {
+        curr->mapping = vm;
+      }
 
-    size_t pgsz = pg_flags_to_size(curr->flags);
-    ptr += pgsz;
-    realsize += pgsz;
-    curr = curr->next;
+      size_t pgsz = pg_flags_to_size(curr->flags);
+      ptr += pgsz;
+      realsize += pgsz;
+      curr = curr->next;
+      count--;
+    }
   }
-  cpu_flush_tlb();
+  // the entries were not present before so there is nothing to invalidate
   kassert(realsize == vm->size);
 }
 
@@ -238,7 +353,7 @@ vm_mapping_t *vmap_phys_internal(uintptr_t phys_addr, size_t size, uint32_t flag
   }
 
   size_t stride = pg_flags_to_size(flags);
-  size_t count = size / stride;
+  kassert(size % stride == 0);
 
   address_space_t *space = select_address_space(hint);
   vm_mapping_t *mapping = allocate_vm_mapping(space, hint, size, vm_flags);
@@ -254,36 +369,338 @@ vm_mapping_t *vmap_phys_internal(uintptr_t phys_addr, size_t size, uint32_t flag
 
   uintptr_t ptr = mapping->address;
   uintptr_t phys_ptr = phys_addr;
-  while (count > 0) {
-    page_t *out_table_pages = NULL;
-    recursive_map_entry(ptr, phys_ptr, flags, &out_table_pages);
-    if (out_table_pages != NULL) {
-      SLIST_ADD(&space->table_pages, out_table_pages, next);
+  uintptr_t end = mapping->address + size;
+  if (stride != PAGE_SIZE) {
+    vm_map_range(space, ptr, phys_ptr, size / stride, flags);
+    return mapping;
+  }
+
+  while (ptr < end) {
+    size_t run;
+    if (vm_can_promote(ptr, phys_ptr, end - ptr)) {
+      run = BIGPAGE_SIZE;
+      vm_map_entry(space, ptr, phys_ptr, flags | PG_BIGPAGE);
+      atomic_fetch_add(&space->stats.promotions, 1);
+    } else {
+      // map up to the next span which could be promoted
+      run = min(end - ptr, BIGPAGE_SIZE - (ptr & (BIGPAGE_SIZE - 1)));
+      vm_map_range(space, ptr, phys_ptr, SIZE_TO_PAGES(run), flags);
     }
+    ptr += run;
+    phys_ptr += run;
+  }
+  // the entries were not present before so there is nothing to invalidate
+  return mapping;
+}
+
+vm_mapping_t *vmap_anon_internal(size_t size, uint32_t flags, uintptr_t hint, uint32_t vm_flags) {
+  kassert(size % PAGE_SIZE == 0 && size > 0);
+  kassert(!(flags & PG_HUGEPAGE));
+  if (vm_flags & VMAP_USERSPACE) {
+    kassert(hint >= USER_SPACE_START && hint <= USER_SPACE_END);
+  } else {
+    kassert(hint >= KERNEL_SPACE_START && hint <= KERNEL_SPACE_END);
+  }
 
-    ptr += stride;
-    phys_ptr += stride;
-    count--;
+  address_space_t *space = select_address_space(hint);
+  vm_mapping_t *mapping = allocate_vm_mapping(space, hint, size, vm_flags);
+  if (mapping == NULL) {
+    return NULL;
   }
 
-  cpu_flush_tlb();
+  // no pages are allocated until the mapping is first touched
+  mapping->type = VM_TYPE_ANON;
+  mapping->attr = vm_flags & VMAP_USERSPACE ? VM_ATTR_USER : 0;
+  if (flags & PG_BIGPAGE) {
+    // the individual pages are still tracked as 4k pages
+    mapping->attr |= VM_ATTR_BIGPAGE;
+    flags &= ~PG_BIGPAGE;
+  }
+  mapping->flags = flags;
+  mapping->data.pages = kmallocz(SIZE_TO_PAGES(size) * sizeof(page_t *));
+  mapping->name = "anon";
   return mapping;
 }
 
+static void anon_page_release(page_t *page) {
+  if (atomic_fetch_sub(&page->refcount, 1) > 1) {
+    // still mapped by another address space
+    return;
+  }
+
+  page->flags &= ~PG_MAPPED;
+  page->mapping = NULL;
+  _free_pages(page);
+}
+
+void vunmap_anon_internal(address_space_t *space, vm_mapping_t *mapping) {
+  spin_lock(&space->lock);
+  intvl_tree_delete(space->root, intvl(mapping->address, mapping->address + mapping->size));
+  spin_unlock(&space->lock);
+
+  size_t count = SIZE_TO_PAGES(mapping->size);
+  size_t i = 0;
+  while (i < count) {
+    if (mapping->data.pages[i] == NULL) {
+      i++;
+      continue;
+    }
+
+    // unmap each run of faulted in pages at once
+    size_t j = i + 1;
+    while (j < count && mapping->data.pages[j] != NULL) {
+      j++;
+    }
+    vm_unmap_range(space, mapping->address + PAGES_TO_SIZE(i), PAGES_TO_SIZE(j - i));
+    i = j;
+  }
+  tlb_flush_batch();
+
+  // the pages can only be released once no cpu can still reach them
+  for (size_t i = 0; i < count; i++) {
+    page_t *page = mapping->data.pages[i];
+    if (page != NULL) {
+      anon_page_release(page);
+    }
+  }
+
+  kfree(mapping->data.pages);
+  kmem_cache_free(vm_mapping_cache, mapping);
+}
+
+static void *copy_vm_mapping(void *data) {
+  vm_mapping_t *mapping = data;
+  vm_mapping_t *copy = kmem_cache_alloc(vm_mapping_cache);
+  memcpy(copy, mapping, sizeof(vm_mapping_t));
+  spin_init(&copy->lock);
+
+  if (mapping->type == VM_TYPE_ANON) {
+    // the pages themselves are shared copy-on-write
+    size_t pages_size = SIZE_TO_PAGES(mapping->size) * sizeof(page_t *);
+    copy->data.pages = kmalloc(pages_size);
+    memcpy(copy->data.pages, mapping->data.pages, pages_size);
+  }
+  return copy;
+}
+
 // called from thread.asm
 __used void swap_address_space(address_space_t *new_space) {
   address_space_t *current = PERCPU_ADDRESS_SPACE;
   if (current != NULL && current->page_table == new_space->page_table) {
     return;
   }
-  set_current_pgtable(new_space->page_table);
+
+  // track which cpus need to take part in tlb shootdowns
+  uint64_t cpu_bit = 1ULL << PERCPU_ID;
+  if (current != NULL) {
+    atomic_fetch_and(&current->cpu_mask, ~cpu_bit);
+  }
+  atomic_fetch_or(&new_space->cpu_mask, cpu_bit);
+  tlb_load_address_space(new_space);
   PERCPU_SET_ADDRESS_SPACE(new_space);
 }
 
+//
+// Demand Paging
+//
+
+/* handles a write to a shared anonymous page (releases the mapping lock) */
+static int anon_cow_fault(address_space_t *space, vm_mapping_t *mapping, uintptr_t virt_addr, size_t index) {
+  page_t *page = mapping->data.pages[index];
+  if (page->refcount == 1) {
+    // every other address space has already copied the page. other cpus can
+    // only hold read-only entries which will simply fault again
+    recursive_map_entry(virt_addr, page->address, mapping->flags, NULL);
+    cpu_invlpg(virt_addr);
+    spin_unlock(&mapping->lock);
+    atomic_fetch_add(&space->stats.minor_faults, 1);
+    return 0;
+  }
+
+  page_t *copy = _alloc_pages(1, mapping->flags);
+  if (copy == NULL) {
+    spin_unlock(&mapping->lock);
+    kprintf("vm: out of memory handling copy-on-write fault at %p\n", virt_addr);
+    return -1;
+  }
+
+  memcpy(phys_to_virt(copy->address), phys_to_virt(page->address), PAGE_SIZE);
+
+  recursive_map_entry(virt_addr, copy->address, copy->flags, NULL);
+  tlb_invalidate_page(space, virt_addr);
+
+  copy->flags |= PG_MAPPED;
+  copy->mapping = mapping;
+  mapping->data.pages[index] = copy;
+  spin_unlock(&mapping->lock);
+
+  // the old page can only be released once no cpu can still reach it
+  tlb_flush_batch();
+  anon_page_release(page);
+
+  atomic_fetch_add(&space->stats.major_faults, 1);
+  return 0;
+}
+
+/* backs the whole 2MB span around the address with a big page if possible (mapping lock held) */
+static bool anon_map_bigpage(address_space_t *space, vm_mapping_t *mapping, uintptr_t virt_addr) {
+  if (!(mapping->attr & VM_ATTR_BIGPAGE)) {
+    // sparse mappings such as stacks only pay for the pages they touch
+    return false;
+  }
+
+  uintptr_t span = align_down(virt_addr, BIGPAGE_SIZE);
+  if (span < mapping->address || span + BIGPAGE_SIZE > mapping->address + mapping->size) {
+    return false;
+  }
+
+  size_t first = (span - mapping->address) / PAGE_SIZE;
+  for (size_t i = 0; i < PAGES_PER_BIGPAGE; i++) {
+    if (mapping->data.pages[first + i] != NULL) {
+      return false;
+    }
+  }
+  if (!recursive_can_map_bigpage(span)) {
+    return false;
+  }
+
+  // multi-page blocks from the buddy allocator are naturally aligned
+  page_t *pages = _try_alloc_pages(PAGES_PER_BIGPAGE, mapping->flags);
+  if (pages == NULL) {
+    return false;
+  }
+  kassert(is_aligned(pages->address, BIGPAGE_SIZE));
+
+  // zero the frames before they become visible
+  __memzero_nt(phys_to_virt(pages->address), BIGPAGE_SIZE);
+
+  spin_lock(&space->lock);
+  vm_map_entry(space, span, pages->address, mapping->flags | PG_BIGPAGE);
+  spin_unlock(&space->lock);
+
+  // every frame keeps its own page struct so it can later be shared and copied on its own
+  page_t *page = pages;
+  for (size_t i = 0; i < PAGES_PER_BIGPAGE; i++) {
+    page_t *next = page->next;
+    page->flags &= ~(PG_LIST_HEAD | PG_LIST_TAIL);
+    page->flags |= PG_MAPPED;
+    page->mapping = mapping;
+    page->next = NULL;
+    mapping->data.pages[first + i] = page;
+    page = next;
+  }
+
+  atomic_fetch_add(&space->stats.promotions, 1);
+  return true;
+}
+
+static int anon_page_fault(address_space_t *space, vm_mapping_t *mapping, uintptr_t fault_addr, uint32_t error_code) {
+  if ((error_code & PF_WRITE) && !IS_PG_WRITABLE(mapping->flags)) {
+    return -1;
+  } else if ((error_code & PF_USER) && !(mapping->attr & VM_ATTR_USER)) {
+    return -1;
+  } else if ((error_code & PF_EXEC) && !(mapping->flags & PG_EXEC)) {
+    return -1;
+  }
+
+  uintptr_t virt_addr = align_down(fault_addr, PAGE_SIZE);
+  size_t index = (virt_addr - mapping->address) / PAGE_SIZE;
+
+  spin_lock(&mapping->lock);
+  if (mapping->data.pages[index] != NULL) {
+    if ((error_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE)) {
+      // writable anonymous pages are only write protected when shared
+      if (recursive_is_bigpage(virt_addr)) {
+        // shared big pages are copied one 4k page at a time
+        vm_split_bigpage(space, virt_addr);
+        cpu_invlpg(virt_addr);
+      }
+      return anon_cow_fault(space, mapping, virt_addr, index);
+    }
+
+    spin_unlock(&mapping->lock);
+    if (error_code & PF_PRESENT) {
+      // the page is present so this is a real protection fault
+      return -1;
+    }
+
+    // another cpu faulted in the page first
+    atomic_fetch_add(&space->stats.minor_faults, 1);
+    return 0;
+  }
+
+  if (anon_map_bigpage(space, mapping, virt_addr)) {
+    spin_unlock(&mapping->lock);
+    atomic_fetch_add(&space->stats.major_faults, 1);
+    return 0;
+  }
+
+  // prefer a page which has already been zeroed
+  page_t *page = zero_pool_alloc(mapping->flags);
+  bool zeroed = page != NULL;
+  if (page == NULL) {
+    page = _try_alloc_pages(1, mapping->flags);
+    if (page == NULL) {
+      spin_unlock(&mapping->lock);
+      kprintf("vm: out of memory handling fault at %p\n", fault_addr);
+      return -1;
+    }
+  }
+
+  // zero the frame before it becomes visible to other threads
+  if (!zeroed) {
+    memset(phys_to_virt(page->address), 0, PAGE_SIZE);
+  }
+
+  spin_lock(&space->lock);
+  vm_map_entry(space, virt_addr, page->address, page->flags);
+  spin_unlock(&space->lock);
+
+  page->flags |= PG_MAPPED;
+  page->mapping = mapping;
+  mapping->data.pages[index] = page;
+  spin_unlock(&mapping->lock);
+
+  atomic_fetch_add(&space->stats.major_faults, 1);
+  return 0;
+}
+
+static int handle_page_fault(uintptr_t fault_addr, uint32_t error_code) {
+  if (error_code & PF_RSVD) {
+    return -1;
+  }
+
+  address_space_t *space;
+  if (fault_addr <= USER_SPACE_END) {
+    space = PERCPU_ADDRESS_SPACE;
+  } else if (fault_addr >= KERNEL_SPACE_START) {
+    space = kernel_space;
+  } else {
+    return -1;
+  }
+
+  spin_lock(&space->lock);
+  intvl_node_t *node = intvl_tree_find(space->root, intvl(fault_addr, fault_addr + 1));
+  spin_unlock(&space->lock);
+  if (node == NULL) {
+    return -1;
+  }
+
+  vm_mapping_t *mapping = node->data;
+  if (mapping->type == VM_TYPE_ANON) {
+    return anon_page_fault(space, mapping, fault_addr, error_code);
+  }
+  return -1;
+}
+
 void page_fault_handler(uint8_t vector, uint32_t error_code, cpu_irq_stack_t *frame, cpu_registers_t *regs) {
   per_cpu_t *percpu = __percpu_struct_ptr();
   uint32_t id = PERCPU_ID;
   uint64_t fault_addr = __read_cr2();
+  if (handle_page_fault(fault_addr, error_code) == 0) {
+    return;
+  }
+
   kprintf("================== !!! Exception !!! ==================\n");
   kprintf("  Page Fault  - Data: %#b\n", error_code);
   kprintf("  CPU#%d  -  RIP: %p  -  CR2: %018p\n", id, frame->rip, fault_addr);
@@ -304,20 +721,26 @@ void page_fault_handler(uint8_t vector, uint32_t error_code, cpu_irq_stack_t *fr
 //
 
 void init_address_space() {
-  kernel_space = kmalloc(sizeof(address_space_t));
+  vm_mapping_cache = kmem_cache_create("vm_mapping", sizeof(vm_mapping_t), 0);
+
+  kernel_space = kmallocz(sizeof(address_space_t));
   kernel_space->root = create_intvl_tree();
   kernel_space->min_addr = KERNEL_SPACE_START;
   kernel_space->max_addr = KERNEL_SPACE_END;
   LIST_INIT(&kernel_space->table_pages);
   spin_init(&kernel_space->lock);
 
-  address_space_t *user_space = kmalloc(sizeof(address_space_t));
+  address_space_t *user_space = kmallocz(sizeof(address_space_t));
   user_space->root = create_intvl_tree();
+  user_space->root->events = &user_space_events;
   user_space->min_addr = USER_SPACE_START;
   user_space->max_addr = USER_SPACE_END;
+  user_space->pcids = tlb_alloc_pcids();
   LIST_INIT(&user_space->table_pages);
   spin_init(&user_space->lock);
   PERCPU_SET_ADDRESS_SPACE(user_space);
+  user_space->cpu_mask = 1ULL << PERCPU_ID;
+  kernel_space->cpu_mask = 1ULL << PERCPU_ID;
 
   uintptr_t pgtable = get_current_pgtable();
   init_recursive_pgtable((void *) pgtable, pgtable);
@@ -329,6 +752,12 @@ void init_address_space() {
   null_vm->type = VM_TYPE_RSVD;
   null_vm->data.ptr = NULL;
 
+  // direct map of physical memory
+  vm_mapping_t *phys_map_vm = _vmap_reserve(PHYS_MAP_VA, phys_map_size);
+  phys_map_vm->name = "phys map";
+  phys_map_vm->type = VM_TYPE_PHYS;
+  phys_map_vm->data.phys = 0;
+
   // kernel mapped low memory
   vm_mapping_t *kernel_lowmem_vm = _vmap_reserve(kernel_virtual_offset, kernel_address - kernel_virtual_offset);
   kernel_lowmem_vm->name = "reserved";
@@ -386,14 +815,19 @@ void init_address_space() {
 }
 
 void init_ap_address_space() {
-  address_space_t *user_space = kmalloc(sizeof(address_space_t));
+  address_space_t *user_space = kmallocz(sizeof(address_space_t));
   user_space->root = create_intvl_tree();
+  user_space->root->events = &user_space_events;
   user_space->min_addr = USER_SPACE_START;
   user_space->max_addr = USER_SPACE_END;
   user_space->page_table = get_current_pgtable();
+  user_space->pcids = tlb_alloc_pcids();
   spin_init(&user_space->lock);
   LIST_INIT(&user_space->table_pages);
   PERCPU_SET_ADDRESS_SPACE(user_space);
+  user_space->cpu_mask = 1ULL << PERCPU_ID;
+  // the kernel half is shared by every cpu
+  atomic_fetch_or(&kernel_space->cpu_mask, 1ULL << PERCPU_ID);
 
   vm_mapping_t *null_vm = _vmap_reserve(0, PAGE_SIZE);
   null_vm->name = "null";
@@ -408,10 +842,12 @@ uintptr_t make_ap_page_tables() {
 }
 
 address_space_t *new_address_space() {
-  address_space_t *space = kmalloc(sizeof(address_space_t));
+  address_space_t *space = kmallocz(sizeof(address_space_t));
   space->root = create_intvl_tree();
+  space->root->events = &user_space_events;
   space->min_addr = USER_SPACE_START;
   space->max_addr = USER_SPACE_END;
+  space->pcids = tlb_alloc_pcids();
   LIST_INIT(&space->table_pages);
   spin_init(&space->lock);
 
@@ -426,19 +862,71 @@ address_space_t *new_address_space() {
 
 address_space_t *fork_address_space() {
   address_space_t *current = PERCPU_ADDRESS_SPACE;
-  address_space_t *space = kmalloc(sizeof(address_space_t));
-  space->root = copy_intvl_tree(current->root);
+  address_space_t *space = kmallocz(sizeof(address_space_t));
   space->min_addr = current->min_addr;
   space->max_addr = current->max_addr;
+  space->pcids = tlb_alloc_pcids();
   LIST_INIT(&space->table_pages);
   spin_init(&space->lock);
 
+  spin_lock(&current->lock);
+  // write protect the anonymous pages so that both address
+  // spaces share them until one of them writes to a page
+  intvl_iter_t *iter = intvl_iter_tree(current->root);
+  intvl_node_t *node;
+  while ((node = intvl_iter_next(iter))) {
+    vm_mapping_t *mapping = node->data;
+    if (mapping->type != VM_TYPE_ANON) {
+      continue;
+    }
+
+    spin_lock(&mapping->lock);
+    size_t count = SIZE_TO_PAGES(mapping->size);
+    size_t i = 0;
+    while (i < count) {
+      page_t *page = mapping->data.pages[i];
+      if (page == NULL) {
+        i++;
+        continue;
+      }
+
+      uintptr_t virt_addr = mapping->address + PAGES_TO_SIZE(i);
+      uint32_t flags = mapping->flags & ~PG_WRITE;
+      size_t num_pages = 1;
+      if (is_aligned(virt_addr, BIGPAGE_SIZE) && recursive_is_bigpage(virt_addr)) {
+        // big pages are shared whole and split on the first write
+        flags |= PG_BIGPAGE;
+        num_pages = PAGES_PER_BIGPAGE;
+      }
+
+      for (size_t j = 0; j < num_pages; j++) {
+        atomic_fetch_add(&mapping->data.pages[i + j]->refcount, 1);
+      }
+      if (IS_PG_WRITABLE(mapping->flags)) {
+        recursive_map_entry(virt_addr, page->address, flags, NULL);
+        tlb_invalidate_page(current, virt_addr);
+      }
+      i += num_pages;
+    }
+    spin_unlock(&mapping->lock);
+  }
+  kfree(iter);
+
+  // the mappings are copied by the tree copy_data event
+  space->root = copy_intvl_tree(current->root);
+  // and the page tables along with them
+  space->stats.mapped_4k = current->stats.mapped_4k;
+  space->stats.mapped_2mb = current->stats.mapped_2mb;
+  space->stats.mapped_1gb = current->stats.mapped_1gb;
+
   // fork page tables
   page_t *meta_pages = NULL;
-  uintptr_t pgtable = deepcopy_fork_page_tables(&meta_pages);
+  uintptr_t pgtable = fork_page_tables(&meta_pages);
   space->page_table = pgtable;
   SLIST_ADD_SLIST(&space->table_pages, meta_pages, SLIST_GET_LAST(meta_pages, next), next);
+  spin_unlock(&current->lock);
 
+  tlb_flush_batch();
   return space;
 }
 
@@ -558,6 +1046,34 @@ void *_vmap_mmio(uintptr_t phys_addr, size_t size, uint32_t flags) {
   return (void *) mapping->address;
 }
 
+vm_mapping_t *_vmap_anon(size_t size, uint32_t flags, const char *name) {
+  uint32_t vm_flags = flags & PG_USER ? VMAP_USERSPACE : 0;
+  uintptr_t hint = select_vmap_hint(vm_flags);
+  vm_mapping_t *mapping = vmap_anon_internal(size, flags, hint, vm_flags);
+  if (mapping == NULL) {
+    return NULL;
+  }
+
+  if (name != NULL) {
+    mapping->name = name;
+  }
+  return mapping;
+}
+
+vm_mapping_t *_vmap_anon_addr(uintptr_t virt_addr, size_t size, uint32_t flags, const char *name) {
+  kassert(virt_addr % PAGE_SIZE == 0);
+  uint32_t vm_flags = VMAP_FIXED | (flags & PG_USER ? VMAP_USERSPACE : 0);
+  vm_mapping_t *mapping = vmap_anon_internal(size, flags, virt_addr, vm_flags);
+  if (mapping == NULL) {
+    return NULL;
+  }
+
+  if (name != NULL) {
+    mapping->name = name;
+  }
+  return mapping;
+}
+
 vm_mapping_t *_vmap_reserve(uintptr_t virt_addr, size_t size) {
   uint32_t vm_flags = VMAP_FIXED;
   uint16_t attr = 0;
@@ -615,25 +1131,44 @@ void _vunmap_pages(page_t *pages) {
   uintptr_t virt_ptr = mapping->address;
 
   interval_t intvl = intvl(mapping->address, mapping->address + mapping->size);
+  spin_lock(&space->lock);
   intvl_tree_delete(space->root, intvl);
-  // mapping->data.ptr = NULL;
-  // kfree(mapping);
+  spin_unlock(&space->lock);
+  mapping->data.ptr = NULL;
+  kmem_cache_free(vm_mapping_cache, mapping);
 
   page_t *curr = pages;
   while (curr) {
-    kassert(curr->flags & PG_MAPPED);
-    recursive_unmap_entry(virt_ptr, curr->flags);
-    curr->flags ^= PG_MAPPED;
-    curr->mapping = NULL;
+    size_t size;
+    if (curr->flags & (PG_BIGPAGE | PG_HUGEPAGE)) {
+      size = vm_unmap_entry(space, virt_ptr, curr->flags);
+    } else {
+      // consecutive 4k pages are unmapped as one range
+      size = 0;
+      page_t *page = curr;
+      while (page != NULL && !(page->flags & (PG_BIGPAGE | PG_HUGEPAGE))) {
+        size += PAGE_SIZE;
+        page = page->next;
+      }
+      vm_unmap_range(space, virt_ptr, size);
+    }
+    virt_ptr += size;
 
-    virt_ptr += pg_flags_to_size(curr->flags);
-    curr = curr->next;
+    while (curr != NULL && size > 0) {
+      kassert(curr->flags & PG_MAPPED);
+      curr->flags ^= PG_MAPPED;
+      curr->mapping = NULL;
+      size -= pg_flags_to_size(curr->flags);
+      curr = curr->next;
+    }
   }
+  tlb_flush_batch();
 }
 
 void _vunmap_addr(uintptr_t virt_addr, size_t size) {
   address_space_t *space = select_address_space(virt_addr);
   interval_t intvl = intvl(virt_addr, virt_addr + size);
+  spin_lock(&space->lock);
   intvl_node_t *node = intvl_tree_find(space->root, intvl);
   if (node == NULL) {
     panic("unmap: page is not mapped");
@@ -641,32 +1176,50 @@ void _vunmap_addr(uintptr_t virt_addr, size_t size) {
 
   vm_mapping_t *mapping = node->data;
   if (mapping->type == VM_TYPE_PAGE) {
+    // these remove the mapping from the tree themselves
+    spin_unlock(&space->lock);
     _vunmap_pages(mapping->data.page);
     return;
+  } else if (mapping->type == VM_TYPE_ANON) {
+    spin_unlock(&space->lock);
+    kassert(mapping->size == size);
+    vunmap_anon_internal(space, mapping);
+    return;
   }
 
   kassert(mapping->size == size);
   size_t flags = mapping->flags;
   size_t ptr = mapping->address;
-  size_t stride = pg_flags_to_size(mapping->flags);
 
   intvl_tree_delete(space->root, intvl);
+  spin_unlock(&space->lock);
   mapping->data.ptr = NULL;
-  kfree(mapping);
+  kmem_cache_free(vm_mapping_cache, mapping);
 
-  while (size > 0) {
-    recursive_unmap_entry(ptr, flags);
-    ptr += stride;
-    size -= stride;
+  if (pg_flags_to_size(flags) == PAGE_SIZE) {
+    vm_unmap_range(space, ptr, size);
+  } else {
+    while (size > 0) {
+      size_t pgsz = vm_unmap_entry(space, ptr, flags);
+      ptr += pgsz;
+      size -= pgsz;
+    }
   }
+  tlb_flush_batch();
 }
 
 //
 
 vm_mapping_t *_vmap_get_mapping(uintptr_t virt_addr) {
   address_space_t *space = select_address_space(virt_addr);
+  return _address_space_get_mapping(space, virt_addr);
+}
+
+vm_mapping_t *_address_space_get_mapping(address_space_t *space, uintptr_t virt_addr) {
   interval_t intvl = intvl(virt_addr, virt_addr + 1);
+  spin_lock(&space->lock);
   intvl_node_t *node = intvl_tree_find(space->root, intvl);
+  spin_unlock(&space->lock);
   if (node == NULL) {
     return NULL;
   }
@@ -677,6 +1230,8 @@ vm_mapping_t *_vmap_get_mapping(uintptr_t virt_addr) {
 uintptr_t _vm_virt_to_phys(uintptr_t virt_addr) {
   if (virt_addr == 0) {
     return 0;
+  } else if (is_phys_map_addr(virt_addr)) {
+    return virt_to_phys((void *) virt_addr);
   }
 
   address_space_t *space = select_address_space(virt_addr);
@@ -702,6 +1257,13 @@ uintptr_t _vm_virt_to_phys(uintptr_t virt_addr) {
     }
     // TODO: fix bug - hit while calling _vm_virt_to_phys with stack variable pointer
     unreachable;
+  } else if (mapping->type == VM_TYPE_ANON) {
+    page_t *page = mapping->data.pages[offset / PAGE_SIZE];
+    if (page == NULL) {
+      // not faulted in yet
+      return 0;
+    }
+    return page->address + (offset % PAGE_SIZE);
   }
 
   // kprintf("vm_virt_to_phys: invalid mapping type [%018p]", virt_addr);
@@ -752,6 +1314,11 @@ page_t *valloc_named_pagesz(size_t count, uint32_t flags, const char *name) {
 }
 
 page_t *valloc_zero_pages(size_t count, uint32_t flags) {
+  if (count == 1) {
+    // single pages come pre-zeroed from the zero page pool
+    return valloc_pages(1, flags | PG_ZERO);
+  }
+
   page_t *pages = _alloc_pages(count, flags);
   void *ptr = _vmap_pages(pages);
   if (ptr == NULL) {
@@ -831,6 +1398,19 @@ void _address_space_to_graphiz(address_space_t *space) {
   kfree(iter);
 }
 
+static void vm_dump_space_stats(const char *name, address_space_t *space) {
+  kprintf("  %s: %zu major, %zu minor faults\n", name, space->stats.major_faults, space->stats.minor_faults);
+  kprintf("    mapped: %zu KiB 4k, %zu KiB 2mb, %zu KiB 1gb (%zu promoted, %zu split)\n",
+          space->stats.mapped_4k / SIZE_1KB, space->stats.mapped_2mb / SIZE_1KB,
+          space->stats.mapped_1gb / SIZE_1KB, space->stats.promotions, space->stats.splits);
+}
+
+void vm_dump_stats() {
+  kprintf("vm: address space stats\n");
+  vm_dump_space_stats("user", PERCPU_ADDRESS_SPACE);
+  vm_dump_space_stats("kernel", kernel_space);
+}
+
 void vm_print_debug_address_space() {
   kprintf("vm: address space mappings\n");
   _address_space_print_mappings(PERCPU_ADDRESS_SPACE);
@@ -0,0 +1,97 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-12.
+//
+
+#include <mm/zeropool.h>
+#include <mm/pmalloc.h>
+#include <mm/vmalloc.h>
+
+#include <spinlock.h>
+#include <atomic.h>
+#include <string.h>
+#include <printf.h>
+#include <panic.h>
+
+//
+// Zero Page Pool
+//
+// A small pool of frames which have already been zeroed. Requests for single
+// zeroed pages are served from the pool so the memset is kept off of the hot
+// path. The pool is refilled from the idle loop so the zeroing only ever uses
+// cpu time nothing else wants. Frames are zeroed one batch at a time using
+// non-temporal stores so that the zeroing does not evict anything useful from
+// the cache, and the idle loop checks for ready threads between batches.
+//
+
+static spinlock_t zero_pool_lock = {};
+static LIST_HEAD(page_t) zero_pool = LIST_HEAD_INITR;
+static size_t zero_pool_count;
+
+static struct {
+  size_t hits;   // zeroed pages served from the pool
+  size_t misses; // zeroed pages requested while the pool was empty
+  size_t zeroed; // frames zeroed from the idle loop
+} zero_pool_stats;
+
+bool zero_pool_idle_refill() {
+  if (zero_pool_count >= ZERO_POOL_MAX) {
+    return false;
+  }
+
+  // batches are physically contiguous so they are zeroed in one pass
+  page_t *pages = _try_alloc_pages(ZERO_POOL_BATCH, 0);
+  if (pages == NULL) {
+    return false;
+  }
+
+  __memzero_nt(phys_to_virt(pages->address), PAGES_TO_SIZE(ZERO_POOL_BATCH));
+
+  spin_lock(&zero_pool_lock);
+  page_t *page = pages;
+  while (page != NULL) {
+    page_t *next = page->next;
+    page->flags = 0;
+    SLIST_ADD(&zero_pool, page, next);
+    zero_pool_count++;
+    page = next;
+  }
+  spin_unlock(&zero_pool_lock);
+
+  atomic_fetch_add(&zero_pool_stats.zeroed, ZERO_POOL_BATCH);
+  return true;
+}
+
+//
+
+page_t *zero_pool_alloc(uint32_t flags) {
+  kassert(!(flags & (PG_BIGPAGE | PG_HUGEPAGE)));
+  spin_lock(&zero_pool_lock);
+  page_t *page = LIST_FIRST(&zero_pool);
+  if (page == NULL) {
+    spin_unlock(&zero_pool_lock);
+    atomic_fetch_add(&zero_pool_stats.misses, 1);
+    return NULL;
+  }
+
+  zero_pool.first = page->next;
+  if (zero_pool.first == NULL) {
+    zero_pool.last = NULL;
+  }
+  zero_pool_count--;
+  spin_unlock(&zero_pool_lock);
+
+  page->flags = flags | PG_LIST_HEAD | PG_LIST_TAIL;
+  page->head.list_sz = PAGE_SIZE;
+  page->refcount = 1;
+  page->mapping = NULL;
+  page->next = NULL;
+  atomic_fetch_add(&zero_pool_stats.hits, 1);
+  return page;
+}
+
+void zero_pool_dump_stats() {
+  size_t requests = zero_pool_stats.hits + zero_pool_stats.misses;
+  kprintf("  zero page pool: %zu/%d pages, %zu zeroed, %zu/%zu hits (%zu%%)\n",
+          zero_pool_count, ZERO_POOL_MAX, zero_pool_stats.zeroed,
+          zero_pool_stats.hits, requests, requests ? (zero_pool_stats.hits * 100) / requests : 0);
+}
@@ -128,12 +128,12 @@ int mutex_unlock(mutex_t *mutex) {
   kassert(mutex->aquired_by == PERCPU_THREAD);
 
   mutex_trace_debug("unlocking mutex (%d:%d)", getpid(), gettid());
-  thread->preempt_count++;
+  preempt_disable();
   if (mutex->flags & MUTEX_REENTRANT) {
     kassert(mutex->aquire_count > 0);
     mutex->aquire_count--;
     if (mutex->aquire_count > 0) {
-      thread->preempt_count--;
+      preempt_enable();
       return 0;
     }
   }
@@ -148,7 +148,7 @@ int mutex_unlock(mutex_t *mutex) {
   if (next != NULL) {
     sched_unblock(next);
   }
-  thread->preempt_count--;
+  preempt_enable();
   mutex_trace_debug("mutex unlocked (%d:%d)", getpid(), gettid());
   return 0;
 }
@@ -8,9 +8,30 @@
 #include <panic.h>
 #include <mm.h>
 
+#include <cpu/cpu.h>
+
 #include <string.h>
 
 #define BUFFER_SIZE 512
+#define FXSAVE_AREA_SIZE 512
+
+// lib/fmt formats floating point values so unlike the rest of the kernel it
+// is built with the vector registers. those still hold the state of whatever
+// user thread or kernel fpu section was interrupted, so it is saved around
+// each call with interrupts disabled. fxsave covers the x87 and sse state,
+// which is all the compiler uses without an -march that enables avx.
+static uint8_t fmt_fpu_areas[MAX_CPUS][FXSAVE_AREA_SIZE] __aligned(16);
+
+static size_t format_fpu_saved(const char *format, char *str, size_t size, va_list valist) {
+  uint64_t flags;
+  temp_irq_save(flags);
+  void *area = fmt_fpu_areas[PERCPU_ID];
+  cpu_fxsave(area);
+  size_t n = fmt_format(format, str, size, FMT_MAX_ARGS, valist);
+  cpu_fxrstor(area);
+  temp_irq_restore(flags);
+  return n;
+}
 
 // MARK: Public API
 
@@ -18,14 +39,14 @@ void kprintf(const char *format, ...) {
   char str[BUFFER_SIZE];
   va_list valist;
   va_start(valist, format);
-  fmt_format(format, str, BUFFER_SIZE, FMT_MAX_ARGS, valist);
+  format_fpu_saved(format, str, BUFFER_SIZE, valist);
   va_end(valist);
   debug_kputs(str);
 }
 
 void kvfprintf(const char *format, va_list valist) {
   char str[BUFFER_SIZE];
-  fmt_format(format, str, BUFFER_SIZE, FMT_MAX_ARGS, valist);
+  format_fpu_saved(format, str, BUFFER_SIZE, valist);
   debug_kputs(str);
 }
 
@@ -39,14 +60,14 @@ void kvfprintf(const char *format, va_list valist) {
 size_t ksprintf(char *str, const char *format, ...) {
   va_list valist;
   va_start(valist, format);
-  size_t n = fmt_format(format, str, INT32_MAX, FMT_MAX_ARGS, valist);
+  size_t n = format_fpu_saved(format, str, INT32_MAX, valist);
   kassert(n < INT32_MAX);
   va_end(valist);
   return (int) n;
 }
 
 size_t kvsprintf(char *str, const char *format, va_list valist) {
-  return fmt_format(format, str, INT32_MAX, FMT_MAX_ARGS, valist);
+  return format_fpu_saved(format, str, INT32_MAX, valist);
 }
 
 /*
@@ -59,13 +80,13 @@ size_t kvsprintf(char *str, const char *format, va_list valist) {
 size_t ksnprintf(char *str, size_t n, const char *format, ...) {
   va_list valist;
   va_start(valist, format);
-  size_t vn = fmt_format(format, str, n, FMT_MAX_ARGS, valist);
+  size_t vn = format_fpu_saved(format, str, n, valist);
   va_end(valist);
   return vn;
 }
 
 size_t kvsnprintf(char *str, size_t n, const char *format, va_list valist) {
-  return fmt_format(format, str, n, FMT_MAX_ARGS, valist);
+  return format_fpu_saved(format, str, n, valist);
 }
 
 /*
@@ -83,7 +104,7 @@ char *kasprintf(const char *format, ...) {
 
   va_list valist;
   va_start(valist, format);
-  size_t n = fmt_format(format, buffer, BUFFER_SIZE, FMT_MAX_ARGS, valist);
+  size_t n = format_fpu_saved(format, buffer, BUFFER_SIZE, valist);
   va_end(valist);
 
   char *str = kmalloc(n + 1);
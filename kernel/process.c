@@ -174,6 +174,9 @@ pid_t process_fork() {
 
   // clone main thread
   thread_t *main = thread_copy(parent_thread);
+  if (parent_thread->user_stack != NULL) {
+    main->user_stack = _address_space_get_mapping(process->address_space, parent_thread->user_stack->address);
+  }
 
   uintptr_t stack = PAGE_VIRT_ADDR(main->kernel_stack);
   uintptr_t frame = (uintptr_t) __builtin_frame_address(0);
@@ -207,9 +210,8 @@ int process_execve(const char *path, char *const argv[], char *const envp[]) {
   thread_t *thread = PERCPU_THREAD;
   if (thread->user_stack == NULL) {
     thread_alloc_stack(thread, true); // allocate user stack
-    memset((void *) PAGE_VIRT_ADDR(thread->user_stack), 0, USER_PSTACK_SIZE);
   }
-  uintptr_t stack_top = PAGE_VIRT_ADDR(thread->user_stack) + USER_PSTACK_SIZE;
+  uintptr_t stack_top = thread->user_stack->address + thread->user_stack->size;
   uint64_t *rsp = (void *) stack_top;
 
   int argc = ptr_list_len((void *) argv);
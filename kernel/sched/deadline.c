@@ -0,0 +1,307 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-19.
+//
+
+#include <sched/deadline.h>
+
+#include <cpu/cpu.h>
+
+#include <mm.h>
+#include <thread.h>
+#include <clock.h>
+#include <timer.h>
+#include <ipi.h>
+
+#include <rb_tree.h>
+#include <spinlock.h>
+#include <panic.h>
+
+// Deadline Policy
+//
+// Earliest deadline first scheduling of threads which reserve a budget of cpu
+// time in every period. Reservations go through admission control so that the
+// total reserved bandwidth never exceeds DEADLINE_MAX_BW of every cpu. Each
+// thread runs as a constant bandwidth server: once its budget for the current
+// period is used up, it is throttled until the next period begins at which point
+// the budget is replenished and the deadline is pushed back by one period.
+// The remaining budget is the time slice of a running thread so the scheduler
+// timer preempts it once the budget is used up. Throttling a thread records the
+// start of its next period and an alarm is armed for it once the scheduler is
+// unlocked, so that its cpu picks the thread back up.
+
+typedef struct deadline_thread {
+  clock_t period;     // reservation period
+  clock_t budget;     // runtime per period
+  clock_t deadline;   // absolute deadline of the current period
+  int64_t remaining;  // budget left in the current period
+  clock_t throttled_until; // start of the period the budget was replenished for
+  uint64_t bw;        // reserved bandwidth
+  rb_node_t *node;    // runqueue node (NULL if not queued)
+  bool running;       // time slice started under this policy
+  bool woken;         // thread blocked since it last ran
+} deadline_thread_t;
+
+typedef struct sched_policy_deadline {
+  rb_tree_t *tree; // ready threads keyed by absolute deadline
+  size_t count;
+  uint8_t cpu_id;
+  clock_t replenish_at; // earliest replenishment without an alarm (0 if none)
+} sched_policy_deadline_t;
+
+#define DL_T(thread) ((deadline_thread_t *)((thread)->stats->data))
+
+static spinlock_t deadline_bw_lock = {};
+static uint64_t deadline_total_bw; // bandwidth reserved by all threads
+
+static void deadline_alarm_expired(void *data) {
+  // the alarm refers to the cpu rather than the thread so it never has to be
+  // cancelled. a spurious one only causes an extra reschedule.
+  uint8_t cpu_id = (uint8_t)(uintptr_t) data;
+  // this runs on the alarm thread so a thread on this cpu will be picked up
+  // once the alarm thread goes back to sleep
+  if (cpu_id != PERCPU_ID) {
+    ipi_deliver_cpu_id(IPI_SCHEDULE, cpu_id, SCHED_PREEMPTED);
+  }
+}
+
+//
+
+void *deadline_init(sched_t *sched) {
+  sched_policy_deadline_t *dl = kmalloc(sizeof(sched_policy_deadline_t));
+  dl->tree = create_rb_tree();
+  dl->count = 0;
+  dl->cpu_id = sched->cpu_id;
+  dl->replenish_at = 0;
+  return dl;
+}
+
+int deadline_add_thread(void *self, thread_t *thread) {
+  sched_policy_deadline_t *dl = self;
+  deadline_thread_t *dt = DL_T(thread);
+  kassert(dt->node == NULL);
+
+  if (dt->woken) {
+    // start a new period unless the remaining budget still fits before the
+    // current deadline without exceeding the reserved bandwidth
+    clock_t now = clock_now();
+    if (dt->deadline <= now || (uint64_t) dt->remaining * dt->period > (dt->deadline - now) * dt->budget) {
+      dt->deadline = now + dt->period;
+      dt->remaining = (int64_t) dt->budget;
+      dt->throttled_until = 0;
+    }
+    dt->woken = false;
+  }
+
+  rb_node_t *node = kmalloc(sizeof(rb_node_t));
+  node->key = dt->deadline;
+  node->data = thread;
+  rb_tree_insert_node(dl->tree, node);
+  dt->node = node;
+  dl->count++;
+  return 0;
+}
+
+int deadline_remove_thread(void *self, thread_t *thread) {
+  sched_policy_deadline_t *dl = self;
+  deadline_thread_t *dt = DL_T(thread);
+  kassert(dl->count > 0);
+  kassert(dt->node != NULL);
+
+  rb_tree_delete_node(dl->tree, dt->node);
+  dt->node = NULL;
+  dl->count--;
+  return 0;
+}
+
+thread_t *deadline_get_next_thread(void *self) {
+  sched_policy_deadline_t *dl = self;
+  if (dl->count == 0) {
+    return NULL;
+  }
+
+  // earliest deadline which is not throttled
+  clock_t now = clock_now();
+  rb_iter_t iter;
+  rb_tree_init_iter(dl->tree, dl->tree->min, FORWARD, &iter);
+  rb_node_t *node;
+  while ((node = rb_iter_next(&iter))) {
+    thread_t *thread = node->data;
+    if (DL_T(thread)->throttled_until <= now) {
+      deadline_remove_thread(dl, thread);
+      return thread;
+    }
+  }
+  return NULL;
+}
+
+thread_t *deadline_get_migratable_thread(void *self, uint8_t cpu_id) {
+  sched_policy_deadline_t *dl = self;
+  if (dl->count == 0) {
+    return NULL;
+  }
+
+  // the latest deadlines would wait the longest. throttled threads stay since
+  // the replenishment alarm only reschedules this cpu
+  clock_t now = clock_now();
+  rb_iter_t iter;
+  rb_tree_init_iter(dl->tree, dl->tree->max, REVERSE, &iter);
+  rb_node_t *node;
+  while ((node = rb_iter_next(&iter))) {
+    thread_t *thread = node->data;
+    if (DL_T(thread)->throttled_until > now) {
+      continue;
+    }
+    if ((thread->affinity < 0 || thread->affinity == cpu_id) && !thread->on_cpu) {
+      return thread;
+    }
+  }
+  return NULL;
+}
+
+clock_t deadline_get_thread_timeslice(void *self, thread_t *thread) {
+  return (clock_t) DL_T(thread)->remaining;
+}
+
+//
+
+int deadline_policy_init_thread(void *self, thread_t *thread) {
+  deadline_thread_t *dt = kmallocz(sizeof(deadline_thread_t));
+  thread->stats->data = dt;
+  return 0;
+}
+
+int deadline_policy_deinit_thread(void *self, thread_t *thread) {
+  deadline_thread_t *dt = DL_T(thread);
+  kassert(dt->node == NULL);
+
+  spin_lock(&deadline_bw_lock);
+  deadline_total_bw -= dt->bw;
+  spin_unlock(&deadline_bw_lock);
+
+  kfree(dt);
+  thread->stats->data = NULL;
+  return 0;
+}
+
+int deadline_on_update_thread_stats(void *self, thread_t *thread, sched_cause_t reason) {
+  if (reason == SCHED_BLOCKED || reason == SCHED_SLEEPING) {
+    DL_T(thread)->woken = true;
+  }
+  return 0;
+}
+
+int deadline_on_thread_timeslice_start(void *self, thread_t *thread) {
+  deadline_thread_t *dt = DL_T(thread);
+  kassert(dt->remaining >= (int64_t) DEADLINE_MIN_RUNTIME);
+  dt->running = true;
+  return 0;
+}
+
+int deadline_on_thread_timeslice_end(void *self, thread_t *thread) {
+  sched_policy_deadline_t *dl = self;
+  deadline_thread_t *dt = DL_T(thread);
+  sched_stats_t *stats = thread->stats;
+  if (!dt->running) {
+    // the thread only just switched to this policy
+    return 0;
+  }
+
+  dt->running = false;
+  dt->remaining -= (int64_t)(stats->last_active - stats->last_scheduled);
+  if (dt->remaining < (int64_t) DEADLINE_MIN_RUNTIME) {
+    // budget exhausted so throttle the thread until the next period (paying
+    // back any overrun) and give it a new deadline
+    while (dt->remaining < (int64_t) DEADLINE_MIN_RUNTIME) {
+      dt->deadline += dt->period;
+      dt->remaining += (int64_t) dt->budget;
+    }
+    dt->throttled_until = dt->deadline - dt->period;
+    if (dl->replenish_at == 0 || dt->throttled_until < dl->replenish_at) {
+      dl->replenish_at = dt->throttled_until;
+    }
+  }
+  return 0;
+}
+
+int deadline_on_reschedule_unlocked(void *self) {
+  // creating an alarm allocates and can wake up the alarm thread so it is
+  // only done once the scheduler is unlocked
+  sched_policy_deadline_t *dl = self;
+  if (dl->replenish_at == 0) {
+    return 0;
+  }
+
+  // alarms too close to now could be dispatched from inside this call. they
+  // are pushed back instead of dropped since an idle cpu with only throttled
+  // threads sleeps until the replenishment alarm wakes it
+  clock_t expires = max(dl->replenish_at, clock_now() + DEADLINE_MIN_RUNTIME);
+  dl->replenish_at = 0;
+  timer_create_alarm(expires, deadline_alarm_expired, (void *)(uintptr_t) dl->cpu_id);
+  return 0;
+}
+
+//
+
+int deadline_policy_admit_thread(thread_t *thread, sched_opts_t *opts) {
+  if (opts->budget < DEADLINE_MIN_BUDGET || opts->budget > opts->period || opts->period > DEADLINE_MAX_PERIOD) {
+    return -EINVAL;
+  }
+
+  uint64_t bw = (opts->budget << DEADLINE_BW_SHIFT) / opts->period;
+  spin_lock(&deadline_bw_lock);
+  if (deadline_total_bw + bw > DEADLINE_MAX_BW * system_num_cpus) {
+    spin_unlock(&deadline_bw_lock);
+    return -EBUSY;
+  }
+  deadline_total_bw += bw;
+  spin_unlock(&deadline_bw_lock);
+  return 0;
+}
+
+int deadline_policy_setup_thread(thread_t *thread, sched_opts_t *opts) {
+  deadline_thread_t *dt = DL_T(thread);
+  dt->period = opts->period;
+  dt->budget = opts->budget;
+  dt->bw = (opts->budget << DEADLINE_BW_SHIFT) / opts->period;
+  dt->deadline = clock_now() + opts->period;
+  dt->remaining = (int64_t) opts->budget;
+  dt->throttled_until = 0;
+  return 0;
+}
+
+bool deadline_should_thread_preempt_same_policy(thread_t *active, thread_t *other) {
+  return DL_T(other)->deadline < DL_T(active)->deadline;
+}
+
+uint64_t deadline_compute_thread_cpu_affinity_score(sched_t *sched, thread_t *thread) {
+  // prefer cpus where the thread can run right away
+  sched_policy_deadline_t *dl = sched->policies[POLICY_DEADLINE].data;
+  uint64_t cost = (dl->count + (sched->active->policy == POLICY_DEADLINE ? 1 : 0)) * 2;
+  if (thread->cpu_id != sched->cpu_id) {
+    cost++;
+  }
+  return cost;
+}
+
+//
+
+sched_policy_impl_t sched_policy_deadline = {
+  .init = deadline_init,
+  .add_thread = deadline_add_thread,
+  .remove_thread = deadline_remove_thread,
+  .get_next_thread = deadline_get_next_thread,
+  .get_migratable_thread = deadline_get_migratable_thread,
+  .get_thread_timeslice = deadline_get_thread_timeslice,
+
+  .policy_init_thread = deadline_policy_init_thread,
+  .policy_deinit_thread = deadline_policy_deinit_thread,
+  .on_update_thread_stats = deadline_on_update_thread_stats,
+  .on_thread_timeslice_start = deadline_on_thread_timeslice_start,
+  .on_thread_timeslice_end = deadline_on_thread_timeslice_end,
+  .on_reschedule_unlocked = deadline_on_reschedule_unlocked,
+
+  .policy_admit_thread = deadline_policy_admit_thread,
+  .policy_setup_thread = deadline_policy_setup_thread,
+  .should_thread_preempt_same_policy = deadline_should_thread_preempt_same_policy,
+  .compute_thread_cpu_affinity_score = deadline_compute_thread_cpu_affinity_score,
+};
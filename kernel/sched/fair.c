@@ -0,0 +1,239 @@
+//
+// Created by Aaron Gill-Braun on 2023-06-18.
+//
+
+#include <sched/fair.h>
+
+#include <mm.h>
+#include <thread.h>
+#include <clock.h>
+
+#include <rb_tree.h>
+#include <panic.h>
+
+// Fair Share Policy
+//
+// Every thread accumulates virtual runtime as it runs, scaled down by its
+// weight (derived from the priority) so heavier threads age more slowly. The
+// ready threads are kept in a tree keyed by their vruntime and the one which
+// has received the least cpu time so far is always picked next. Time slices
+// split a fixed scheduling period between all ready threads in proportion to
+// their weight, with the period growing once there are too many threads to
+// give each one at least FAIR_MIN_GRANULARITY.
+//
+// Each runqueue tracks a monotonic min_vruntime which new, waking and migrating
+// threads are placed relative to so that a thread can not build up credit by
+// sleeping or moving between cpus.
+
+typedef struct fair_thread {
+  uint64_t vruntime;  // weighted virtual runtime (ns)
+  uint64_t weight;    // weight used while the thread is queued
+  clock_t slice;      // length of the current time slice
+  rb_node_t node;     // runqueue node
+  bool queued;        // node is in the runqueue
+  bool migrated;      // vruntime is relative to the old runqueue
+} fair_thread_t;
+
+typedef struct sched_policy_fair {
+  rb_tree_t *tree;       // ready threads keyed by vruntime
+  uint64_t min_vruntime; // lower bound of the vruntime of all threads
+  uint64_t total_weight; // sum of the weights of the ready threads
+  size_t count;
+} sched_policy_fair_t;
+
+#define FAIR_T(thread) ((fair_thread_t *)((thread)->stats->data))
+
+static inline uint64_t fair_weight(thread_t *thread) {
+  // each priority level adds 1/8th of the base weight
+  return FAIR_BASE_WEIGHT + ((uint64_t) thread->priority * (FAIR_BASE_WEIGHT / 8));
+}
+
+static inline uint64_t fair_scale_delta(clock_t delta, uint64_t weight) {
+  return (delta * FAIR_BASE_WEIGHT) / weight;
+}
+
+static void fair_update_min_vruntime(sched_policy_fair_t *fair, uint64_t vruntime) {
+  // `vruntime` is that of the thread which just ran (or the smallest one queued)
+  if (fair->tree->nodes > 0) {
+    vruntime = min(vruntime, fair->tree->min->key);
+  }
+  fair->min_vruntime = max(fair->min_vruntime, vruntime);
+}
+
+//
+
+void *fair_init(sched_t *sched) {
+  sched_policy_fair_t *fair = kmalloc(sizeof(sched_policy_fair_t));
+  fair->tree = create_rb_tree();
+  fair->min_vruntime = 0;
+  fair->total_weight = 0;
+  fair->count = 0;
+  return fair;
+}
+
+int fair_add_thread(void *self, thread_t *thread) {
+  sched_policy_fair_t *fair = self;
+  fair_thread_t *ft = FAIR_T(thread);
+  kassert(!ft->queued);
+
+  if (ft->migrated) {
+    ft->vruntime += fair->min_vruntime;
+    ft->migrated = false;
+  }
+
+  // threads waking up get at most half a period of credit
+  uint64_t floor = fair->min_vruntime > FAIR_LATENCY / 2 ? fair->min_vruntime - FAIR_LATENCY / 2 : 0;
+  ft->vruntime = max(ft->vruntime, floor);
+  ft->weight = fair_weight(thread);
+
+  // the node is embedded so enqueueing never allocates under the sched lock
+  ft->node.key = ft->vruntime;
+  ft->node.data = thread;
+  rb_tree_insert_node(fair->tree, &ft->node);
+  ft->queued = true;
+
+  fair->total_weight += ft->weight;
+  fair->count++;
+  return 0;
+}
+
+int fair_remove_thread(void *self, thread_t *thread) {
+  sched_policy_fair_t *fair = self;
+  fair_thread_t *ft = FAIR_T(thread);
+  kassert(fair->count > 0);
+  kassert(ft->queued);
+
+  rb_tree_remove_node(fair->tree, &ft->node);
+  ft->queued = false;
+  fair->total_weight -= ft->weight;
+  fair->count--;
+  return 0;
+}
+
+thread_t *fair_get_next_thread(void *self) {
+  sched_policy_fair_t *fair = self;
+  if (fair->count == 0) {
+    return NULL;
+  }
+
+  thread_t *thread = fair->tree->min->data;
+  fair_remove_thread(fair, thread);
+  return thread;
+}
+
+thread_t *fair_get_migratable_thread(void *self, uint8_t cpu_id) {
+  sched_policy_fair_t *fair = self;
+  if (fair->count == 0) {
+    return NULL;
+  }
+
+  // the threads furthest ahead in vruntime would wait the longest
+  thread_t *result = NULL;
+  rb_iter_t iter;
+  rb_tree_init_iter(fair->tree, fair->tree->max, REVERSE, &iter);
+  rb_node_t *node;
+  while ((node = rb_iter_next(&iter))) {
+    thread_t *thread = node->data;
+    if ((thread->affinity < 0 || thread->affinity == cpu_id) && !thread->on_cpu) {
+      result = thread;
+      break;
+    }
+  }
+  return result;
+}
+
+clock_t fair_get_thread_timeslice(void *self, thread_t *thread) {
+  return FAIR_T(thread)->slice;
+}
+
+//
+
+int fair_policy_init_thread(void *self, thread_t *thread) {
+  sched_policy_fair_t *fair = self;
+  fair_thread_t *ft = kmallocz(sizeof(fair_thread_t));
+  // start new threads at the back of the current period
+  ft->vruntime = fair->min_vruntime;
+  ft->weight = fair_weight(thread);
+  thread->stats->data = ft;
+  return 0;
+}
+
+int fair_policy_deinit_thread(void *self, thread_t *thread) {
+  fair_thread_t *ft = FAIR_T(thread);
+  kassert(!ft->queued);
+  kfree(ft);
+  thread->stats->data = NULL;
+  return 0;
+}
+
+int fair_on_update_thread_stats(void *self, thread_t *thread, sched_cause_t reason) {
+  sched_policy_fair_t *fair = self;
+  if (reason == SCHED_YIELDED && fair->count > 0) {
+    // move behind every other ready thread
+    fair_thread_t *ft = FAIR_T(thread);
+    ft->vruntime = max(ft->vruntime, fair->tree->max->key);
+  }
+  return 0;
+}
+
+int fair_on_thread_timeslice_start(void *self, thread_t *thread) {
+  sched_policy_fair_t *fair = self;
+  fair_thread_t *ft = FAIR_T(thread);
+
+  // the thread was already taken off of the runqueue
+  size_t nr_running = fair->count + 1;
+  uint64_t total_weight = fair->total_weight + ft->weight;
+  clock_t period = max(FAIR_LATENCY, nr_running * FAIR_MIN_GRANULARITY);
+  ft->slice = max((period * ft->weight) / total_weight, FAIR_MIN_GRANULARITY);
+  return 0;
+}
+
+int fair_on_thread_timeslice_end(void *self, thread_t *thread) {
+  sched_policy_fair_t *fair = self;
+  fair_thread_t *ft = FAIR_T(thread);
+  sched_stats_t *stats = thread->stats;
+
+  clock_t delta = stats->last_active - stats->last_scheduled;
+  ft->vruntime += fair_scale_delta(delta, fair_weight(thread));
+  fair_update_min_vruntime(fair, ft->vruntime);
+  return 0;
+}
+
+int fair_on_thread_migrate_cpu(void *self, thread_t *thread, uint8_t new_cpu) {
+  sched_policy_fair_t *fair = self;
+  fair_thread_t *ft = FAIR_T(thread);
+  // keep only the lead over the old runqueue, fair_add_thread rebases it
+  ft->vruntime = ft->vruntime > fair->min_vruntime ? ft->vruntime - fair->min_vruntime : 0;
+  ft->migrated = true;
+  return 0;
+}
+
+bool fair_should_thread_preempt_same_policy(thread_t *active, thread_t *other) {
+  fair_thread_t *aft = FAIR_T(active);
+  fair_thread_t *oft = FAIR_T(other);
+
+  // include the time the active thread has been running so far
+  clock_t running = clock_now() - active->stats->last_scheduled;
+  uint64_t active_vruntime = aft->vruntime + fair_scale_delta(running, fair_weight(active));
+  return oft->vruntime + FAIR_WAKEUP_GRANULARITY < active_vruntime;
+}
+
+//
+
+sched_policy_impl_t sched_policy_fair = {
+  .init = fair_init,
+  .add_thread = fair_add_thread,
+  .remove_thread = fair_remove_thread,
+  .get_next_thread = fair_get_next_thread,
+  .get_migratable_thread = fair_get_migratable_thread,
+  .get_thread_timeslice = fair_get_thread_timeslice,
+
+  .policy_init_thread = fair_policy_init_thread,
+  .policy_deinit_thread = fair_policy_deinit_thread,
+  .on_update_thread_stats = fair_on_update_thread_stats,
+  .on_thread_timeslice_start = fair_on_thread_timeslice_start,
+  .on_thread_timeslice_end = fair_on_thread_timeslice_end,
+  .on_thread_migrate_cpu = fair_on_thread_migrate_cpu,
+
+  .should_thread_preempt_same_policy = fair_should_thread_preempt_same_policy,
+};
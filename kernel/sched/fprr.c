@@ -10,23 +10,39 @@
 #include <string.h>
 #include <panic.h>
 
+#include <asm/bits.h>
+
 // Fixed Priority Round Robin Policy
+//
+// Ready threads are kept in one fifo queue per priority level along with a
+// bitmap of the non-empty levels, so the highest priority thread is found
+// with a single bit scan and adding or removing a thread is O(1).
 
 typedef struct sched_policy_fprr {
   size_t count;
-  LIST_HEAD(thread_t) queue;
+  uint64_t bitmap; // non-empty priority levels
+  LIST_HEAD(thread_t) queues[FPRR_NUM_PRIORITIES];
 } sched_policy_fprr_t;
 
+static inline uint8_t fprr_level(thread_t *thread) {
+  return min(thread->priority, FPRR_NUM_PRIORITIES - 1);
+}
+
 void *fprr_init(sched_t *sched) {
   sched_policy_fprr_t *fprr = kmalloc(sizeof(sched_policy_fprr_t));
   fprr->count = 0;
-  LIST_INIT(&fprr->queue);
+  fprr->bitmap = 0;
+  for (int i = 0; i < FPRR_NUM_PRIORITIES; i++) {
+    LIST_INIT(&fprr->queues[i]);
+  }
   return fprr;
 }
 
 int fprr_add_thread(void *self, thread_t *thread) {
   sched_policy_fprr_t *fprr = self;
-  LIST_ADD(&fprr->queue, thread, list);
+  uint8_t level = fprr_level(thread);
+  LIST_ADD(&fprr->queues[level], thread, list);
+  fprr->bitmap |= 1ULL << level;
   fprr->count++;
   return 0;
 }
@@ -34,32 +50,59 @@ int fprr_add_thread(void *self, thread_t *thread) {
 int fprr_remove_thread(void *self, thread_t *thread) {
   sched_policy_fprr_t *fprr = self;
   kassert(fprr->count > 0);
-  LIST_REMOVE(&fprr->queue, thread, list);
+  uint8_t level = fprr_level(thread);
+  LIST_REMOVE(&fprr->queues[level], thread, list);
+  if (LIST_EMPTY(&fprr->queues[level])) {
+    fprr->bitmap &= ~(1ULL << level);
+  }
   fprr->count--;
   return 0;
 }
 
 thread_t *fprr_get_next_thread(void *self) {
   sched_policy_fprr_t *fprr = self;
-  if (fprr->count == 0) {
+  if (fprr->bitmap == 0) {
     return NULL;
   }
 
-  thread_t *thread = LIST_FIRST(&fprr->queue);
-  if (thread == NULL) {
-    kassert(thread != NULL);
-  }
+  uint8_t level = __bsr64(fprr->bitmap);
+  thread_t *thread = LIST_FIRST(&fprr->queues[level]);
+  kassert(thread != NULL);
 
-  LIST_REMOVE(&fprr->queue, thread, list);
+  LIST_REMOVE(&fprr->queues[level], thread, list);
+  if (LIST_EMPTY(&fprr->queues[level])) {
+    fprr->bitmap &= ~(1ULL << level);
+  }
   fprr->count--;
   return thread;
 }
 
+thread_t *fprr_get_migratable_thread(void *self, uint8_t cpu_id) {
+  sched_policy_fprr_t *fprr = self;
+  // take the lowest priority threads from the back of their queue since
+  // those would wait the longest
+  uint64_t bitmap = fprr->bitmap;
+  while (bitmap != 0) {
+    uint8_t level = __bsf64(bitmap);
+    bitmap &= ~(1ULL << level);
+
+    thread_t *thread = LIST_LAST(&fprr->queues[level]);
+    while (thread != NULL) {
+      if ((thread->affinity < 0 || thread->affinity == cpu_id) && !thread->on_cpu) {
+        return thread;
+      }
+      thread = LIST_PREV(thread, list);
+    }
+  }
+  return NULL;
+}
+
 //
 
 sched_policy_impl_t sched_policy_fprr = {
   .init = fprr_init,
   .add_thread = fprr_add_thread,
   .remove_thread = fprr_remove_thread,
-  .get_next_thread = fprr_get_next_thread
+  .get_next_thread = fprr_get_next_thread,
+  .get_migratable_thread = fprr_get_migratable_thread,
 };
@@ -4,16 +4,22 @@
 
 #include <sched/sched.h>
 #include <sched/fprr.h>
+#include <sched/fair.h>
+#include <sched/deadline.h>
 
 #include <cpu/cpu.h>
 #include <cpu/io.h>
 
+#include <device/apic.h>
+
 #include <mm.h>
+#include <mm/zeropool.h>
 #include <thread.h>
 #include <process.h>
 #include <clock.h>
 #include <timer.h>
 #include <ipi.h>
+#include <irq.h>
 
 #include <printf.h>
 #include <panic.h>
@@ -23,8 +29,6 @@ sched_policy_impl_t *policy_impl[NUM_POLICIES];
 sched_t *_schedulers[MAX_CPUS] = {};
 size_t _num_schedulers = 0;
 
-#define SCHED_UNIPROC
-
 #define DPRINTF(...)
 // #define DPRINTF(...) kprintf(__VA_ARGS__)
 
@@ -108,6 +112,7 @@ static inline void sched_add_ready_thread(sched_t *sched, thread_t *thread) {
   int result = SCHED_DISPATCH(sched, thread->policy, add_thread, thread);
   sched_assert(result == 0);
   sched->ready_count++;
+  sched->throttled = false;
   // kprintf("sched: added ready thread\n");
 }
 
@@ -170,22 +175,34 @@ void sched_update_thread_stats(sched_t *sched, thread_t *thread, sched_cause_t r
   SCHED_DISPATCH(sched, thread->policy, on_update_thread_stats, thread, reason);
 }
 
-double sched_compute_thread_cpu_affinity_score(sched_t *sched, thread_t *thread) {
+static inline bool sched_has_runnable(sched_t *sched) {
+  // ready threads which are all throttled can only run again once their
+  // policy wakes the cpu up (or another thread is made ready)
+  return sched->ready_count > 0 && !sched->throttled;
+}
+
+static inline size_t sched_load(sched_t *sched) {
+  // number of threads competing for the cpu (including the active one)
+  return sched->ready_count + (sched->active != sched->idle ? 1 : 0);
+}
+
+uint64_t sched_compute_thread_cpu_affinity_score(sched_t *sched, thread_t *thread) {
+  // the cost of placing `thread` on `sched` (lower is better)
+  // this is integer only since the fpu state is not saved for kernel code
   if (POLICY_FUNC(thread->policy, compute_thread_cpu_affinity_score) != NULL) {
-    return POLICY_FUNC(thread->policy, compute_thread_cpu_affinity_score)(thread);
+    return POLICY_FUNC(thread->policy, compute_thread_cpu_affinity_score)(sched, thread);
   }
 
-  double load_scale = 0.2f;
-  if (thread->cpu_id == sched->cpu_id && thread->stats->sched_count > 0) {
-    // prefer to schedule onto the same scheduler as before
-    load_scale = 0.1f;
+  uint64_t cost = (sched_load(sched) * 4) + sched->blocked_count;
+  if (thread->cpu_id != sched->cpu_id || thread->stats->sched_count == 0) {
+    // prefer the cpu the thread last ran on since its cache is still warm
+    cost *= 2;
   }
-
-  double sched_load = ((sched->ready_count * 0.8) + (sched->blocked_count * 0.2));
-  return 1 / (load_scale * sched_load);
+  return cost;
 }
 
 thread_t *sched_get_next_thread(sched_t *sched) {
+  sched->throttled = false;
   if (sched->ready_count == 0) {
     return sched->idle;
   }
@@ -198,6 +215,12 @@ thread_t *sched_get_next_thread(sched_t *sched) {
     }
   }
 
+  if (thread == NULL) {
+    // every ready thread is throttled by its policy
+    sched->throttled = true;
+    return sched->idle;
+  }
+
   sched->ready_count--;
   // kprintf("sched: removed ready (next) thread\n");
 
@@ -207,36 +230,24 @@ thread_t *sched_get_next_thread(sched_t *sched) {
 }
 
 sched_t *sched_find_cpu_for_thread(thread_t *thread) {
-#ifdef SCHED_UNIPROC
-  return PERCPU_SCHED;
-#endif
-
   if (thread->affinity >= 0) {
     return SCHEDULER(thread->affinity);
-  } else if (thread->stats->sched_count >= SCHED_COUNT_CACHE_AFFINITY_THRES) {
-    return SCHEDULER(thread->cpu_id);
   }
 
-  sched_t *best_sched = _schedulers[0];
+  // start from the last cpu (or the local one) so that it wins any ties
+  sched_t *best_sched = thread->stats->sched_count > 0 ? SCHEDULER(thread->cpu_id) : PERCPU_SCHED;
+  uint64_t best_score = sched_compute_thread_cpu_affinity_score(best_sched, thread);
   foreach_sched(sched) {
-    if (sched->total_count <= best_sched->total_count) {
+    if (sched == best_sched) {
+      continue;
+    }
+
+    uint64_t score = sched_compute_thread_cpu_affinity_score(sched, thread);
+    if (score < best_score) {
       best_sched = sched;
+      best_score = score;
     }
   }
-
-  // double best_score = sched_compute_thread_cpu_affinity_score(best_sched, thread);
-  // foreach_sched(sched) {
-  //   if (sched == best_sched) {
-  //     continue;
-  //   }
-  //
-  //   double score = sched_compute_thread_cpu_affinity_score(sched, thread);
-  //   if (score > best_score) {
-  //     best_sched = sched;
-  //     best_score = score;
-  //   }
-  // }
-
   return best_sched;
 }
 
@@ -262,70 +273,231 @@ bool sched_should_preempt(sched_t *sched, thread_t *thread) {
   return preempt;
 }
 
+static int sched_preempt_cpu(sched_t *sched) {
+  // preempts the active thread on the given cpu
+  if (sched->cpu_id == PERCPU_ID) {
+    // reschedule current cpu
+    return sched_reschedule(SCHED_PREEMPTED);
+  } else if (sched->idle_polling) {
+    // the cpu is idle in mwait and already woke up from the ready_count store
+    return 0;
+  }
+
+  DPRINTF("[CPU#%d] sched: sending ipi to CPU#%d\n", PERCPU_ID, sched->cpu_id);
+  return ipi_deliver_cpu_id(IPI_SCHEDULE, sched->cpu_id, SCHED_PREEMPTED);
+}
+
+//
+// Time Slices
+//
+// There is no periodic tick. Each cpu instead arms its local apic timer in
+// one-shot mode for the end of the active thread's time slice whenever it
+// switches threads, and the timer interrupt preempts the thread if it is still
+// running by then. While the runqueue is empty the thread would be picked again
+// anyway, so the timer is left off until another thread is made ready there.
+// Deadline threads are the exception since the end of their time slice is the
+// end of their budget, which has to be enforced even when they run alone.
+//
+
+static inline bool sched_slice_has_end(sched_t *sched, thread_t *thread) {
+  return thread != sched->idle && (sched->ready_count > 0 || thread->policy == POLICY_DEADLINE);
+}
+
+static void sched_arm_timer(sched_t *sched) {
+  // (re)arms the timer for the active thread. must be called on the cpu of
+  // `sched` with the scheduler locked and interrupts disabled.
+  sched_assert(sched->cpu_id == PERCPU_ID);
+  thread_t *active = sched->active;
+  if (!sched_slice_has_end(sched, active)) {
+    sched->slice_end = 0;
+    apic_oneshot_ns(0);
+    return;
+  }
+
+  clock_t slice = SCHED_DEFAULT_TIMESLICE;
+  if (POLICY_FUNC(active->policy, get_thread_timeslice)) {
+    slice = POLICY_FUNC(active->policy, get_thread_timeslice)(POLICY_DATA(sched, active->policy), active);
+  }
+  slice = min(max(slice, SCHED_MIN_TIMESLICE), SCHED_MAX_TIMESLICE);
+
+  clock_t now = clock_now();
+  sched->slice_end = max(active->stats->last_scheduled + slice, now + SCHED_MIN_TIMESLICE);
+  apic_oneshot_ns(sched->slice_end - now);
+}
+
+static inline bool sched_needs_timer(sched_t *sched) {
+  // the active thread has been running alone without a timer
+  return sched->active != sched->idle && sched->slice_end == 0;
+}
+
+static int sched_start_timer(sched_t *sched) {
+  // starts the timer on the given cpu after a thread was made ready there
+  if (sched->cpu_id != PERCPU_ID) {
+    return ipi_deliver_cpu_id(IPI_TIMESLICE, sched->cpu_id, 0);
+  }
+
+  sched_timer_update();
+  return 0;
+}
+
 // ----------------------------------------------------------
 // Locks must be used
-
-void sched_migrate_thread(sched_t *old_sched, sched_t *new_sched, thread_t *thread) {
+//
+// Lock order: thread -> scheduler -> policy. Only one scheduler lock is
+// held at a time.
+
+int sched_migrate_thread(sched_t *old_sched, sched_t *new_sched, thread_t *thread, bool queued) {
+  // moves a ready thread from `old_sched` to the ready queue of `new_sched`. if
+  // `queued` is true the thread is taken off of the old ready queue first and the
+  // migration is abandoned if the thread was picked or moved in the meantime.
+  // the two scheduler locks are never held at the same time.
   sched_assert(old_sched != new_sched);
-  sched_assert(thread->cpu_id == old_sched->cpu_id);
-  sched_assert(thread->status == THREAD_READY);
+
+  uint64_t flags;
+  temp_irq_save(flags);
+  LOCK_THREAD(thread);
+  LOCK_SCHED(old_sched);
+  if (thread->cpu_id != old_sched->cpu_id || thread->status != THREAD_READY) {
+    sched_assert(queued);
+    UNLOCK_SCHED(old_sched);
+    UNLOCK_THREAD(thread);
+    temp_irq_restore(flags);
+    return -1;
+  }
 
   DPRINTF("[CPU#%d] sched: migrating thread %d.%d [%s] from CPU#%d to CPU#%d\n",
           PERCPU_ID, thread->process->pid, thread->tid, thread->name, old_sched->cpu_id, new_sched->cpu_id);
-  // DPRINTF("sched: migrating thread %d.%d from CPU#%d to CPU#%d\n",
-  //         thread->process->pid, thread->tid, old_sched->cpu_id, new_sched->cpu_id);
 
-  LOCK_THREAD(thread);
-  LOCK_SCHED(old_sched);
   LOCK_POLICY(old_sched, thread);
+  if (queued) {
+    sched_remove_ready_thread(old_sched, thread);
+  }
+  old_sched->total_count--;
   thread->cpu_id = new_sched->cpu_id;
   SCHED_DISPATCH(old_sched, thread->policy, on_thread_migrate_cpu, thread, new_sched->cpu_id);
   UNLOCK_POLICY(old_sched, thread);
   UNLOCK_SCHED(old_sched);
 
   LOCK_SCHED(new_sched);
+  LOCK_POLICY(new_sched, thread);
   sched_add_ready_thread(new_sched, thread);
   new_sched->total_count++;
+  bool start_timer = sched_needs_timer(new_sched);
+  UNLOCK_POLICY(new_sched, thread);
   UNLOCK_SCHED(new_sched);
 
   UNLOCK_THREAD(thread);
+  temp_irq_restore(flags);
+
+  if (start_timer) {
+    sched_start_timer(new_sched);
+  }
+  return 0;
+}
+
+void sched_balance(sched_t *sched) {
+  // pulls a ready thread over from the busiest cpu if it is sufficiently
+  // busier than this one. only the busiest scheduler is locked while a
+  // thread is picked and it is released before the migration.
+  sched->last_balance = clock_now();
+
+  sched_t *busiest = NULL;
+  size_t busiest_load = sched_load(sched) + 1;
+  foreach_sched(other) {
+    if (other == sched || other->ready_count == 0) {
+      continue;
+    }
+
+    size_t load = sched_load(other);
+    if (load > busiest_load) {
+      busiest = other;
+      busiest_load = load;
+    }
+  }
+
+  if (busiest == NULL) {
+    return;
+  }
+
+  uint64_t flags;
+  temp_irq_save(flags);
+  LOCK_SCHED(busiest);
+  thread_t *thread = NULL;
+  foreach_policy(policy) {
+    if (POLICY_FUNC(policy, get_migratable_thread) == NULL) {
+      continue;
+    }
+
+    LOCK(&busiest->policies[policy]);
+    thread = POLICY_FUNC(policy, get_migratable_thread)(POLICY_DATA(busiest, policy), sched->cpu_id);
+    UNLOCK(&busiest->policies[policy]);
+    if (thread != NULL) {
+      break;
+    }
+  }
+  UNLOCK_SCHED(busiest);
+
+  if (thread != NULL) {
+    sched_migrate_thread(busiest, sched, thread, true);
+  }
+  temp_irq_restore(flags);
 }
 
 //
 
+static void sched_idle_wait(sched_t *sched) {
+  // sleeps until the next interrupt or, when mwait is supported, until the
+  // ready count of this cpu is written to. the ready count is checked again
+  // after arming the monitor so a wakeup can not slip in before the sleep.
+  uint64_t flags;
+  temp_irq_save(flags);
+  clock_t start = clock_now();
+  if (cpuid_query_bit(CPUID_BIT_MONITOR)) {
+    sched->idle_polling = true;
+    // pairs with the fence in spin_unlock on the waking cpu
+    __asm volatile("mfence" ::: "memory");
+    cpu_monitor(&sched->ready_count);
+    if (!sched_has_runnable(sched)) {
+      cpu_sti_mwait();
+    }
+    sched->idle_polling = false;
+  } else if (!sched_has_runnable(sched)) {
+    cpu_sti_hlt();
+  }
+
+  sched->idle_time += clock_now() - start;
+  temp_irq_restore(flags);
+}
+
 noreturn void *sched_idle_thread(void *arg) {
   sched_t *sched = PERCPU_SCHED;
 
-  uint64_t retries = 0;
   clock_t expire = clock_future_time(MS_TO_NS(1000));
   while (true) {
     clock_t now = clock_now();
     if (now >= expire) {
-      if (retries > UINT64_MAX) {
-        panic("stuck in idle");
-        unreachable;
-      }
-
+      // kick the alarm thread in case a timer interrupt was missed
       alarm_reschedule();
       expire = now + MS_TO_NS(1000);
-      retries++;
     }
 
-    LOCK_SCHED(sched);
-    if (sched->ready_count > 0) {
-      retries = 0;
-      DPRINTF("sched: exiting idle [CPU#%d]\n", PERCPU_ID);
+    if (!sched_has_runnable(sched)) {
+      // try to take work from a busier cpu before going to sleep
+      sched_balance(sched);
+    }
 
-      UNLOCK_SCHED(sched);
+    if (sched_has_runnable(sched)) {
+      DPRINTF("sched: exiting idle [CPU#%d]\n", PERCPU_ID);
       sched_yield();
-      expire = now + MS_TO_NS(1000);
-    } else {
-      UNLOCK_SCHED(sched);
+      continue;
     }
 
-    cpu_pause();
-    cpu_pause();
-    cpu_pause();
+    if (zero_pool_idle_refill()) {
+      // check for ready threads between batches
+      continue;
+    }
+
+    sched_idle_wait(sched);
   }
   unreachable;
 }
@@ -356,12 +528,16 @@ noreturn void sched_init() {
   spin_init(&sched->lock);
 
   sched->ready_count = 0;
+  sched->throttled = false;
   sched->blocked_count = 0;
   sched->total_count = PERCPU_IS_BSP ? 1 : 0;
   sched->idle_time = 0;
+  sched->last_balance = 0;
+  sched->slice_end = 0;
 
   sched->active = PERCPU_IS_BSP ? root->main : idle;
   sched->idle = idle;
+  sched->idle_polling = false;
 
   LIST_INIT(&sched->blocked);
 
@@ -375,11 +551,14 @@ noreturn void sched_init() {
   atomic_fetch_add(&_num_schedulers, 1);
 
   // register policies
+  register_policy(POLICY_DEADLINE, &sched_policy_deadline);
   register_policy(POLICY_SYSTEM, &sched_policy_fprr);
   register_policy(POLICY_DRIVER, &sched_policy_fprr);
+  register_policy(POLICY_FAIR, &sched_policy_fair);
 
   init_oneshot_timer();
   timer_enable(TIMER_ONE_SHOT);
+  apic_init_oneshot(timer_vectornum);
   if (PERCPU_IS_BSP) {
     // schedule the root main thread onto the primary core
     thread_t *root_main = root->main;
@@ -413,8 +592,8 @@ int sched_add(thread_t *thread) {
 
   uint64_t flags;
   temp_irq_save(flags);
-  LOCK_SCHED(sched);
   LOCK_THREAD(thread);
+  LOCK_SCHED(sched);
   LOCK_POLICY(sched, thread);
 
   thread->cpu_id = sched->cpu_id;
@@ -422,28 +601,24 @@ int sched_add(thread_t *thread) {
   SCHED_DISPATCH(sched, thread->policy, policy_init_thread, thread);
   sched->total_count++;
   sched_add_ready_thread(sched, thread);
+  bool start_timer = sched_needs_timer(sched);
 
   UNLOCK_POLICY(sched, thread);
-  UNLOCK_THREAD(thread);
   UNLOCK_SCHED(sched);
+  UNLOCK_THREAD(thread);
   temp_irq_restore(flags);
 
   if (sched_should_preempt(sched, thread)) {
-    if (thread->cpu_id == PERCPU_ID) {
-      // reschedule current cpu
-      return sched_reschedule(SCHED_PREEMPTED);
-    }
-
-    DPRINTF("[CPU#%d] sched: sending ipi to CPU#%d\n", PERCPU_ID, thread->cpu_id);
-    return ipi_deliver_cpu_id(IPI_SCHEDULE, thread->cpu_id, SCHED_PREEMPTED);
+    return sched_preempt_cpu(sched);
+  } else if (start_timer) {
+    return sched_start_timer(sched);
   }
   return 0;
 }
 
 int sched_terminate(thread_t *thread) {
+LABEL(retry);
   sched_assert(thread->status != THREAD_TERMINATED);
-  sched_t *sched = SCHEDULER(thread->cpu_id);
-
   if (thread->status == THREAD_RUNNING) {
     if (thread->cpu_id == PERCPU_ID) {
       // reschedule current cpu and let the scheduler clean up on next pass
@@ -454,8 +629,16 @@ int sched_terminate(thread_t *thread) {
 
   uint64_t flags;
   temp_irq_save(flags);
-  LOCK_SCHED(sched);
   LOCK_THREAD(thread);
+  sched_t *sched = SCHEDULER(thread->cpu_id);
+  LOCK_SCHED(sched);
+  if (thread->status == THREAD_RUNNING) {
+    // the thread was picked to run in the meantime
+    UNLOCK_SCHED(sched);
+    UNLOCK_THREAD(thread);
+    temp_irq_restore(flags);
+    goto retry;
+  }
   LOCK_POLICY(sched, thread);
 
   if (thread->status == THREAD_READY) {
@@ -476,18 +659,18 @@ int sched_terminate(thread_t *thread) {
   SCHED_DISPATCH(sched, thread->policy, policy_deinit_thread, thread);
 
   UNLOCK_POLICY(sched, thread);
-  UNLOCK_THREAD(thread);
   UNLOCK_SCHED(sched);
+  UNLOCK_THREAD(thread);
   temp_irq_restore(flags);
   return 0;
 }
 
 int sched_block(thread_t *thread) {
-  sched_t *sched = SCHEDULER(thread->cpu_id);
+LABEL(retry);
   sched_assert(!IS_BLOCKED(thread));
 
   DPRINTF("[CPU#%d] sched: blocking thread %d.%d [%s] on CPU#%d\n",
-          PERCPU_ID, thread->process->pid, thread->tid, thread->name, sched->cpu_id);
+          PERCPU_ID, thread->process->pid, thread->tid, thread->name, thread->cpu_id);
   if (thread->status == THREAD_RUNNING) {
     if (thread->cpu_id == PERCPU_ID) {
       // reschedule current cpu
@@ -500,8 +683,24 @@ int sched_block(thread_t *thread) {
 
   uint64_t flags;
   temp_irq_save(flags);
-  LOCK_SCHED(sched);
   LOCK_THREAD(thread);
+  sched_t *sched = SCHEDULER(thread->cpu_id);
+  LOCK_SCHED(sched);
+  if (thread->status == THREAD_RUNNING) {
+    // the thread was picked to run in the meantime
+    UNLOCK_SCHED(sched);
+    UNLOCK_THREAD(thread);
+    temp_irq_restore(flags);
+    goto retry;
+  }
+  if (thread->wake_pending) {
+    // the thread was unblocked before it got to block
+    thread->wake_pending = false;
+    UNLOCK_SCHED(sched);
+    UNLOCK_THREAD(thread);
+    temp_irq_restore(flags);
+    return 0;
+  }
   LOCK_POLICY(sched, thread);
 
   sched_assert(thread->status == THREAD_READY);
@@ -510,81 +709,79 @@ int sched_block(thread_t *thread) {
   sched_add_blocked_thread(sched, thread);
 
   UNLOCK_POLICY(sched, thread);
-  UNLOCK_THREAD(thread);
   UNLOCK_SCHED(sched);
+  UNLOCK_THREAD(thread);
   temp_irq_restore(flags);
   return 0;
 }
 
-int sched_unblock(thread_t *thread) {
-  sched_t *sched = SCHEDULER(thread->cpu_id);
-  if (!IS_BLOCKED(thread)) {
-    panic("thread %d.%d not blocked [%s]", thread->tid, thread->process->pid, thread->name);
-  }
+static int sched_ready_blocked_thread(thread_t *thread, uint64_t flags) {
+  // places a blocked or sleeping thread on the ready queue of the best cpu for
+  // it and preempts the active thread there if needed. it is called with the
+  // thread lock held so that a thread which is still blocking on another cpu
+  // is fully added to its blocked list before it is removed again.
+  sched_t *old_sched = SCHEDULER(thread->cpu_id);
+  sched_t *sched = sched_find_cpu_for_thread(thread);
 
-  DPRINTF("[CPU#%d] sched: unblocking thread %d.%d [%s] on CPU#%d\n",
-          PERCPU_ID, thread->process->pid, thread->tid, thread->name, sched->cpu_id);
+  LOCK_SCHED(old_sched);
+  sched_remove_blocked_thread(old_sched, thread);
+  if (sched != old_sched) {
+    LOCK_POLICY(old_sched, thread);
+    old_sched->total_count--;
+    thread->cpu_id = sched->cpu_id;
+    SCHED_DISPATCH(old_sched, thread->policy, on_thread_migrate_cpu, thread, sched->cpu_id);
+    UNLOCK_POLICY(old_sched, thread);
+  }
+  UNLOCK_SCHED(old_sched);
 
-  uint64_t flags;
-  temp_irq_save(flags);
   LOCK_SCHED(sched);
-  LOCK_THREAD(thread);
   LOCK_POLICY(sched, thread);
-
-  sched_remove_blocked_thread(sched, thread);
+  if (sched != old_sched) {
+    sched->total_count++;
+  }
   thread->status = THREAD_READY;
   sched_add_ready_thread(sched, thread);
-
+  bool start_timer = sched_needs_timer(sched);
   UNLOCK_POLICY(sched, thread);
-  UNLOCK_THREAD(thread);
   UNLOCK_SCHED(sched);
+  UNLOCK_THREAD(thread);
   temp_irq_restore(flags);
 
   if (sched_should_preempt(sched, thread)) {
-    if (thread->cpu_id == PERCPU_ID) {
-      // reschedule current cpu
-      return sched_reschedule(SCHED_PREEMPTED);
-    }
-
-    DPRINTF("[CPU#%d] sched: sending ipi to CPU#%d\n", PERCPU_ID, thread->cpu_id);
-    return ipi_deliver_cpu_id(IPI_SCHEDULE, thread->cpu_id, SCHED_PREEMPTED);
+    return sched_preempt_cpu(sched);
+  } else if (start_timer) {
+    return sched_start_timer(sched);
   }
   return 0;
 }
 
-int sched_wakeup(thread_t *thread) {
-  sched_t *sched = SCHEDULER(thread->cpu_id);
-  sched_assert(thread->status == THREAD_SLEEPING);
+int sched_unblock(thread_t *thread) {
+  uint64_t flags;
+  temp_irq_save(flags);
+  LOCK_THREAD(thread);
+  if (!IS_BLOCKED(thread)) {
+    // the thread is queued on a wait queue but has not blocked yet. the flag
+    // makes its next sched_block return straight away instead.
+    thread->wake_pending = true;
+    UNLOCK_THREAD(thread);
+    temp_irq_restore(flags);
+    return 0;
+  }
 
-  DPRINTF("[CPU#%d] sched: waking up thread %d.%d [%s] on CPU#%d\n",
+  DPRINTF("[CPU#%d] sched: unblocking thread %d.%d [%s] on CPU#%d\n",
           PERCPU_ID, thread->process->pid, thread->tid, thread->name, thread->cpu_id);
+  return sched_ready_blocked_thread(thread, flags);
+}
 
+int sched_wakeup(thread_t *thread) {
   uint64_t flags;
   temp_irq_save(flags);
-  LOCK_SCHED(sched);
   LOCK_THREAD(thread);
-  LOCK_POLICY(sched, thread);
-
-  sched_remove_blocked_thread(sched, thread);
-  thread->status = THREAD_READY;
-  sched_add_ready_thread(sched, thread);
-
-  UNLOCK_POLICY(sched, thread);
-  UNLOCK_THREAD(thread);
-  UNLOCK_SCHED(sched);
-  temp_irq_restore(flags);
-
-  if (sched_should_preempt(sched, thread)) {
-    if (thread->cpu_id == PERCPU_ID) {
-      // reschedule current cpu
-      return sched_reschedule(SCHED_PREEMPTED);
-    }
-    // rescheduler another cpu
+  sched_assert(thread->status == THREAD_SLEEPING);
 
-    DPRINTF("[CPU#%d] sched: sending ipi to CPU#%d\n", PERCPU_ID, thread->cpu_id);
-    return ipi_deliver_cpu_id(IPI_SCHEDULE, thread->cpu_id, SCHED_PREEMPTED);
-  }
-  return 0;
+  DPRINTF("[CPU#%d] sched: waking up thread %d.%d [%s] on CPU#%d\n",
+          PERCPU_ID, thread->process->pid, thread->tid, thread->name, thread->cpu_id);
+  return sched_ready_blocked_thread(thread, flags);
 }
 
 int sched_setsched(sched_opts_t opts) {
@@ -593,14 +790,30 @@ int sched_setsched(sched_opts_t opts) {
 
   uint64_t flags;
   temp_irq_save(flags);
-  LOCK_SCHED(sched);
   LOCK_THREAD(thread);
+  LOCK_SCHED(sched);
   LOCK_POLICY(sched, thread);
 
   if (opts.policy != thread->policy) {
+    if (POLICY_FUNC(opts.policy, policy_admit_thread) != NULL) {
+      int result = POLICY_FUNC(opts.policy, policy_admit_thread)(thread, &opts);
+      if (result < 0) {
+        UNLOCK_POLICY(sched, thread);
+        UNLOCK_SCHED(sched);
+        UNLOCK_THREAD(thread);
+        temp_irq_restore(flags);
+        return result;
+      }
+    }
+
     SCHED_DISPATCH(sched, thread->policy, policy_deinit_thread, thread);
+    UNLOCK_POLICY(sched, thread);
     thread->policy = opts.policy;
+    LOCK_POLICY(sched, thread);
     SCHED_DISPATCH(sched, thread->policy, policy_init_thread, thread);
+    if (POLICY_FUNC(thread->policy, policy_setup_thread) != NULL) {
+      POLICY_FUNC(thread->policy, policy_setup_thread)(thread, &opts);
+    }
   }
   if (opts.priority != thread->priority) {
     thread->priority = opts.priority;
@@ -612,16 +825,16 @@ int sched_setsched(sched_opts_t opts) {
     thread->affinity = opts.affinity;
     if (opts.affinity >= 0 && opts.affinity != PERCPU_ID) {
       UNLOCK_POLICY(sched, thread);
-      UNLOCK_THREAD(thread);
       UNLOCK_SCHED(sched);
+      UNLOCK_THREAD(thread);
       temp_irq_restore(flags);
       return sched_reschedule(SCHED_UPDATED);
     }
   }
 
   UNLOCK_POLICY(sched, thread);
-  UNLOCK_THREAD(thread);
   UNLOCK_SCHED(sched);
+  UNLOCK_THREAD(thread);
   temp_irq_restore(flags);
   return 0;
 }
@@ -653,6 +866,21 @@ int sched_yield() {
 
 //
 
+static void sched_run_unlocked_hooks(sched_t *sched, thread_t *curr) {
+  // policies put off work such as arming alarms, which allocates and can wake
+  // up other threads, until the scheduler is unlocked. the current thread is
+  // not switched out yet so preemption is held off by hand while they run.
+  if (curr == NULL) {
+    return;
+  }
+
+  curr->preempt_count++;
+  foreach_policy(policy) {
+    SCHED_DISPATCH(sched, policy, on_reschedule_unlocked);
+  }
+  curr->preempt_count--;
+}
+
 int sched_reschedule(sched_cause_t reason) {
   DPRINTF("[CPU#%d] sched: rescheduling [%s]\n", PERCPU_ID, sched_reason_str[reason]);
 
@@ -671,14 +899,31 @@ int sched_reschedule(sched_cause_t reason) {
   // --------------
 
   sched_assert(curr->cpu_id == sched->cpu_id);
-  if (reason == SCHED_PREEMPTED && curr->preempt_count > 0) {
-    curr->preempt_count--;
-    goto end;
-  } else if (reason == SCHED_PREEMPTED && sched->ready_count == 0) {
-    goto end;
+  if (curr != sched->idle && clock_now() - sched->last_balance >= SCHED_BALANCE_INTERVAL) {
+    // there is no periodic tick so balance whenever the cpu reschedules
+    sched_balance(sched);
+  }
+
+  if (reason == SCHED_PREEMPTED && (curr->preempt_count > 0 || !sched_slice_has_end(sched, curr))) {
+    goto keep_running;
   }
 
+  // a thread can not block, sleep or yield with preemption disabled. requests
+  // from other cpus are deferred by sched_reschedule_remote instead.
+  thread_assert(curr, curr->preempt_count == 0);
+  // this reschedule replaces any deferred one
+  curr->resched_pending = 0;
+
+  // the extended state saved by kernel_fpu_begin would be overwritten
+  thread_assert(curr, !(curr->flags & F_THREAD_KERNEL_FPU));
+
   LOCK_THREAD(curr);
+  if (reason == SCHED_BLOCKED && curr->wake_pending) {
+    // the thread was unblocked before it got to block
+    curr->wake_pending = false;
+    UNLOCK_THREAD(curr);
+    goto keep_running;
+  }
   sched_update_thread_time_end(sched, curr);
   curr->status = get_thread_status(reason);
   sched_update_thread_stats(sched, curr, reason);
@@ -688,7 +933,7 @@ int sched_reschedule(sched_cause_t reason) {
     if (curr->affinity >= 0 && curr->affinity != PERCPU_ID) {
       sched_assert(curr->affinity < _num_schedulers);
       sched_t *new_sched = SCHEDULER(curr->affinity);
-      sched_migrate_thread(sched, new_sched, curr);
+      sched_migrate_thread(sched, new_sched, curr, false);
       LOCK_SCHED(sched);
       goto next_thread;
     }
@@ -700,7 +945,6 @@ int sched_reschedule(sched_cause_t reason) {
 
   if (curr == sched->idle) {
     curr->status = THREAD_READY;
-    sched->idle_time += curr->stats->last_active - curr->stats->last_scheduled;
   } else if (IS_BLOCKED(curr)) {
     sched_add_blocked_thread(sched, curr);
   } else if (curr->status == THREAD_TERMINATED) {
@@ -718,9 +962,10 @@ LABEL(next_thread);
   UNLOCK_THREAD(curr);
 
 LABEL(next_thread_first);
+  // a thread on the ready queue is owned by the scheduler lock so the next
+  // thread is not locked itself. paths which hold the thread lock check that
+  // the thread was not picked once they have the scheduler lock.
   thread_t *next = sched_get_next_thread(sched);
-
-  LOCK_THREAD(next);
   if (next != sched->idle)
     LOCK_POLICY(sched, next);
 
@@ -730,10 +975,17 @@ LABEL(next_thread_first);
 
   if (next != sched->idle)
     UNLOCK_POLICY(sched, next);
-  UNLOCK_THREAD(next);
+  sched_arm_timer(sched);
   UNLOCK_SCHED(sched);
+  sched_run_unlocked_hooks(sched, curr);
 
   if (next != curr) {
+    // the thread may still be switching out on the cpu it last ran on
+    while (next->on_cpu) {
+      cpu_pause();
+    }
+    next->on_cpu = 1;
+
     if (curr != NULL) {
       DPRINTF("[CPU#%d] sched: switching from thread %d.%d [%s] to %d.%d [%s]\n",
               PERCPU_ID,
@@ -741,12 +993,23 @@ LABEL(next_thread_first);
               next->process->pid, next->tid, next->name);
     }
 
-    temp_irq_restore(flags);
+    // interrupts stay disabled until this thread is switched back in. a
+    // new thread starts with the rflags from its initial context instead.
     thread_switch(next);
+    temp_irq_restore(flags);
     DPRINTF("[CPU#%d] sched: now in thread %d.%d [%s]\n",
             PERCPU_ID, PERCPU_THREAD->process->pid, PERCPU_THREAD->tid, PERCPU_THREAD->name);
     return 0;
   }
+  goto end;
+
+LABEL(keep_running);
+  // preemption is disabled, there is nothing else to run or a pending wakeup
+  // cancelled the block. the timer is armed again so a thread with preemption
+  // disabled is retried shortly after.
+  LOCK_SCHED(sched);
+  sched_arm_timer(sched);
+  UNLOCK_SCHED(sched);
 
 LABEL(end);
   temp_irq_restore(flags);
@@ -754,3 +1017,76 @@ LABEL(end);
           PERCPU_ID, PERCPU_THREAD->process->pid, PERCPU_THREAD->tid, PERCPU_THREAD->name);
   return 0;
 }
+
+int sched_reschedule_remote(sched_cause_t reason) {
+  // handles a reschedule requested by another cpu. it can arrive while the
+  // thread is inside a noirq spinlock or another section which expects to
+  // stay on this cpu, so it is deferred until preemption is enabled again.
+  thread_t *curr = PERCPU_THREAD;
+  if (curr != NULL && curr->preempt_count > 0 && reason != SCHED_PREEMPTED) {
+    // a termination is never overridden
+    if (curr->resched_pending != SCHED_TERMINATED + 1) {
+      curr->resched_pending = reason + 1;
+    }
+    return 0;
+  }
+  return sched_reschedule(reason);
+}
+
+int sched_reschedule_pending() {
+  // runs a reschedule which was deferred while preemption was disabled
+  uint64_t flags;
+  temp_irq_save(flags);
+  thread_t *curr = PERCPU_THREAD;
+  int res = 0;
+  if (curr->preempt_count == 0 && curr->resched_pending) {
+    // an interrupt may have already rescheduled and cleared it
+    res = sched_reschedule((sched_cause_t)(curr->resched_pending - 1));
+  }
+  temp_irq_restore(flags);
+  return res;
+}
+
+//
+
+void sched_timer_handler() {
+  // the local apic timer fired for the end of the active time slice
+  sched_t *sched = PERCPU_SCHED;
+  if (sched == NULL || sched->slice_end == 0) {
+    // the timer was stopped after it had already fired
+    return;
+  }
+
+  clock_t now = clock_now();
+  if (now + SCHED_MIN_TIMESLICE < sched->slice_end) {
+    // the apic clock drifts from the system clock
+    apic_oneshot_ns(sched->slice_end - now);
+    return;
+  }
+
+  sched->slice_end = 0;
+  sched_reschedule(SCHED_PREEMPTED);
+}
+
+void sched_timer_update() {
+  // arms the timer for the active thread on the current cpu
+  sched_t *sched = PERCPU_SCHED;
+  uint64_t flags;
+  temp_irq_save(flags);
+  LOCK_SCHED(sched);
+  sched_arm_timer(sched);
+  UNLOCK_SCHED(sched);
+  temp_irq_restore(flags);
+}
+
+//
+
+void sched_dump_stats() {
+  foreach_sched(sched) {
+    thread_t *active = sched->active;
+    kprintf("  CPU#%d: %zu ready, %zu blocked, %zu total, active %s\n",
+            sched->cpu_id, sched->ready_count, sched->blocked_count, sched->total_count,
+            active ? active->name : "none");
+    kprintf("    idle for %llu ms\n", sched->idle_time / MS_TO_NS(1));
+  }
+}
@@ -5,53 +5,233 @@
 #include <spinlock.h>
 #include <panic.h>
 #include <thread.h>
+#include <ipi.h>
 
 #include <cpu/cpu.h>
 
 #include <atomic.h>
 
+// Queued Spinlocks
 //
+// A lock is a pointer to the tail of a queue of waiting cpus. Locking swaps
+// the cpu's own node in as the new tail and, if there was a previous tail,
+// links up behind it and spins on a flag in its own node until the previous
+// owner clears it on unlock. The lock is handed over in the order it was
+// requested and every waiter spins on a separate cache line.
+//
+// Each cpu has a small pool of nodes since a node is in use for as long as
+// the lock is held and a cpu can hold several locks at once. The irq saving
+// variants keep a per-cpu count of the locks held so interrupts are only
+// restored once the last one is released, regardless of the unlock order.
+//
+// Ownership is tracked by cpu. That only identifies the holder while nothing
+// else can run on the cpu, which holds for the irq saving variants, so only
+// those are re-entrant. The noirq variants leave interrupts enabled and are
+// never re-entered since an interrupt handler on the same cpu would look like
+// the owner. With SPINLOCK_DEBUG they panic instead of deadlocking on a nested
+// lock.
 
-void spin_init(spinlock_t *lock) {
-  lock->locked = 0;
-  lock->locked_by = 0;
-  lock->lock_count = 0;
+#define SPIN_MAX_NODES 16
+#define SPIN_DEBUG_TIMEOUT 100000000
+
+typedef struct spin_node {
+  struct spin_node *volatile next; // next waiter in the queue
+  volatile uint32_t waiting;       // cleared when the lock is handed over
+} __aligned(64) spin_node_t;
+
+typedef struct spin_node_pool {
+  spin_node_t nodes[SPIN_MAX_NODES];
+  uint32_t used; // bitmap of nodes in use
+} __aligned(64) spin_node_pool_t;
+
+static spin_node_pool_t spin_node_pools[MAX_CPUS];
+
+static spin_node_t *spin_alloc_node() {
+  uint64_t flags;
+  temp_irq_save(flags);
+  spin_node_pool_t *pool = &spin_node_pools[PERCPU_ID];
+  if (pool->used == (1U << SPIN_MAX_NODES) - 1) {
+    panic("spinlock: too many locks held [CPU#%d]", PERCPU_ID);
+  }
+
+  int index = __builtin_ctz(~pool->used);
+  pool->used |= 1U << index;
+  temp_irq_restore(flags);
+
+  spin_node_t *node = &pool->nodes[index];
+  node->next = NULL;
+  node->waiting = 1;
+  return node;
 }
 
-int spin_lock(spinlock_t *lock) {
-  if (lock == NULL) {
-    return -1;
+static void spin_free_node(spin_node_t *node) {
+  uint64_t flags;
+  temp_irq_save(flags);
+  spin_node_pool_t *pool = &spin_node_pools[PERCPU_ID];
+  int index = (int)(node - pool->nodes);
+  kassert(index >= 0 && index < SPIN_MAX_NODES);
+  pool->used &= ~(1U << index);
+  temp_irq_restore(flags);
+}
+
+static inline void spin_irq_save() {
+  uint64_t rflags = cpu_save_clear_interrupts();
+  uint32_t depth = __percpu_get_spin_depth();
+  if (depth == 0) {
+    PERCPU_SET_RFLAGS(rflags);
+  }
+  __percpu_set_spin_depth(depth + 1);
+}
+
+static inline void spin_irq_restore() {
+  uint32_t depth = __percpu_get_spin_depth();
+  kassert(depth > 0);
+  __percpu_set_spin_depth(depth - 1);
+  if (depth == 1) {
+    cpu_restore_interrupts(PERCPU_RFLAGS);
   }
+}
+
+static inline void spin_preempt_disable() {
+  if (PERCPU_THREAD != NULL) {
+    preempt_disable();
+  }
+}
 
-  uint64_t id = PERCPU_ID;
-  uint64_t rflags = cpu_save_clear_interrupts(); // disable interrupts
-  if (atomic_lock_test_and_set(&lock->locked)) {
-    // lock is currently held
-    if (lock->locked_by == id) {
-      // held by us so it's re-entrant
-      lock->lock_count++;
-      return 0;
+static inline void spin_preempt_enable() {
+  if (PERCPU_THREAD != NULL) {
+    preempt_enable();
+  }
+}
+
+//
+
+static void spin_wait(spinlock_t *lock, spin_node_t *node) {
+#ifdef SPINLOCK_DEBUG
+  uint64_t timeout = SPIN_DEBUG_TIMEOUT;
+#endif
+  while (node->waiting) {
+    // the owner may be waiting on a shootdown from this cpu
+    ipi_poll_invlpg();
+    cpu_pause();
+#ifdef SPINLOCK_DEBUG
+    if (--timeout == 0) {
+      panic("stuck waiting for spinlock %p [held by CPU#%d, lock_count = %d, locked at %p]",
+            lock, (int) lock->owner - 1, lock->lock_count, lock->locked_at);
     }
+#endif
+  }
+}
 
-    // wait for spinlock (wow this is bad!!! but it works)
-    register uint64_t timeout asm ("r15") = 10000000 + (PERCPU_ID * 1000000);
-
-    cpu_enable_interrupts(); // enable interrupts
-    while (atomic_lock_test_and_set(&lock->locked)) {
-      cpu_pause(); // spin
-      timeout--;
-      if (timeout == 0) {
-        panic("stuck waiting for spinlock %p [locked = %d, held by %u, lock_count = %d]",
-              lock, lock->locked, lock->locked_by, lock->lock_count);
-      }
+static inline bool spin_lock_reentrant(spinlock_t *lock, bool reentrant) {
+  // only this cpu could have stored its own id so this is safe without the lock
+  if (!reentrant) {
+#ifdef SPINLOCK_DEBUG
+    if (lock->owner == PERCPU_ID + 1) {
+      // preemption is disabled so the holder can only be the caller
+      panic("spin_lock_noirq() on lock that is already held [%p]", lock);
     }
-    cpu_disable_interrupts(); // re-disable interrupts
+#endif
+    return false;
+  }
+
+  if (lock->owner == PERCPU_ID + 1) {
+    lock->lock_count++;
+    return true;
   }
+  return false;
+}
 
-  // interrupts are disabled while the lock is held
-  lock->locked_by = id;
+static inline void spin_lock_acquired(spinlock_t *lock, spin_node_t *node, uintptr_t caller) {
+  lock->node = node;
+  lock->owner = PERCPU_ID + 1;
   lock->lock_count = 1;
-  PERCPU_SET_RFLAGS(rflags);
+#ifdef SPINLOCK_DEBUG
+  lock->locked_at = caller;
+#endif
+}
+
+static void spin_lock_internal(spinlock_t *lock, bool reentrant, uintptr_t caller) {
+  if (spin_lock_reentrant(lock, reentrant)) {
+    return;
+  }
+
+  spin_node_t *node = spin_alloc_node();
+  spin_node_t *prev = atomic_xchg(&lock->tail, node);
+  if (prev != NULL) {
+    // queue up behind the previous tail
+    prev->next = node;
+    spin_wait(lock, node);
+  }
+  spin_lock_acquired(lock, node, caller);
+}
+
+static bool spin_trylock_internal(spinlock_t *lock, bool reentrant, uintptr_t caller) {
+  if (spin_lock_reentrant(lock, reentrant)) {
+    return true;
+  }
+
+  spin_node_t *node = spin_alloc_node();
+  if (!atomic_cas(&lock->tail, NULL, node)) {
+    spin_free_node(node);
+    return false;
+  }
+  spin_lock_acquired(lock, node, caller);
+  return true;
+}
+
+static void spin_unlock_internal(spinlock_t *lock) {
+  if (lock->owner != PERCPU_ID + 1) {
+    panic("spin_unlock() on lock that is not held [%p]", lock);
+  }
+
+  if (lock->lock_count > 1) {
+    // re-entrant unlock
+    lock->lock_count--;
+    return;
+  }
+
+  spin_node_t *node = lock->node;
+  lock->node = NULL;
+  lock->owner = 0;
+  lock->lock_count = 0;
+  if (node->next == NULL) {
+    if (atomic_cas(&lock->tail, node, NULL)) {
+      // no one was waiting
+      spin_free_node(node);
+      return;
+    }
+
+    // a waiter swapped itself in but has not linked up yet
+    while (node->next == NULL) {
+      cpu_pause();
+    }
+  }
+
+  // hand the lock over (this is a full barrier)
+  atomic_xchg(&node->next->waiting, 0);
+  spin_free_node(node);
+}
+
+//
+
+void spin_init(spinlock_t *lock) {
+  lock->tail = NULL;
+  lock->node = NULL;
+  lock->owner = 0;
+  lock->lock_count = 0;
+#ifdef SPINLOCK_DEBUG
+  lock->locked_at = 0;
+#endif
+}
+
+int spin_lock(spinlock_t *lock) {
+  if (lock == NULL) {
+    return -1;
+  }
+
+  spin_irq_save();
+  spin_lock_internal(lock, true, (uintptr_t) __builtin_return_address(0));
   return 0;
 }
 
@@ -60,25 +240,11 @@ int spin_trylock(spinlock_t *lock) {
     return 0;
   }
 
-  uint64_t id = PERCPU_ID;
-  uint64_t rflags = cpu_save_clear_interrupts(); // disable interrupts
-  if (atomic_lock_test_and_set(&lock->locked)) {
-    // lock is currently held
-    if (lock->locked_by == id) {
-      // held by us so it's re-entrant
-      lock->lock_count++;
-      return 1;
-    }
-
-    // the lock is already claimed
-    cpu_restore_interrupts(rflags); // restore interrupts
+  spin_irq_save();
+  if (!spin_trylock_internal(lock, true, (uintptr_t) __builtin_return_address(0))) {
+    spin_irq_restore();
     return 0;
   }
-
-  // interrupts are disabled while the lock is held
-  PERCPU_SET_RFLAGS(rflags);
-  lock->locked_by = id;
-  lock->lock_count = 1;
   return 1;
 }
 
@@ -87,30 +253,48 @@ int spin_unlock(spinlock_t *lock) {
     return -1;
   }
 
-  uint64_t id = PERCPU_ID;
-  if (atomic_lock_test_and_set(&lock->locked)) {
-    kassert(lock->locked_by == id);
-    if (lock->lock_count == 1) {
-      // only clear when last re-entrant lock is released
-      atomic_lock_test_and_reset(&lock->locked);
-      lock->lock_count = 0;
-      cpu_restore_interrupts(PERCPU_RFLAGS); // restore interrupts
-      return 0;
-    }
+  spin_unlock_internal(lock);
+  spin_irq_restore();
+  return 0;
+}
 
-    // re-entrant unlock
-    lock->lock_count--;
+int spin_lock_noirq(spinlock_t *lock) {
+  if (lock == NULL) {
+    return -1;
+  }
+
+  spin_preempt_disable();
+  spin_lock_internal(lock, false, (uintptr_t) __builtin_return_address(0));
+  return 0;
+}
+
+int spin_trylock_noirq(spinlock_t *lock) {
+  if (lock == NULL) {
     return 0;
   }
 
-  // lock was not held by anyone
-  panic("spin_unlock() on lock that is not held [%p]", lock);
+  spin_preempt_disable();
+  if (!spin_trylock_internal(lock, false, (uintptr_t) __builtin_return_address(0))) {
+    spin_preempt_enable();
+    return 0;
+  }
+  return 1;
 }
 
-int spin_getowner(spinlock_t *lock) {
+int spin_unlock_noirq(spinlock_t *lock) {
   if (lock == NULL) {
     return -1;
   }
 
-  return (int)lock->locked_by;
+  spin_unlock_internal(lock);
+  spin_preempt_enable();
+  return 0;
+}
+
+int spin_getowner(spinlock_t *lock) {
+  if (lock == NULL || lock->owner == 0) {
+    return -1;
+  }
+
+  return (int) lock->owner - 1;
 }
@@ -12,11 +12,13 @@
 %define PERCPU_KERNEL_SP 0x20
 %define PERCPU_USER_SP   0x28
 %define PERCPU_RFLAGS    0x30
+%define PERCPU_PREV_THREAD 0x68
 
 %define CURRENT_THREAD  gs:PERCPU_THREAD
 %define CURRENT_PROCESS gs:PERCPU_PROCESS
 %define KERNEL_SP       gs:PERCPU_KERNEL_SP
 %define USER_SP         gs:PERCPU_USER_SP
+%define PREV_THREAD     gs:PERCPU_PREV_THREAD
 
 ; process offsets
 %define PROCESS_PID      0x00
@@ -25,15 +27,14 @@
 
 ; thread offsets
 %define THREAD_ID        0x00
+%define THREAD_ON_CPU    0x04
 %define THREAD_CTX       0x08
 %define THREAD_META_CTX  0x10
 %define THREAD_PROCESS   0x18
 %define THREAD_TLS_BLCK  0x20
 %define THREAD_KERNEL_SP 0x28
 %define THREAD_USER_SP   0x30
-
-; tls offsets
-%define TLS_BASE_ADDR    0x00
+%define THREAD_FPU       0x38
 
 ; thread context offsets
 %define CTX_RAX    0x00
@@ -53,7 +54,9 @@
 extern swap_address_space
 
 extern thread_entry
-extern cpu_write_fsbase
+extern thread_switch_tls
+extern fpu_save
+extern fpu_restore
 
 
 global thread_entry_stub
@@ -68,13 +71,16 @@ thread_entry_stub:
 
 ; perform a thread context switch
 ; void thread_switch(thread_t *thread)
+;   interrupts stay disabled for the whole switch. an interrupt which
+;   reschedules halfway through would save over the half-switched state,
+;   so the incoming context restores its own rflags with iretq.
 global thread_switch
 thread_switch:
   ; rdi = next thread
   ; rsi = next process
   ; rdx = current thread
   ; rcx = current process
-  ;  cli
+  cli
   mov rsi, [rdi + THREAD_PROCESS]
   mov rdx, CURRENT_THREAD
   mov rcx, CURRENT_PROCESS
@@ -110,21 +116,30 @@ thread_switch:
   pop qword [rdx + CTX_RIP]    ; rip
   mov [rdx + CTX_RSP], rsp     ; rsp
 
+  ; save extended state
+  push rdi
+  push rsi
+  push rcx
+  mov rdi, CURRENT_THREAD
+  mov rdi, [rdi + THREAD_FPU]
+  call fpu_save
+  pop rcx
+  pop rsi
+  pop rdi
+
 .switch_thread: ; update thread
+  mov rax, CURRENT_THREAD
+  mov PREV_THREAD, rax
   mov CURRENT_THREAD, rdi
 
-  ; avoid msr access if thread doesnt use tls
-  mov rax, [rdi + THREAD_TLS_BLCK]
-  mov rax, [rax + TLS_BASE_ADDR]
-  cmp rax, NULL
-  je .switch_process
-
   ; update thread local storage pointer
   push rdi
   push rsi
-  ; write tls base address
+  push rcx
+  mov rsi, rdi
   mov rdi, rax
-  call cpu_write_fsbase
+  call thread_switch_tls
+  pop rcx
   pop rsi
   pop rdi
 
@@ -132,7 +147,7 @@ thread_switch:
   ; if we're switching to a thread from the same process
   ; we dont have to update anything process related
   cmp rcx, rsi
-  je .restore_ctx
+  je .restore_fpu
 
   ; update current process
   mov CURRENT_PROCESS, rsi
@@ -144,6 +159,13 @@ thread_switch:
   call swap_address_space
   pop rdi
 
+.restore_fpu:
+  ; restore extended state
+  push rdi
+  mov rdi, [rdi + THREAD_FPU]
+  call fpu_restore
+  pop rdi
+
 .restore_ctx:
   ; restore new context
   push rax
@@ -152,6 +174,16 @@ thread_switch:
   mov rax, [rdi + THREAD_USER_SP]
   mov USER_SP, rax
   pop rax
+
+  ; release the previous thread once we are done with its stack so
+  ; that it can be resumed by another cpu
+  mov rsi, PREV_THREAD
+  cmp rsi, NULL
+  je .load_ctx
+  mov qword PREV_THREAD, NULL
+  mov dword [rsi + THREAD_ON_CPU], 0
+
+.load_ctx:
   mov rsp, [rdi + THREAD_CTX]
 
   pop rax
@@ -162,7 +194,6 @@ thread_switch:
   pop r14
   pop r15
 
-  sti
   iretq
 
 ; fast path to return to current thread
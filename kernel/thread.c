@@ -15,6 +15,8 @@
 #include <signal.h>
 #include <atomic.h>
 
+#include <cpu/cpu.h>
+#include <cpu/fpu.h>
 #include <debug/debug.h>
 
 // #define THREAD_DEBUG
@@ -26,6 +28,12 @@
 
 
 extern void thread_entry_stub();
+static kmem_cache_t *thread_cache;
+
+static void thread_static_init() {
+  thread_cache = kmem_cache_create("thread", sizeof(thread_t), 0);
+}
+STATIC_INIT(thread_static_init);
 
 static inline const char *get_status_str(thread_status_t status) {
   switch (status) {
@@ -46,19 +54,26 @@ static inline const char *get_status_str(thread_status_t status) {
   }
 }
 
-static inline page_t *create_stack(uintptr_t *sp, bool user) {
+static inline page_t *create_kernel_stack(uintptr_t *sp) {
   kassert(sp != NULL);
-  size_t virt_size = user ? USER_VSTACK_SIZE : KERNEL_STACK_SIZE;
-  size_t phys_size = user ? USER_PSTACK_SIZE : KERNEL_STACK_SIZE;
-
-  page_t *stack_pages = _alloc_pages(SIZE_TO_PAGES(phys_size), (user ? PG_USER : 0) | PG_WRITE);
+  page_t *stack_pages = _alloc_pages(SIZE_TO_PAGES(KERNEL_STACK_SIZE), PG_WRITE);
   void *va = _vmap_pages(stack_pages);
 
-  uintptr_t rsp = (uintptr_t) va + virt_size;
+  uintptr_t rsp = (uintptr_t) va + KERNEL_STACK_SIZE;
   *sp = rsp;
   return stack_pages;
 }
 
+static inline vm_mapping_t *create_user_stack(uintptr_t *sp) {
+  kassert(sp != NULL);
+  // user stacks are demand paged so only the touched pages are backed
+  vm_mapping_t *stack_vm = _vmap_anon(USER_VSTACK_SIZE, PG_USER | PG_WRITE, "user stack");
+
+  uintptr_t rsp = stack_vm->address + stack_vm->size;
+  *sp = rsp;
+  return stack_vm;
+}
+
 //
 
 __used void *thread_entry(void *(start_routine)(void *), void *arg) {
@@ -67,21 +82,41 @@ __used void *thread_entry(void *(start_routine)(void *), void *arg) {
   return NULL;
 }
 
+__used void thread_switch_tls(thread_t *prev, thread_t *next) {
+  // called from thread_switch to load the tls base of the next thread
+  if (cpuid_query_bit(CPUID_BIT_FSGSBASE)) {
+    // userspace can move its tls base with wrfsbase so the current base is
+    // read back into the previous thread before it is replaced
+    uint64_t base = __rdfsbase();
+    if (prev != NULL) {
+      prev->tls->addr = base;
+    }
+    if (next->tls->addr != base) {
+      __wrfsbase(next->tls->addr);
+    }
+    return;
+  }
+
+  // avoid msr access if thread doesnt use tls
+  if (next->tls->addr != 0) {
+    cpu_write_fsbase(next->tls->addr);
+  }
+}
+
 //
 // Thread Allocation
 //
 
 thread_t *thread_alloc(id_t tid, void *(start_routine)(void *), void *arg, bool user) {
-  thread_t *thread = kmalloc(sizeof(thread_t));
-  memset(thread, 0, sizeof(thread_t));
+  thread_t *thread = kmem_cache_allocz(thread_cache);
 
   // create kernel stack
   uintptr_t kernel_sp = 0;
-  page_t *kernel_stack = create_stack(&kernel_sp, false);
+  page_t *kernel_stack = create_kernel_stack(&kernel_sp);
   uintptr_t user_sp = 0;
-  page_t *user_stack = NULL;
+  vm_mapping_t *user_stack = NULL;
   if (user) {
-    user_stack = create_stack(&user_sp, true);
+    user_stack = create_user_stack(&user_sp);
   }
 
   ((uint64_t *) kernel_sp)[-1] = (uintptr_t) start_routine;
@@ -117,9 +152,10 @@ thread_t *thread_alloc(id_t tid, void *(start_routine)(void *), void *arg, bool
   thread->flags = F_THREAD_CREATED;
   thread->kernel_sp = kernel_sp;
   thread->user_sp = user_sp;
+  thread->fpu = fpu_alloc_area();
   thread->status = THREAD_READY;
   thread->cpu_id = PERCPU_ID;
-  thread->policy = POLICY_SYSTEM;
+  thread->policy = user ? POLICY_FAIR : POLICY_SYSTEM;
   thread->stats = stats;
   thread->affinity = -1;
   thread->name = NULL;
@@ -135,36 +171,37 @@ thread_t *thread_alloc(id_t tid, void *(start_routine)(void *), void *arg, bool
 
 thread_t *thread_copy(thread_t *other) {
   char *name = other->name ? kasprintf("%s (copy)", other->name) : NULL;
-  bool user = other->user_stack != NULL;
-  thread_t *thread = thread_alloc(0, NULL, NULL, user);
+  thread_t *thread = thread_alloc(0, NULL, NULL, false);
   thread->name = name;
 
-  // copy the stacks
+  // copy the kernel stack. the user stack is shared copy-on-write through the
+  // forked address space and is set by the caller
   memcpy((void *) PAGE_VIRT_ADDR(thread->kernel_stack), (void *) PAGE_VIRT_ADDR(other->kernel_stack), KERNEL_STACK_SIZE);
-  if (user) {
-    memcpy((void *) PAGE_VIRT_ADDR(thread->user_stack), (void *) PAGE_VIRT_ADDR(other->user_stack), USER_PSTACK_SIZE);
-  }
-
   uintptr_t kernel_sp_rel = other->kernel_sp - PAGE_VIRT_ADDR(other->kernel_stack);
-  uintptr_t user_sp_rel;
-  if (user) {
-    user_sp_rel = other->user_sp - PAGE_VIRT_ADDR(other->user_stack);
-  }
 
   // copy the context
   memcpy(thread->ctx, other->ctx, sizeof(thread_ctx_t));
   // copy the meta context
   memcpy(thread->mctx, other->mctx, sizeof(thread_meta_ctx_t));
-  // copy the tls block
+  // copy the tls block (the base may have been changed from userspace)
+  if (other == PERCPU_THREAD) {
+    other->tls->addr = cpu_read_fsbase();
+  }
   memcpy(thread->tls, other->tls, sizeof(tls_block_t));
+  // copy the extended state (the live state if other is the current thread)
+  if (other == PERCPU_THREAD) {
+    fpu_save(other->fpu);
+  }
+  fpu_copy_area(thread->fpu, other->fpu);
 
   // copy the tls data (if needed)
   // to do
 
   thread->kernel_sp = PAGE_VIRT_ADDR(thread->kernel_stack) + kernel_sp_rel;
-  thread->user_sp = user ? PAGE_VIRT_ADDR(thread->user_stack) + user_sp_rel : 0;
+  thread->user_sp = other->user_sp;
   thread->cpu_id = PERCPU_ID;
-  thread->policy = other->policy;
+  // deadline reservations are not inherited
+  thread->policy = other->policy == POLICY_DEADLINE ? POLICY_SYSTEM : other->policy;
   thread->priority = other->priority;
   thread->status = other->status;
 
@@ -179,7 +216,7 @@ void thread_free(thread_t *thread) {
     vfree_pages(thread->kernel_stack);
   }
   if (thread->user_stack) {
-    vfree_pages(thread->user_stack);
+    _vunmap_addr(thread->user_stack->address, thread->user_stack->size);
   }
   if (thread->tls) {
     tls_block_t *tls = thread->tls;
@@ -191,7 +228,8 @@ void thread_free(thread_t *thread) {
 
   kfree(thread->name);
   kfree(thread->ctx);
-  kfree(thread);
+  fpu_free_area(thread->fpu);
+  kmem_cache_free(thread_cache, thread);
 }
 
 //
@@ -290,7 +328,7 @@ int thread_receive(thread_t *thread, void **data) {
 }
 
 void thread_sleep(uint64_t us) {
-  thread_trace_debug("thread %d process %d sleeping for %lf seconds", gettid(), getpid(), (double)(us) / 1e6);
+  thread_trace_debug("thread %d process %d sleeping for %llu us", gettid(), getpid(), us);
   sched_sleep(US_TO_NS(us));
   thread_trace_debug("thread %d process %d wakeup", gettid(), getpid());
 }
@@ -343,12 +381,27 @@ int thread_setsched(uint8_t policy, uint16_t priority) {
   return sched_setsched(opts);
 }
 
+int thread_setdeadline(clock_t period, clock_t budget) {
+  sched_opts_t opts = {
+    .policy = POLICY_DEADLINE,
+    .priority = PERCPU_THREAD->priority,
+    .affinity = PERCPU_THREAD->affinity,
+    .period = period,
+    .budget = budget,
+  };
+  return sched_setsched(opts);
+}
+
 void preempt_disable() {
   PERCPU_THREAD->preempt_count++;
 }
 
 void preempt_enable() {
-  PERCPU_THREAD->preempt_count--;
+  thread_t *thread = PERCPU_THREAD;
+  thread->preempt_count--;
+  if (thread->preempt_count == 0 && thread->resched_pending) {
+    sched_reschedule_pending();
+  }
 }
 
 //
@@ -358,8 +411,7 @@ int thread_alloc_stack(thread_t *thread, bool user) {
   kassert(thread->user_stack == NULL);
 
   uintptr_t user_sp = 0;
-  page_t *stack = create_stack(&user_sp, user);
-  thread->user_stack = stack;
+  thread->user_stack = create_user_stack(&user_sp);
   thread->user_sp = user_sp;
   return 0;
 }
@@ -22,6 +22,7 @@ typedef struct timer_alarm {
   clock_t expires;
   timer_cb_t callback;
   void *data;
+  rb_node_t *node; // node in alarm_expiry_tree
 } timer_alarm_t;
 
 // void scheduler_tick();
@@ -40,9 +41,8 @@ LIST_HEAD(timer_device_t) timer_devices;
 
 
 void timer_periodic_handler(timer_device_t *td) {
-  kprintf("---> tick <---\n");
-  // clock_update_ticks();
-  // panic("sched_tick not implemented");
+  // the scheduler has no periodic tick, threads are preempted by the
+  // local apic timer of each cpu instead
 }
 
 void timer_oneshot_handler(timer_device_t *td) {
@@ -65,6 +65,9 @@ noreturn void *alarm_event_loop(unused void *arg) {
   kassert(global_one_shot_timer != NULL);
   timer_device_t *timer = global_one_shot_timer;
   thread_setaffinity(cpu_bsp_id); // pin to CPU#0
+  if (thread_setdeadline(MS_TO_NS(1), US_TO_NS(100)) < 0) {
+    kprintf("timer: failed to reserve deadline bandwidth\n");
+  }
 
   kprintf("timer: starting alarm event loop\n");
   while (true) {
@@ -74,7 +77,9 @@ noreturn void *alarm_event_loop(unused void *arg) {
     }
 
   LABEL(dispatch);
+    spin_lock(&pending_alarm_lock);
     if (alarm_expiry_tree->nodes == 0) {
+      spin_unlock(&pending_alarm_lock);
       continue;
     }
 
@@ -86,11 +91,13 @@ noreturn void *alarm_event_loop(unused void *arg) {
       if (set_alarm_timer_value(timer, alarm->expires) < 0) {
         panic("failed to set alarm timer value");
       }
+      spin_unlock(&pending_alarm_lock);
       continue;
     }
 
-    rb_tree_delete_node(alarm_expiry_tree, alarm_expiry_tree->min);
-    rb_tree_delete(pending_alarm_tree, alarm->expires);
+    rb_tree_delete_node(alarm_expiry_tree, alarm->node);
+    rb_tree_delete(pending_alarm_tree, alarm->id);
+    spin_unlock(&pending_alarm_lock);
 
     preempt_enable();
     alarm->callback(alarm->data);
@@ -205,10 +212,14 @@ clockid_t timer_create_alarm(clock_t expires, timer_cb_t callback, void *data) {
   alarm->expires = expires;
   alarm->callback = callback;
   alarm->data = data;
+  // keep the node so that alarms with the same expiry can be told apart
+  alarm->node = kmalloc(sizeof(rb_node_t));
+  alarm->node->key = expires;
+  alarm->node->data = alarm;
 
   spin_lock(&pending_alarm_lock);
   rb_tree_insert(pending_alarm_tree, id, alarm);
-  rb_tree_insert(alarm_expiry_tree, expires, alarm);
+  rb_tree_insert_node(alarm_expiry_tree, alarm->node);
 
   // check if timer needs to be updated
   if (alarm == alarm_expiry_tree->min->data) {
@@ -232,12 +243,13 @@ clockid_t timer_create_alarm(clock_t expires, timer_cb_t callback, void *data) {
 void *timer_delete_alarm(clockid_t id) {
   spin_lock(&pending_alarm_lock);
   timer_alarm_t *alarm = rb_tree_delete(pending_alarm_tree, id);
-  rb_tree_delete(alarm_expiry_tree, alarm->expires);
-
-  spin_unlock(&pending_alarm_lock);
   if (alarm == NULL) {
+    // already fired
+    spin_unlock(&pending_alarm_lock);
     return NULL;
   }
+  rb_tree_delete_node(alarm_expiry_tree, alarm->node);
+  spin_unlock(&pending_alarm_lock);
 
   void *data = alarm->data;
   kfree(alarm);
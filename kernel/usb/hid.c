@@ -74,6 +74,9 @@ noreturn void *hid_device_event_loop(void *arg) {
   usb_device_t *device = arg;
   hid_device_t *hid_device = device->driver_data;
   kassert(hid_device != NULL);
+  if (thread_setdeadline(MS_TO_NS(8), US_TO_NS(500)) < 0) {
+    kprintf("hid: failed to reserve deadline bandwidth\n");
+  }
 
   usb_endpoint_t *endpoint = LIST_FIND(e, &device->endpoints, list, e->number != 0 && e->dir == USB_IN);
   kassert(endpoint != NULL);
@@ -273,6 +273,9 @@ int _xhci_handle_controller_event(xhci_controller_t *hc, xhci_trb_t trb) {
 noreturn void *_xhci_controller_event_loop(void *arg) {
   xhci_controller_t *hc = arg;
   kprintf("[CPU#%d] xhci: starting controller event loop\n", PERCPU_ID);
+  if (thread_setdeadline(MS_TO_NS(1), US_TO_NS(200)) < 0) {
+    kprintf("xhci: failed to reserve deadline bandwidth\n");
+  }
 
   while (true) {
     cond_wait(&hc->evt_ring->cond);
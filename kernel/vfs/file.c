@@ -5,6 +5,7 @@
 #include <vfs/file.h>
 #include <vfs/vnode.h>
 
+#include <mm.h>
 #include <panic.h>
 #include <printf.h>
 #include <bitmap.h>
@@ -22,18 +23,25 @@ typedef struct ftable {
 
 #define FTABLE_MAX_FILES 1024
 
-#define FTABLE_LOCK(ftable) SPIN_LOCK(&(ftable)->lock)
-#define FTABLE_UNLOCK(ftable) SPIN_UNLOCK(&(ftable)->lock)
+#define FTABLE_LOCK(ftable) SPIN_LOCK_NOIRQ(&(ftable)->lock)
+#define FTABLE_UNLOCK(ftable) SPIN_UNLOCK_NOIRQ(&(ftable)->lock)
+
+static kmem_cache_t *file_cache;
+
+static void file_static_init() {
+  file_cache = kmem_cache_create("file", sizeof(file_t), 0);
+}
+STATIC_INIT(file_static_init);
 
 static void f_cleanup(file_t *file) {
   vn_release(&file->vnode);
-  kfree(file);
+  kmem_cache_free(file_cache, file);
 }
 
 //
 
 file_t *f_alloc(int fd, int flags, vnode_t *vnode) __move {
-  file_t *file = kmallocz(sizeof(file_t));
+  file_t *file = kmem_cache_allocz(file_cache);
   file->fd = fd;
   file->flags = flags;
   file->type = vnode->type;
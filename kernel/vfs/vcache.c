@@ -35,8 +35,8 @@ struct vcache_dir {
   hash_t *children; // array of child (full path) hashes
 };
 
-#define VCACHE_LOCK(vcache) SPIN_LOCK(&(vcache)->lock)
-#define VCACHE_UNLOCK(vcache) SPIN_UNLOCK(&(vcache)->lock)
+#define VCACHE_LOCK(vcache) SPIN_LOCK_NOIRQ(&(vcache)->lock)
+#define VCACHE_UNLOCK(vcache) SPIN_UNLOCK_NOIRQ(&(vcache)->lock)
 
 #define ASSERT(x) kassert(x)
 #define DPRINTF(fmt, ...) kprintf("vcache: %s: " fmt, __func__, ##__VA_ARGS__)
@@ -55,9 +55,15 @@ static const char *vtype_to_str[] = {
   [V_SOCK] = "sock",
 };
 
+static kmem_cache_t *vcache_entry_cache;
+
+static void vcache_static_init() {
+  vcache_entry_cache = kmem_cache_create("vcache_entry", sizeof(struct vcache_entry), 0);
+}
+STATIC_INIT(vcache_static_init);
 
 static inline struct vcache_entry *vcache_entry_alloc(cstr_t path, hash_t hash, ventry_t *ve) {
-  struct vcache_entry *entry = kmallocz(sizeof(struct vcache_entry));
+  struct vcache_entry *entry = kmem_cache_allocz(vcache_entry_cache);
   entry->path = str_copy_cstr(path);
   entry->hash = hash;
   entry->ve = ve_getref(ve); // take a reference
@@ -67,7 +73,7 @@ static inline struct vcache_entry *vcache_entry_alloc(cstr_t path, hash_t hash,
 static inline void vcache_entry_free(struct vcache_entry *entry) {
   str_free(&entry->path);
   ve_release(&entry->ve);
-  kfree(entry);
+  kmem_cache_free(vcache_entry_cache, entry);
 }
 
 static inline struct vcache_dir *vcache_dir_alloc() {
@@ -14,12 +14,24 @@
 #define atomic_fetch_sub(ptr, val) \
   __sync_fetch_and_sub(ptr, val)
 
+#define atomic_fetch_or(ptr, val) \
+  __sync_fetch_and_or(ptr, val)
+
+#define atomic_fetch_and(ptr, val) \
+  __sync_fetch_and_and(ptr, val)
+
 #define atomic_bit_test_and_set(ptr, b) \
   __atomic_bit_test_and_set((void *)(ptr), b)
 
 #define atomic_bit_test_and_reset(ptr, b) \
   __atomic_bit_test_and_reset((void *)(ptr), b)
 
+#define atomic_cas(ptr, old, new) \
+  __sync_bool_compare_and_swap(ptr, old, new)
+
+#define atomic_xchg(ptr, val) \
+  __sync_lock_test_and_set(ptr, val)
+
 #define atomic_lock_test_and_set(ptr) \
   __sync_lock_test_and_set(ptr, 1)
 #define atomic_lock_test_and_reset(ptr) \
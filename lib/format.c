@@ -11,31 +11,6 @@
 
 //
 
-double fmod(double x, double y) {
-  return x - ((int) x / y) * y;
-}
-
-double pow(double x, double y) {
-  if (x == 0) return 0;
-  if (y == 0) return 1;
-
-  if (fmod(y, 1) == 0) {
-    double value = 0;
-    while (y) {
-      value += x;
-      if (y < 0) {
-        y++;
-      } else {
-        y--;
-      }
-    }
-    return value;
-  }
-  return -1;
-}
-
-//
-
 typedef enum {
   START,
   FLAGS,
@@ -78,22 +53,13 @@ typedef struct packed {
   uint32_t precision; // Precision of the value
 } fmt_options_t;
 
-typedef union double_raw {
-  double value;
-  struct {
-    uint64_t frac : 52;
-    uint64_t exp : 11;
-    uint64_t sign : 1;
-  };
-} double_raw_t;
-
 // Buffers
 #define BUFFER_SIZE 512
 #define TEMP_BUFFER_SIZE 128
 #define NTOA_BUFFER_SIZE 32
 #define FTOA_BUFFER_SIZE 32
 
-static const double pow10[] = {
+static const uint64_t pow10[] = {
   1, 10, 100, 1000, 10000, 100000,
   1000000, 10000000, 100000000, 1000000000
 };
@@ -258,109 +224,88 @@ int _ntoa(char *buf, unsigned long long value, int base, fmt_options_t *opts) {
   return index;
 }
 
-int _ftoa(char *buf, double value, fmt_options_t *opts) {
+// fixed-point number (value / unit) to decimal string
+int _fixtoa(char *buf, uint64_t value, uint64_t unit, fmt_options_t *opts) {
   char fnumber[FTOA_BUFFER_SIZE];
   char fprefix[16];
 
   int prefix_len = 0;
-  int padding_len = 0;
   int number_len = 0;
 
-  double_raw_t raw = { .value = value };
-
-  prefix_len = apply_prefix(fprefix, value < 0, opts);
-  if (raw.exp == 0 && raw.frac == 0) {
-    // signed zero
-    fnumber[0] = '0';
-    number_len = 1;
-  } else if (raw.exp == 0x7FF && raw.frac == 0) {
-    // infinity
-    const char *inf = opts->is_uppercase ? "INFINITY" : "infinity";
-    int len = strlen(inf);
-    memcpy(fnumber, inf, len);
-    number_len = len;
-  } else if (raw.exp == 0x7FF && raw.frac != 0) {
-    // NaN
-    const char *nan = opts->is_uppercase ? "NAN" : "nan";
-    int len = strlen(nan);
-    memcpy(fnumber, nan, len);
-    number_len = len;
-  } else {
-    double diff = 0.0;
-    size_t len = 0;
-    uint32_t prec = opts->precision;
+  prefix_len = apply_prefix(fprefix, false, opts);
+  size_t len = 0;
+  uint32_t prec = opts->precision;
 
-    // set default precision, if not set explicitly
-    if (!prec) {
-      prec = 6;
-    }
+  // set default precision, if not set explicitly
+  if (!prec) {
+    prec = 6;
+  }
 
-    // limit precision to 9, cause a prec >= 10 can lead to overflow errors
-    while ((len < FTOA_BUFFER_SIZE) && (prec > 9)) {
-      buf[len++] = '0';
-      prec--;
-    }
+  // limit precision to 9, cause a prec >= 10 can lead to overflow errors
+  if (prec > 9) {
+    prec = 9;
+  }
 
-    int whole = (int) value;
-    double tmp = (value - whole) * pow10[prec];
-    unsigned long long frac = (unsigned long long) tmp;
-    diff = tmp - (double) frac;
-
-    if (diff > 0.5) {
-      ++frac;
-      // handle rollover, e.g. case 0.99 with prec 1 is 1.0
-      if ((double) frac >= pow10[prec]) {
-        frac = 0;
-        ++whole;
-      }
-    } else if (diff < 0.5) {
-    } else if ((frac == 0) || (frac & 1)) {
-      // if halfway, round up if odd OR if last digit is 0
-      ++frac;
-    }
+  // long division one digit at a time so that rem * 10 never overflows
+  uint64_t whole = value / unit;
+  uint64_t rem = value % unit;
+  uint64_t frac = 0;
+  for (uint32_t i = 0; i < prec; i++) {
+    rem *= 10;
+    frac = (frac * 10) + (rem / unit);
+    rem %= unit;
+  }
 
-    unsigned int count = prec;
-    // do fractional part, as an unsigned number
-    while (len < FTOA_BUFFER_SIZE) {
-      --count;
-      fnumber[len++] = (char) (48 + (frac % 10));
-      if (!(frac /= 10)) {
-        break;
-      }
+  if (rem * 2 >= unit) {
+    ++frac;
+    // handle rollover, e.g. case 0.99 with prec 1 is 1.0
+    if (frac >= pow10[prec]) {
+      frac = 0;
+      ++whole;
     }
+  }
 
-    // add extra 0s
-    while ((len < FTOA_BUFFER_SIZE) && (count-- > 0U)) {
-      fnumber[len++] = '0';
+  unsigned int count = prec;
+  // do fractional part, as an unsigned number
+  while (len < FTOA_BUFFER_SIZE) {
+    --count;
+    fnumber[len++] = (char) (48 + (frac % 10));
+    if (!(frac /= 10)) {
+      break;
     }
+  }
 
-    if (len < FTOA_BUFFER_SIZE) {
-      // add decimal
-      fnumber[len++] = '.';
-    }
+  // add extra 0s
+  while ((len < FTOA_BUFFER_SIZE) && (count-- > 0U)) {
+    fnumber[len++] = '0';
+  }
 
-    // do whole part, number is reversed
-    while (len < FTOA_BUFFER_SIZE) {
-      fnumber[len++] = (char)(48 + (whole % 10));
-      if (!(whole /= 10)) {
-        break;
-      }
-    }
+  if (len < FTOA_BUFFER_SIZE) {
+    // add decimal
+    fnumber[len++] = '.';
+  }
 
-    unsigned width = opts->width;
-    // pad leading zeros
-    if (!opts->pad_right && opts->pad_zero) {
-      if (opts->width && (value < 0 || (opts->add_plus || opts->add_space))) {
-        width--;
-      }
-      while ((len < width) && (len < FTOA_BUFFER_SIZE)) {
-        fnumber[len++] = '0';
-      }
+  // do whole part, number is reversed
+  while (len < FTOA_BUFFER_SIZE) {
+    fnumber[len++] = (char)(48 + (whole % 10));
+    if (!(whole /= 10)) {
+      break;
     }
+  }
 
-    number_len = len;
+  unsigned width = opts->width;
+  // pad leading zeros
+  if (!opts->pad_right && opts->pad_zero) {
+    if (opts->width && (opts->add_plus || opts->add_space)) {
+      width--;
+    }
+    while ((len < width) && (len < FTOA_BUFFER_SIZE)) {
+      fnumber[len++] = '0';
+    }
   }
 
+  number_len = len;
+
   fnumber[number_len] = '\0';
   reverse(fnumber);
 
@@ -387,11 +332,11 @@ int _ntosza(char *buf, size_t value, fmt_options_t *opts) {
   bool use_decimal = false;
 
   unsigned long long num_u;
-  double num_d;
+  size_t unit;
   const char *suffix;
   if (value >= SIZE_1TB) {
     num_u = value / SIZE_1TB;
-    num_d = ((double) value) / SIZE_1TB;
+    unit = SIZE_1TB;
     if (opts->is_uppercase) {
       suffix = opts->alt_form ? "TB" : "T";
     } else {
@@ -399,7 +344,7 @@ int _ntosza(char *buf, size_t value, fmt_options_t *opts) {
     }
   } else if (value >= SIZE_1GB) {
     num_u = value / SIZE_1GB;
-    num_d = ((double) value) / SIZE_1GB;
+    unit = SIZE_1GB;
     if (opts->is_uppercase) {
       suffix = opts->alt_form ? "GB" : "G";
     } else {
@@ -411,7 +356,7 @@ int _ntosza(char *buf, size_t value, fmt_options_t *opts) {
     }
   } else if (value >= SIZE_1MB) {
     num_u = value / SIZE_1MB;
-    num_d = ((double) value) / SIZE_1MB;
+    unit = SIZE_1MB;
     if (opts->is_uppercase) {
       suffix = opts->alt_form ? "MB" : "M";
     } else {
@@ -423,7 +368,7 @@ int _ntosza(char *buf, size_t value, fmt_options_t *opts) {
     }
   } else if (value >= SIZE_1KB) {
     num_u = value / SIZE_1KB;
-    num_d = ((double) value) / SIZE_1KB;
+    unit = SIZE_1KB;
     if (opts->is_uppercase) {
       suffix = opts->alt_form ? "KB" : "K";
     } else {
@@ -435,7 +380,7 @@ int _ntosza(char *buf, size_t value, fmt_options_t *opts) {
     }
   } else {
     num_u = value;
-    num_d = (double) value;
+    unit = 1;
     if (opts->is_uppercase) {
       suffix = opts->alt_form ? "B" : "";
     } else {
@@ -455,7 +400,7 @@ int _ntosza(char *buf, size_t value, fmt_options_t *opts) {
     if (opts->width >= suffix_len) {
       opts->width -= suffix_len;
     }
-    number_len = _ftoa(number, num_d, opts);
+    number_len = _fixtoa(number, value, unit, opts);
   } else {
     number_len = ntoa_unsigned(number, num_u, 10, opts);
     number[number_len] = '\0';
@@ -522,9 +467,8 @@ int _atoi(const char *str, int base) {
   while (str[index]) {
     char ch = str[index];
     if (ch >= '0' && ch <= '9') {
-      int column = (int) len - (index + 1);
       int digit = char2digit(ch, 10);
-      value += digit * (int) pow(base, column);
+      value = (value * base) + digit;
     } else {
       return -1;
     }
@@ -739,17 +683,6 @@ int print_format(const char *format, char *str, size_t size, va_list args, bool
           format_len = _ntoa(buffer, value, base, &opts);
           break;
         }
-        case 'f':
-        case 'F': {
-          if (ch == 'F') {
-            opts.is_uppercase = true;
-          }
-
-          // double (in decimal notation)
-          double value = va_arg(valist, double);
-          format_len = _ftoa(buffer, value, &opts);
-          break;
-        }
         case 'c': {
           char value = va_arg(valist, int);
           buffer[0] = value;
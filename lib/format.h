@@ -59,8 +59,6 @@
  *   'u' - Unsigned decimal
  *   'x' - Hexadecimal (lowercase)
  *   'X' - Hexadecimal (uppercase)
- *   'f' - Floating point (lowercase)
- *   'F' - Floating point (uppercase)
  *   'c' - Character
  *   's' - String
  *   'T' - path_t path string
@@ -102,8 +102,7 @@ void *map_get_(map_base_t *map, char *key) {
 }
 
 void map_set_(map_base_t *map, char *key, void *value, size_t size) {
-  double lf = (double) (map->size + 1) / map->capacity;
-  if (lf > LOAD_FACTOR) {
+  if ((map->size + 1) * 100 > map->capacity * LOAD_FACTOR) {
     map_resize_(map, map->capacity * 2);
   }
 
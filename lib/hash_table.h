@@ -15,7 +15,7 @@
 #endif
 
 #ifndef LOAD_FACTOR
-#define LOAD_FACTOR 0.75
+#define LOAD_FACTOR 75 // percent
 #endif
 
 // Macros
@@ -38,7 +38,7 @@ typedef struct {
   hasher_t hasher;     // hash function
   size_t size;         // total number of items
   size_t capacity;     // number of buckets
-  double load_factor;  // acceptable load factor
+  uint32_t load_factor; // acceptable load factor (percent)
   map_entry_t **items; // map entries
 } map_base_t;
 
@@ -46,6 +46,17 @@ static inline uint64_t get_min(rb_tree_t *tree, rb_node_t *node) {
   return ((intvl_node_t *) node->data)->min;
 }
 
+static inline uint64_t get_gap(rb_tree_t *tree, rb_node_t *node) {
+  if (node == NULL || node == tree->nil || node->data == NULL) {
+    return 0;
+  }
+  return ((intvl_node_t *) node->data)->gap;
+}
+
+static inline uint64_t gap_between(uint64_t start, uint64_t end) {
+  return end > start ? end - start : 0;
+}
+
 //
 
 void recalculate_min_max(rb_tree_t *tree, rb_node_t *x) {
@@ -53,6 +64,16 @@ void recalculate_min_max(rb_tree_t *tree, rb_node_t *x) {
     intvl_node_t *xd = x->data;
     xd->max = max(xd->interval.end, max(get_max(tree, x->left), get_max(tree, x->right)));
     xd->min = min(xd->interval.start, min(get_min(tree, x->left), get_min(tree, x->right)));
+
+    // the largest hole between any two neighbouring intervals in the subtree
+    uint64_t gap = max(get_gap(tree, x->left), get_gap(tree, x->right));
+    if (x->left != tree->nil) {
+      gap = max(gap, gap_between(get_max(tree, x->left), xd->interval.start));
+    }
+    if (x->right != tree->nil) {
+      gap = max(gap, gap_between(xd->interval.end, get_min(tree, x->right)));
+    }
+    xd->gap = gap;
     x = x->parent;
   }
 }
@@ -63,6 +84,7 @@ void post_rotate_callback(rb_tree_t *tree, rb_node_t *x, rb_node_t *y) {
 
   yd->max = xd->max;
   yd->min = xd->min;
+  yd->gap = xd->gap;
   recalculate_min_max(tree, x);
 }
 
@@ -73,9 +95,9 @@ void post_insert_callback(rb_tree_t *tree, rb_node_t *z) {
 }
 
 void post_delete_callback(rb_tree_t *tree, rb_node_t *z, rb_node_t *x) {
-  if (z != tree->nil) {
-    _free(((intvl_node_t *) z->data)->data);
-  }
+  // x took over the values of the node it replaced and everything
+  // above it has lost an interval
+  recalculate_min_max(tree, x != tree->nil ? x : x->parent);
 }
 
 void replace_node_callback(rb_tree_t *tree, rb_node_t *u, rb_node_t *v) {
@@ -84,6 +106,7 @@ void replace_node_callback(rb_tree_t *tree, rb_node_t *u, rb_node_t *v) {
     intvl_node_t *vd = v->data;
     vd->max = ud->max;
     vd->min = ud->min;
+    vd->gap = ud->gap;
   }
 }
 
@@ -96,9 +119,12 @@ void duplicate_node_callback(rb_tree_t *tree, rb_tree_t *new_tree, rb_node_t *u,
     vd->interval = ud->interval;
     vd->min = ud->min;
     vd->max = ud->max;
+    vd->gap = ud->gap;
 
     if (ud->data && ud->events && ud->events->copy_data) {
       vd->data = ud->events->copy_data(ud->data);
+    } else {
+      vd->data = ud->data;
     }
     v->data = vd;
   }
@@ -217,12 +243,119 @@ void intvl_tree_insert(intvl_tree_t *tree, interval_t interval, void *data) {
   intvl_node_t *node_data = _malloc(sizeof(intvl_node_t));
   node_data->events = tree->events;
   node_data->interval = interval;
+  // a new node is always a leaf
+  node_data->min = interval.start;
+  node_data->max = interval.end;
+  node_data->gap = 0;
   node_data->data = data;
   rb_tree_insert(tree->tree, interval.start, node_data);
 }
 
 void intvl_tree_delete(intvl_tree_t *tree, interval_t interval) {
-  rb_tree_delete(tree->tree, interval.start);
+  // the caller owns the interval data
+  intvl_node_t *node_data = rb_tree_delete(tree->tree, interval.start);
+  _free(node_data);
+}
+
+//
+// Free Range Search
+//
+// Every node tracks the largest hole between neighbouring intervals within its
+// subtree. Subtrees whose largest hole is too small or which lie entirely outside
+// of the search bounds are skipped, so a fitting hole is found by visiting only a
+// logarithmic number of nodes. Holes which are big enough but cannot fit the
+// request once aligned are the only reason the search has to keep going.
+//
+
+/* returns the lowest (or highest) aligned start in [start, end) which fits size */
+static uint64_t fit_in_hole(uint64_t start, uint64_t end, interval_t bounds, uint64_t size, uint64_t alignment, bool reverse) {
+  start = max(start, bounds.start);
+  end = min(end, bounds.end);
+  if (end <= start || end - start < size) {
+    return UINT64_MAX;
+  }
+
+  uint64_t addr;
+  if (reverse) {
+    addr = align_down(end - size, alignment);
+    if (addr < start) {
+      return UINT64_MAX;
+    }
+  } else {
+    addr = align(start, alignment);
+    if (addr < start || addr > end - size) {
+      return UINT64_MAX;
+    }
+  }
+  return addr;
+}
+
+static uint64_t find_free_in_subtree(rb_tree_t *tree, rb_node_t *x, interval_t bounds, uint64_t size, uint64_t alignment, bool reverse) {
+  if (x == tree->nil || get_gap(tree, x) < size) {
+    return UINT64_MAX;
+  } else if (get_max(tree, x) <= bounds.start || get_min(tree, x) >= bounds.end) {
+    return UINT64_MAX;
+  }
+
+  // the holes are visited in address order (or reverse address order)
+  rb_node_t *first = reverse ? x->right : x->left;
+  rb_node_t *last = reverse ? x->left : x->right;
+  interval_t i = get_interval(tree, x);
+
+  uint64_t addr = find_free_in_subtree(tree, first, bounds, size, alignment, reverse);
+  if (addr != UINT64_MAX) {
+    return addr;
+  }
+
+  if (first != tree->nil) {
+    if (reverse) {
+      addr = fit_in_hole(i.end, get_min(tree, first), bounds, size, alignment, reverse);
+    } else {
+      addr = fit_in_hole(get_max(tree, first), i.start, bounds, size, alignment, reverse);
+    }
+    if (addr != UINT64_MAX) {
+      return addr;
+    }
+  }
+
+  if (last != tree->nil) {
+    if (reverse) {
+      addr = fit_in_hole(get_max(tree, last), i.start, bounds, size, alignment, reverse);
+    } else {
+      addr = fit_in_hole(i.end, get_min(tree, last), bounds, size, alignment, reverse);
+    }
+    if (addr != UINT64_MAX) {
+      return addr;
+    }
+  }
+
+  return find_free_in_subtree(tree, last, bounds, size, alignment, reverse);
+}
+
+uint64_t intvl_tree_find_free(intvl_tree_t *tree, interval_t bounds, uint64_t size, uint64_t alignment, bool reverse) {
+  rb_tree_t *rb = tree->tree;
+  if (rb->root == rb->nil) {
+    return fit_in_hole(bounds.start, bounds.end, bounds, size, alignment, reverse);
+  }
+
+  // the holes before the first and after the last interval are not part of any subtree
+  uint64_t lowest = get_min(rb, rb->root);
+  uint64_t highest = get_max(rb, rb->root);
+  uint64_t addr = reverse ?
+    fit_in_hole(highest, UINT64_MAX, bounds, size, alignment, reverse) :
+    fit_in_hole(0, lowest, bounds, size, alignment, reverse);
+  if (addr != UINT64_MAX) {
+    return addr;
+  }
+
+  addr = find_free_in_subtree(rb, rb->root, bounds, size, alignment, reverse);
+  if (addr != UINT64_MAX) {
+    return addr;
+  }
+
+  return reverse ?
+    fit_in_hole(0, lowest, bounds, size, alignment, reverse) :
+    fit_in_hole(highest, UINT64_MAX, bounds, size, alignment, reverse);
 }
 
 //
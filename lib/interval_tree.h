@@ -63,6 +63,7 @@ typedef struct {
   interval_t interval;
   uint64_t max;
   uint64_t min;
+  uint64_t gap; // largest hole between intervals in the subtree
   void *data;
 } intvl_node_t;
 
@@ -82,6 +83,14 @@ intvl_node_t *intvl_tree_find_closest(intvl_tree_t *tree, interval_t interval);
 void intvl_tree_insert(intvl_tree_t *tree, interval_t interval, void *data);
 void intvl_tree_delete(intvl_tree_t *tree, interval_t interval);
 
+/**
+ * Finds the lowest start address (or highest if reverse is set) of a hole
+ * within bounds that can hold an interval of the given size and alignment
+ * without overlapping any interval in the tree. The tree must not contain
+ * overlapping intervals. Returns UINT64_MAX if there is no such hole.
+ */
+uint64_t intvl_tree_find_free(intvl_tree_t *tree, interval_t bounds, uint64_t size, uint64_t alignment, bool reverse);
+
 intvl_iter_t *intvl_iter_tree(intvl_tree_t *tree);
 intvl_node_t *intvl_iter_next(intvl_iter_t *iter);
 
@@ -31,6 +31,13 @@ static inline rb_node_t *minimum(rb_tree_t *tree, rb_node_t *x) {
   return x;
 }
 
+static inline rb_node_t *maximum(rb_tree_t *tree, rb_node_t *x) {
+  while (x->right != tree->nil) {
+    x = x->right;
+  }
+  return x;
+}
+
 static inline rb_node_t *get_side(rb_node_t *node, bool left) {
   if (left) {
     return node->left;
@@ -465,23 +472,24 @@ void *rb_tree_delete(rb_tree_t *tree, uint64_t key) {
 }
 
 void *rb_tree_delete_node(rb_tree_t *tree, rb_node_t *node) {
+  rb_tree_remove_node(tree, node);
+  void *data = node->data;
+  _free(node);
+  return data;
+}
+
+void rb_tree_remove_node(rb_tree_t *tree, rb_node_t *node) {
+  // unlinks the node without freeing it
   delete_node(tree, node);
   if (tree->nodes == 1) {
     tree->min = tree->nil;
     tree->max = tree->nil;
   } else if (node == tree->min) {
-    if (tree->nodes == 2) {
-      tree->min = tree->max;
-    } else {
-      tree->min = node->parent;
-    }
+    tree->min = minimum(tree, tree->root);
   } else if (node == tree->max) {
-    tree->max = node->parent;
+    tree->max = maximum(tree, tree->root);
   }
   tree->nodes--;
-  void *data = node->data;
-  _free(node);
-  return data;
 }
 
 // Iterators